@@ -0,0 +1,178 @@
+#include "chacha20.h"
+
+#include <string.h>
+
+// ChaCha20 as laid out in RFC 7539. The state is sixteen 32-bit words: four constants, the
+// 256-bit key, a block counter and a 96-bit nonce.
+
+// One vector holds the same state word of CHACHA20_LANES blocks
+typedef uint32_t lanes __attribute__((vector_size(4 * CHACHA20_LANES)));
+
+static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+  a += b; d ^= a; d = ROTL(d, 16); \
+  c += d; b ^= c; b = ROTL(b, 12); \
+  a += b; d ^= a; d = ROTL(d, 8);  \
+  c += d; b ^= c; b = ROTL(b, 7);
+
+// Keystream is defined as little-endian bytes whatever the host order
+static void store32_le(uint8_t *out, uint32_t value)
+{
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+}
+
+// Produce the single block at counter. Used for key derivation and the self check.
+void chacha20_block(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter,
+                    uint8_t out[CHACHA20_BLOCK])
+{
+  uint32_t state[16];
+  uint32_t x[16];
+  int i;
+
+  memcpy(state, sigma, sizeof(sigma));
+  memcpy(state + 4, key, 8 * sizeof(uint32_t));
+  state[12] = counter;
+  memcpy(state + 13, nonce, 3 * sizeof(uint32_t));
+  memcpy(x, state, sizeof(x));
+
+  for (i = 0; i < 10; i++)
+  {
+    QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+    QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+    QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+    QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+    QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+    QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+    QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+    QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+  }
+
+  for (i = 0; i < 16; i++)
+  {
+    store32_le(out + 4 * i, x[i] + state[i]);
+  }
+}
+
+// Produce CHACHA20_LANES consecutive blocks starting at counter, one block per vector lane.
+// Built for each vector width and the widest the CPU supports is picked at load time.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void chacha20_blocks(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter,
+                     uint8_t out[CHACHA20_BLOCK * CHACHA20_LANES])
+{
+  lanes state[16];
+  lanes x[16];
+  int i;
+  int lane;
+
+  for (i = 0; i < 4; i++)
+  {
+    state[i] = (lanes){0} + sigma[i];
+  }
+  for (i = 0; i < 8; i++)
+  {
+    state[4 + i] = (lanes){0} + key[i];
+  }
+  for (lane = 0; lane < CHACHA20_LANES; lane++)
+  {
+    state[12][lane] = counter + lane;
+  }
+  for (i = 0; i < 3; i++)
+  {
+    state[13 + i] = (lanes){0} + nonce[i];
+  }
+  memcpy(x, state, sizeof(x));
+
+  for (i = 0; i < 10; i++)
+  {
+    QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+    QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+    QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+    QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+    QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+    QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+    QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+    QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+  }
+
+  for (i = 0; i < 16; i++)
+  {
+    x[i] += state[i];
+    for (lane = 0; lane < CHACHA20_LANES; lane++)
+    {
+      store32_le(out + lane * CHACHA20_BLOCK + 4 * i, x[i][lane]);
+    }
+  }
+}
+
+// Encrypt or decrypt len bytes of buf in place with the keystream starting at block counter
+void chacha20_xor(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter,
+                  uint8_t *buf, size_t len)
+{
+  uint8_t stream[CHACHA20_BLOCK * CHACHA20_LANES];
+  size_t i;
+
+  while (len > 0)
+  {
+    size_t chunk = (len < sizeof(stream)) ? len : sizeof(stream);
+    chacha20_blocks(key, nonce, counter, stream);
+
+    for (i = 0; i + 8 <= chunk; i += 8)
+    {
+      uint64_t word;
+      uint64_t pad;
+      memcpy(&word, buf + i, 8);
+      memcpy(&pad, stream + i, 8);
+      word ^= pad;
+      memcpy(buf + i, &word, 8);
+    }
+    for (; i < chunk; i++)
+    {
+      buf[i] ^= stream[i];
+    }
+
+    buf += chunk;
+    len -= chunk;
+    counter += CHACHA20_LANES;
+  }
+}
+
+// Check the block function against the test vector in RFC 7539 section 2.3.2 and the
+// vector lanes against the block function. Returns 1 if everything matches.
+int chacha20_self_check()
+{
+  static const uint8_t expect[16] = {0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+                                     0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4};
+  uint32_t key[8];
+  uint32_t nonce[3] = {0x09000000, 0x4a000000, 0x00000000};
+  uint8_t block[CHACHA20_BLOCK];
+  uint8_t blocks[CHACHA20_BLOCK * CHACHA20_LANES];
+  int i;
+
+  for (i = 0; i < 8; i++)
+  {
+    key[i] = (4 * i) | (4 * i + 1) << 8 | (4 * i + 2) << 16 | (uint32_t)(4 * i + 3) << 24;
+  }
+
+  chacha20_block(key, nonce, 1, block);
+  if (memcmp(block, expect, sizeof(expect)) != 0)
+  {
+    return 0;
+  }
+
+  chacha20_blocks(key, nonce, 1, blocks);
+  for (i = 0; i < CHACHA20_LANES; i++)
+  {
+    chacha20_block(key, nonce, 1 + i, block);
+    if (memcmp(block, blocks + i * CHACHA20_BLOCK, CHACHA20_BLOCK) != 0)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
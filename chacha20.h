@@ -0,0 +1,19 @@
+#ifndef _CHACHA20_H_
+#define _CHACHA20_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHACHA20_BLOCK 64 // Bytes of keystream per ChaCha20 block
+
+#define CHACHA20_LANES 8 // Blocks worked on side by side, one per vector lane
+
+void chacha20_block(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter,
+                    uint8_t out[CHACHA20_BLOCK]);
+void chacha20_blocks(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter,
+                     uint8_t out[CHACHA20_BLOCK * CHACHA20_LANES]);
+void chacha20_xor(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter,
+                  uint8_t *buf, size_t len);
+int chacha20_self_check();
+
+#endif
@@ -0,0 +1,1034 @@
+#include "mfs.h"
+
+// LIBRARY
+// The calls in libmfs.h on top of the image code in mfs.c. Nothing here prints, every
+// failure comes back as an MFS_E code.
+
+pthread_once_t library_once = PTHREAD_ONCE_INIT;
+
+// Pick the XOR kernel, once per process
+void library_init()
+{
+  select_xor_kernel();
+}
+
+// A fresh context for an image about to be created or opened, NULL if out of memory
+struct mfs *new_context()
+{
+  pthread_once(&library_once, library_init);
+
+  struct mfs *fs = calloc(1, sizeof(struct mfs));
+  if (fs == NULL)
+  {
+    return NULL;
+  }
+  fs->journal_fd = -1;
+
+  // savefs and journal commits wait for the calls in flight, so they must not be starved
+  // by a steady stream of new ones
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&fs->image_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  pthread_rwlock_init(&fs->dir_lock, NULL);
+  for (int i = 0; i < INODE_LOCKS; i++)
+  {
+    pthread_rwlock_init(inode_lock(fs, i), NULL);
+  }
+  pthread_mutex_init(&fs->alloc_lock, NULL);
+  pthread_mutex_init(&fs->handle_lock, NULL);
+  pthread_mutex_init(&fs->cache_lock, NULL);
+  pthread_mutex_init(&fs->inflate_lock, NULL);
+  return fs;
+}
+
+void free_context(struct mfs *fs)
+{
+  pthread_rwlock_destroy(&fs->image_lock);
+  pthread_rwlock_destroy(&fs->dir_lock);
+  for (int i = 0; i < INODE_LOCKS; i++)
+  {
+    pthread_rwlock_destroy(inode_lock(fs, i));
+  }
+  pthread_mutex_destroy(&fs->alloc_lock);
+  pthread_mutex_destroy(&fs->handle_lock);
+  pthread_mutex_destroy(&fs->cache_lock);
+  pthread_mutex_destroy(&fs->inflate_lock);
+  free_geometry(fs);
+  free(fs);
+}
+
+pthread_rwlock_t *inode_lock(struct mfs *fs, int32_t inode_index)
+{
+  return &fs->inode_locks[inode_index % INODE_LOCKS];
+}
+
+const char *mfs_strerror(int err)
+{
+  switch (err)
+  {
+    case MFS_OK:
+      return "Success";
+    case MFS_ENOTOPEN:
+      return "Disk image is not open";
+    case MFS_EBUSY:
+      return "Already in use";
+    case MFS_EIO:
+      return "Input/output error";
+    case MFS_EBADIMAGE:
+      return "File is not a valid image file";
+    case MFS_ENOENT:
+      return "File not found";
+    case MFS_EEXIST:
+      return "File already exists";
+    case MFS_ENAMETOOLONG:
+      return "Filename is too long";
+    case MFS_EFBIG:
+      return "File is too large";
+    case MFS_ENOSPC:
+      return "Not enough disk space";
+    case MFS_EFRAGMENTED:
+      return "Not enough contiguous disk space";
+    case MFS_ENFILE:
+      return "No free directory entry or inode";
+    case MFS_EBADF:
+      return "Bad file handle";
+    case MFS_EROFS:
+      return "File or image is read-only";
+    case MFS_EKEY:
+      return "File is encrypted with a different key";
+    case MFS_EINVAL:
+      return "Invalid argument";
+    case MFS_ENOMEM:
+      return "Out of memory";
+    case MFS_EMFILE:
+      return "Too many open handles";
+  }
+  return "Unknown error";
+}
+
+int mfs_create(const char *image, int flags, mfs_t **fs)
+{
+  return mfs_create_geometry(image, flags, NULL, fs);
+}
+
+int mfs_create_geometry(const char *image, int flags, const struct mfs_geometry *geometry,
+                        mfs_t **fs)
+{
+  uint32_t block_size = DEFAULT_BLOCK_SIZE;
+  uint32_t num_blocks = DEFAULT_NUM_BLOCKS;
+  uint32_t num_files = DEFAULT_NUM_FILES;
+  uint32_t pack_size = 0;
+  uint32_t features = 0;
+  if (geometry != NULL)
+  {
+    block_size = geometry->block_size ? geometry->block_size : block_size;
+    num_blocks = geometry->num_blocks ? geometry->num_blocks : num_blocks;
+    num_files = geometry->num_files ? geometry->num_files : num_files;
+    pack_size = geometry->pack_size;
+    features |= (geometry->flags & MFS_COMPRESS) ? SUPERBLOCK_COMPRESS : 0;
+    features |= (geometry->flags & MFS_DEDUP) ? SUPERBLOCK_DEDUP : 0;
+  }
+  if (pack_size == 0)
+  {
+    pack_size = block_size / 2;
+  }
+  else if (pack_size == MFS_NO_PACKING)
+  {
+    pack_size = 0;
+  }
+
+  // The bounds are checked before planning so the sizes in it can't overflow
+  struct superblock layout;
+  if (num_blocks > MAX_NUM_BLOCKS || num_files > MAX_NUM_FILES)
+  {
+    return MFS_EINVAL;
+  }
+  plan_geometry(&layout, block_size, num_blocks, num_files, pack_size, features);
+  if (check_geometry(&layout) == -1)
+  {
+    return MFS_EINVAL;
+  }
+
+  struct mfs *created = new_context();
+  if (created == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+
+  int ret = createfs(created, (char *)image, flags & MFS_MAP, &layout);
+  if (ret != MFS_OK)
+  {
+    if (created->image_open)
+    {
+      closefs(created);
+    }
+    free_context(created);
+    return ret;
+  }
+
+  *fs = created;
+  return MFS_OK;
+}
+
+int mfs_mount(const char *image, int flags, mfs_t **fs)
+{
+  struct mfs *opened = new_context();
+  if (opened == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+
+  int ret = openfs(opened, (char *)image, flags & MFS_MAP);
+  if (ret != MFS_OK)
+  {
+    free_context(opened);
+    return ret;
+  }
+
+  *fs = opened;
+  return MFS_OK;
+}
+
+int mfs_sync(mfs_t *fs)
+{
+  if (fs == NULL || !fs->image_open)
+  {
+    return MFS_ENOTOPEN;
+  }
+
+  pthread_rwlock_wrlock(&fs->image_lock);
+  int ret = savefs(fs);
+  pthread_rwlock_unlock(&fs->image_lock);
+  return ret;
+}
+
+// Handles still open are dropped along with the image, and fs is freed. No other call may
+// be using fs at the same time.
+int mfs_unmount(mfs_t *fs)
+{
+  if (fs == NULL || !fs->image_open)
+  {
+    return MFS_ENOTOPEN;
+  }
+
+  pthread_rwlock_wrlock(&fs->image_lock);
+  int ret = closefs(fs);
+  pthread_rwlock_unlock(&fs->image_lock);
+  free_context(fs);
+  return ret;
+}
+
+// The open file behind handle if it was opened with access, NULL otherwise
+struct openFile *handle_file(mfs_t *fs, int handle, int access)
+{
+  if (fs == NULL || !fs->image_open || handle < 0 || handle >= MFS_MAX_HANDLES)
+  {
+    return NULL;
+  }
+  if ((fs->files[handle].flags & access) == 0)
+  {
+    return NULL;
+  }
+  return &fs->files[handle];
+}
+
+// Forget where handles open on a file got to, after its extents were rearranged
+void reset_cursors(struct mfs *fs, int32_t inode_index)
+{
+  int i;
+
+  pthread_mutex_lock(&fs->handle_lock);
+  for (i = 0; i < MFS_MAX_HANDLES; i++)
+  {
+    if (fs->files[i].flags != 0 && fs->files[i].inode == inode_index)
+    {
+      __atomic_store_n(&fs->files[i].cursor, 0, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&fs->handle_lock);
+}
+
+// Give back every block of a file, leaving it empty. An encrypted file starts a new
+// generation, since what it held is still on disk in the blocks it gave back. Returns MFS_OK,
+// or MFS_EIO if no generation could be drawn, leaving the file as it was.
+int truncate_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+
+  if ((file_inode->attribute & ENCRYPTED) && new_generation(fs, inode_index) == -1)
+  {
+    return MFS_EIO;
+  }
+  if (is_packed(file_inode))
+  {
+    free_file_blocks(fs, file_inode, 1);
+    memset(file_inode->extents, 0, sizeof(file_inode->extents));
+  }
+  else
+  {
+    truncate_extents(fs, file_inode, 0);
+  }
+  file_inode->file_size = 0;
+  file_inode->attribute &= ~COMPRESSED;
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  reset_cursors(fs, inode_index);
+  return MFS_OK;
+}
+
+// Add blocks to a file until it holds need of them. The new blocks read back as zeros, the
+// same as the unused end of a file's last block. Both are plain zeros in an encrypted file
+// too, so none of its keystream past the end is ever on disk. Returns MFS_OK or an MFS_E code,
+// in which case the file is left as it was.
+int grow_file(struct mfs *fs, int32_t inode_index, int32_t need)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  int32_t old_blocks = file_inode->num_blocks;
+  int32_t i;
+
+  if ((uint64_t)(need - old_blocks) * fs->block_size > df(fs))
+  {
+    return MFS_ENOSPC;
+  }
+
+  while (file_inode->num_blocks < need)
+  {
+    int32_t length;
+    int32_t start = claim_run(fs, need - file_inode->num_blocks, &length);
+    if (start != -1 && append_extent(fs, file_inode, start, length) == -1)
+    {
+      set_free_run(fs, start, length, 1);
+      start = -1;
+    }
+    if (start == -1)
+    {
+      truncate_extents(fs, file_inode, old_blocks);
+      return MFS_EFRAGMENTED;
+    }
+  }
+
+  // The new blocks are the end of the last extents, so those are walked back from the end
+  struct extentPath path = {0};
+  int32_t extent_end = need;
+  for (i = file_inode->num_extents - 1; extent_end > old_blocks; i--)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (ext == NULL)
+    {
+      truncate_extents(fs, file_inode, old_blocks);
+      return MFS_EIO;
+    }
+    int32_t extent_start = extent_end - ext->length;
+    int32_t index = (extent_start > old_blocks) ? extent_start : old_blocks;
+    for (; index < extent_end; index++)
+    {
+      uint8_t *block = cache_blocks(fs, ext->start + (index - extent_start), 1);
+      if (block == NULL)
+      {
+        truncate_extents(fs, file_inode, old_blocks);
+        return MFS_EIO;
+      }
+      memset(block, 0, fs->block_size);
+      mark_dirty_range(fs, block, fs->block_size);
+    }
+    extent_end = extent_start;
+  }
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  return MFS_OK;
+}
+
+// Move an encrypted file to a new generation and encrypt what it holds again under it, so
+// bytes written over it don't reuse keystream already on disk. Like inflate_file, it is copied
+// into new blocks and the old ones are freed once it all is, so a crash before the next commit
+// still finds it under the old generation. Returns MFS_OK or an MFS_E code, in which case the
+// file is left as it was.
+int rekey_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  struct inode before = *file_inode;
+  uint32_t size = file_inode->file_size;
+  uint8_t *buf = malloc(READ_CHUNK);
+  if (buf == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+
+  memset(file_inode->extents, 0, sizeof(file_inode->extents));
+  file_inode->num_extents = 0;
+  file_inode->num_blocks = 0;
+  int ret = grow_file(fs, inode_index, before.num_blocks);
+  if (ret == MFS_OK && new_generation(fs, inode_index) == -1)
+  {
+    truncate_extents(fs, file_inode, 0);
+    ret = MFS_EIO;
+  }
+  if (ret != MFS_OK)
+  {
+    *file_inode = before;
+    free(buf);
+    return ret;
+  }
+
+  // only the file's own bytes are encrypted, the rest of its last block stays plain zeros
+  uint32_t generation = file_inode->generation;
+  uint64_t old_cursor = 0;
+  uint64_t new_cursor = 0;
+  uint32_t offset;
+  for (offset = 0; offset < size && ret == MFS_OK; offset += READ_CHUNK)
+  {
+    uint32_t bytes = (size - offset < READ_CHUNK) ? size - offset : READ_CHUNK;
+    if (copy_stored(fs, &before, offset, buf, bytes, 0, &old_cursor) == -1)
+    {
+      ret = MFS_EIO;
+      break;
+    }
+    file_inode->generation = before.generation;
+    crypt_range(fs, inode_index, offset, buf, bytes);
+    file_inode->generation = generation;
+    crypt_range(fs, inode_index, offset, buf, bytes);
+    if (copy_stored(fs, file_inode, offset, buf, bytes, 1, &new_cursor) == -1)
+    {
+      ret = MFS_EIO;
+    }
+  }
+  free(buf);
+
+  if (ret != MFS_OK)
+  {
+    truncate_extents(fs, file_inode, 0);
+    *file_inode = before;
+    return ret;
+  }
+  free_file_blocks(fs, &before, 1);
+  reset_cursors(fs, inode_index);
+  return MFS_OK;
+}
+
+// Pack a file written through a handle if it is small enough. It has a single block then, and
+// its bytes are moved as they are stored since encryption only depends on their offset.
+// Returns MFS_OK, or MFS_ENOSPC if there was no room for a tail block or MFS_EIO if a block
+// couldn't be read in or a new tail block given a generation, leaving it unpacked.
+int pack_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  uint32_t size = file_inode->file_size;
+  if (size == 0 || size > fs->pack_size || is_packed(file_inode))
+  {
+    return MFS_OK;
+  }
+
+  struct inode before = *file_inode;
+  uint8_t *stored = cache_blocks(fs, file_inode->extents[0].start, 1);
+  if (stored == NULL)
+  {
+    return MFS_EIO;
+  }
+  int ret = pack_reserve(fs, file_inode, size);
+  if (ret != MFS_OK)
+  {
+    *file_inode = before;
+    return ret;
+  }
+  file_inode->num_extents = 0;
+  file_inode->num_blocks = 0;
+  memcpy(packed_data(fs, file_inode), stored, size);
+  mark_packed_dirty(fs, file_inode);
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  free_file_blocks(fs, &before, 1);
+  reset_cursors(fs, inode_index);
+  return MFS_OK;
+}
+
+// Give a packed file a block of its own again so it can be written in place. Returns MFS_OK
+// or an MFS_E code, in which case the file stays packed.
+int unpack_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  struct inode before = *file_inode;
+  uint32_t size = file_inode->file_size;
+
+  uint8_t *packed = packed_data(fs, file_inode);
+  if (packed == NULL)
+  {
+    return MFS_EIO;
+  }
+  uint8_t *stored = malloc(size);
+  if (stored == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+  memcpy(stored, packed, size);
+
+  // the new block is zeroed, and encrypted if the file is, before the bytes go back in
+  memset(file_inode->extents, 0, sizeof(file_inode->extents));
+  int ret = grow_file(fs, inode_index, (size + fs->block_size - 1) / fs->block_size);
+  if (ret != MFS_OK)
+  {
+    *file_inode = before;
+    free(stored);
+    return ret;
+  }
+  // grow_file just zeroed the block, so it is cached
+  uint8_t *block = block_data(fs, file_inode->extents[0].start);
+  memcpy(block, stored, size);
+  mark_dirty_range(fs, block, size);
+  free(stored);
+
+  free_file_blocks(fs, &before, 1);
+  reset_cursors(fs, inode_index);
+  return MFS_OK;
+}
+
+// Copy len bytes at offset in a file out to buf, or with write in from buf. The range must
+// lie inside the file's blocks. The extents are walked once, starting from cursor when the
+// range doesn't start before it, and cursor is left at the last extent copied so the next
+// call in sequence starts there. An encrypted file has its keystream made READ_CHUNK bytes
+// at a time. Returns MFS_OK, MFS_ENOMEM or MFS_EIO if a compressed file is damaged or the
+// blocks couldn't be read in.
+int copy_range(struct mfs *fs, int32_t inode_index, uint8_t *buf, uint32_t offset, uint32_t len,
+               int write, uint64_t *cursor)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  struct extentPath path = {0};
+  int encrypted = file_inode->attribute & ENCRYPTED;
+  uint32_t end = offset + len;
+
+  // a packed file is only ever read, it is unpacked before being written
+  if (is_packed(file_inode))
+  {
+    uint8_t *packed = packed_data(fs, file_inode);
+    if (packed == NULL)
+    {
+      return MFS_EIO;
+    }
+    uint8_t *plain = malloc(end);
+    if (plain == NULL)
+    {
+      return MFS_ENOMEM;
+    }
+    memcpy(plain, packed, end);
+    if (encrypted)
+    {
+      crypt_range(fs, inode_index, 0, plain, end);
+    }
+    memcpy(buf, plain + offset, len);
+    free(plain);
+    return MFS_OK;
+  }
+
+  // so is a compressed one, it is inflated first
+  if (file_inode->attribute & COMPRESSED)
+  {
+    return read_compressed(fs, inode_index, buf, offset, len, cursor);
+  }
+
+  // the cursor holds the extent in its top half and the offset it starts at in the bottom
+  uint64_t hint = __atomic_load_n(cursor, __ATOMIC_RELAXED);
+  int32_t i = hint >> 32;
+  uint32_t extent_offset = (uint32_t)hint;
+  if (i >= file_inode->num_extents || extent_offset > offset)
+  {
+    i = 0;
+    extent_offset = 0;
+  }
+
+  // the keystream is only addressable in whole ChaCha20 blocks, so it may start up to one
+  // of them early
+  uint8_t *stream = encrypted ? malloc(READ_CHUNK + CHACHA20_BLOCK) : NULL;
+  if (encrypted && stream == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+
+  int ret = MFS_OK;
+  for (; i < file_inode->num_extents && extent_offset < end && ret == MFS_OK; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (ext == NULL)
+    {
+      ret = MFS_EIO;
+      break;
+    }
+    uint32_t extent_bytes = (uint32_t)ext->length * fs->block_size;
+    uint32_t from = (offset > extent_offset) ? offset : extent_offset;
+    uint32_t to = (end < extent_offset + extent_bytes) ? end : extent_offset + extent_bytes;
+
+    while (from < to)
+    {
+      size_t bytes = (to - from < READ_CHUNK) ? to - from : READ_CHUNK;
+      int32_t block = ext->start + (from - extent_offset) / fs->block_size;
+      int32_t blocks = (from - extent_offset + bytes - 1) / fs->block_size + ext->start - block + 1;
+      uint8_t *disk = cache_blocks(fs, block, blocks);
+      if (disk == NULL)
+      {
+        ret = MFS_EIO;
+        break;
+      }
+      disk += (from - extent_offset) % fs->block_size;
+      uint8_t *user = buf + (from - offset);
+
+      if (encrypted)
+      {
+        size_t lead = from % CHACHA20_BLOCK;
+        size_t j;
+        memset(stream, 0, lead + bytes);
+        crypt_range(fs, inode_index, from - lead, stream, lead + bytes);
+        for (j = 0; j < bytes; j++)
+        {
+          if (write)
+          {
+            disk[j] = user[j] ^ stream[lead + j];
+          }
+          else
+          {
+            user[j] = disk[j] ^ stream[lead + j];
+          }
+        }
+      }
+      else if (write)
+      {
+        memcpy(disk, user, bytes);
+      }
+      else
+      {
+        memcpy(user, disk, bytes);
+      }
+
+      if (write)
+      {
+        mark_dirty_range(fs, disk, bytes);
+      }
+      from += bytes;
+    }
+    if (to > offset)
+    {
+      hint = ((uint64_t)i << 32) | extent_offset;
+    }
+    extent_offset += extent_bytes;
+  }
+  __atomic_store_n(cursor, hint, __ATOMIC_RELAXED);
+
+  free(stream);
+  return ret;
+}
+
+// Write encrypted zeros into an encrypted file from offset up to end, which must lie inside
+// its blocks, so a write that leaves a gap past the end uses up the keystream over it too.
+// Returns MFS_OK or an MFS_E code like copy_range.
+int zero_range(struct mfs *fs, int32_t inode_index, uint32_t offset, uint32_t end,
+               uint64_t *cursor)
+{
+  uint8_t *zeros = calloc(1, READ_CHUNK);
+  if (zeros == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+  int ret = MFS_OK;
+  while (offset < end && ret == MFS_OK)
+  {
+    uint32_t bytes = (end - offset < READ_CHUNK) ? end - offset : READ_CHUNK;
+    ret = copy_range(fs, inode_index, zeros, offset, bytes, 1, cursor);
+    offset += bytes;
+  }
+  free(zeros);
+  return ret;
+}
+
+// The directory lock is held until the handle is in the table, so a file can't be unlinked
+// between being found and being opened
+int mfs_open(mfs_t *fs, const char *name, int flags)
+{
+  if (fs == NULL || !fs->image_open)
+  {
+    return MFS_ENOTOPEN;
+  }
+  if (name == NULL || (flags & (MFS_READ | MFS_WRITE)) == 0)
+  {
+    return MFS_EINVAL;
+  }
+  if ((flags & (MFS_CREATE | MFS_TRUNCATE)) && !(flags & MFS_WRITE))
+  {
+    return MFS_EINVAL;
+  }
+  if ((flags & MFS_WRITE) && fs->read_only)
+  {
+    return MFS_EROFS;
+  }
+
+  pthread_rwlock_rdlock(&fs->image_lock);
+  if (flags & MFS_CREATE)
+  {
+    pthread_rwlock_wrlock(&fs->dir_lock);
+  }
+  else
+  {
+    pthread_rwlock_rdlock(&fs->dir_lock);
+  }
+
+  int ret = MFS_OK;
+  int32_t entry = lookup(fs, (char *)name, 0);
+  if (entry == -1 && (flags & MFS_CREATE))
+  {
+    ret = reserve_file(fs, (char *)name, 0);
+    entry = lookup(fs, (char *)name, 0);
+  }
+  else if (entry == -1)
+  {
+    ret = MFS_ENOENT;
+  }
+
+  int32_t inode_index = (entry == -1) ? -1 : fs->directory[entry].inode;
+  if (ret >= 0)
+  {
+    struct inode *file_inode = &fs->inodes[inode_index];
+    if ((file_inode->attribute & ENCRYPTED) && !key_matches(fs, inode_index))
+    {
+      ret = MFS_EKEY;
+    }
+    else if ((flags & MFS_WRITE) && (file_inode->attribute & READONLY))
+    {
+      ret = MFS_EROFS;
+    }
+  }
+
+  int handle = MFS_EMFILE;
+  if (ret >= 0)
+  {
+    pthread_mutex_lock(&fs->handle_lock);
+    for (handle = 0; handle < MFS_MAX_HANDLES; handle++)
+    {
+      if (fs->files[handle].flags == 0)
+      {
+        fs->files[handle].entry = entry;
+        fs->files[handle].inode = inode_index;
+        fs->files[handle].flags = flags & (MFS_READ | MFS_WRITE);
+        fs->files[handle].written = (flags & (MFS_CREATE | MFS_TRUNCATE)) != 0;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&fs->handle_lock);
+    ret = (handle == MFS_MAX_HANDLES) ? MFS_EMFILE : handle;
+  }
+
+  if (ret >= 0 && (flags & MFS_TRUNCATE))
+  {
+    pthread_rwlock_wrlock(inode_lock(fs, inode_index));
+    int error = truncate_file(fs, inode_index);
+    pthread_rwlock_unlock(inode_lock(fs, inode_index));
+    if (error != MFS_OK)
+    {
+      pthread_mutex_lock(&fs->handle_lock);
+      memset(&fs->files[ret], 0, sizeof(struct openFile));
+      pthread_mutex_unlock(&fs->handle_lock);
+      ret = error;
+    }
+  }
+
+  pthread_rwlock_unlock(&fs->dir_lock);
+  pthread_rwlock_unlock(&fs->image_lock);
+  return ret;
+}
+
+// Closing a handle that changed its file commits the change to the journal
+int mfs_close(mfs_t *fs, int handle)
+{
+  struct openFile *file = handle_file(fs, handle, MFS_READ | MFS_WRITE);
+  if (file == NULL)
+  {
+    return MFS_EBADF;
+  }
+
+  // A small file written through the handle is packed before its changes are committed
+  if (file->written && fs->pack_size > 0)
+  {
+    pthread_rwlock_rdlock(&fs->image_lock);
+    pthread_rwlock_wrlock(inode_lock(fs, file->inode));
+    pack_file(fs, file->inode);
+    pthread_rwlock_unlock(inode_lock(fs, file->inode));
+    pthread_rwlock_unlock(&fs->image_lock);
+  }
+
+  // The block cache is trimmed back to size while nothing else can be using it
+  int commit = file->written && !defer_savefs;
+  if (commit || fs->frames_loaded > fs->cache_frames)
+  {
+    pthread_rwlock_wrlock(&fs->image_lock);
+    if (commit)
+    {
+      journal_commit(fs);
+    }
+    cache_trim(fs);
+    pthread_rwlock_unlock(&fs->image_lock);
+  }
+
+  pthread_mutex_lock(&fs->handle_lock);
+  memset(file, 0, sizeof(struct openFile));
+  pthread_mutex_unlock(&fs->handle_lock);
+  return MFS_OK;
+}
+
+// Any number of threads can read, the same file or different ones, while others write
+// other files
+ssize_t mfs_pread(mfs_t *fs, int handle, void *buf, size_t len, uint32_t offset)
+{
+  struct openFile *file = handle_file(fs, handle, MFS_READ);
+  if (file == NULL)
+  {
+    return MFS_EBADF;
+  }
+
+  pthread_rwlock_rdlock(&fs->image_lock);
+  pthread_rwlock_rdlock(inode_lock(fs, file->inode));
+
+  struct inode *file_inode = &fs->inodes[file->inode];
+  ssize_t ret = 0;
+  if (offset < file_inode->file_size)
+  {
+    if (len > file_inode->file_size - offset)
+    {
+      len = file_inode->file_size - offset;
+    }
+    ret = copy_range(fs, file->inode, buf, offset, len, 0, &file->cursor);
+    if (ret == MFS_OK)
+    {
+      ret = len;
+    }
+  }
+
+  pthread_rwlock_unlock(inode_lock(fs, file->inode));
+  pthread_rwlock_unlock(&fs->image_lock);
+  return ret;
+}
+
+ssize_t mfs_pwrite(mfs_t *fs, int handle, const void *buf, size_t len, uint32_t offset)
+{
+  struct openFile *file = handle_file(fs, handle, MFS_WRITE);
+  if (file == NULL)
+  {
+    return MFS_EBADF;
+  }
+  if (len == 0)
+  {
+    return 0;
+  }
+  if (offset > MAX_FILE_SIZE || len > MAX_FILE_SIZE - offset)
+  {
+    return MFS_EFBIG;
+  }
+
+  pthread_rwlock_rdlock(&fs->image_lock);
+  pthread_rwlock_wrlock(inode_lock(fs, file->inode));
+
+  struct inode *file_inode = &fs->inodes[file->inode];
+  uint32_t end = offset + len;
+  int32_t need = (end + fs->block_size - 1) / fs->block_size;
+  ssize_t ret = MFS_OK;
+
+  if (is_packed(file_inode))
+  {
+    ret = unpack_file(fs, file->inode);
+  }
+  else if (file_inode->attribute & COMPRESSED)
+  {
+    ret = inflate_file(fs, file->inode);
+    if (ret == MFS_OK)
+    {
+      reset_cursors(fs, file->inode);
+    }
+  }
+  // Writing over bytes an encrypted file already holds would reuse their keystream, so the
+  // whole file moves to a new one first. None past the end has been used, so a write that
+  // starts there needs none.
+  uint32_t size = file_inode->file_size;
+  int encrypted = file_inode->attribute & ENCRYPTED;
+  if (ret == MFS_OK && encrypted && offset < size)
+  {
+    ret = rekey_file(fs, file->inode);
+  }
+  if (ret == MFS_OK)
+  {
+    // blocks shared with other files are copied before they are written
+    ret = unshare_blocks(fs, file->inode, offset / fs->block_size, need);
+    if (ret > 0)
+    {
+      reset_cursors(fs, file->inode);
+      ret = MFS_OK;
+    }
+  }
+  if (ret == MFS_OK && need > file_inode->num_blocks)
+  {
+    ret = grow_file(fs, file->inode, need);
+  }
+  if (ret == MFS_OK && encrypted && offset > size)
+  {
+    ret = zero_range(fs, file->inode, size, offset, &file->cursor);
+  }
+  if (ret == MFS_OK)
+  {
+    ret = copy_range(fs, file->inode, (uint8_t *)buf, offset, len, 1, &file->cursor);
+  }
+  if (ret == MFS_OK)
+  {
+    if (end > file_inode->file_size)
+    {
+      file_inode->file_size = end;
+      mark_dirty_range(fs, file_inode, sizeof(struct inode));
+    }
+    file->written = 1;
+    ret = len;
+  }
+
+  pthread_rwlock_unlock(inode_lock(fs, file->inode));
+  pthread_rwlock_unlock(&fs->image_lock);
+  return ret;
+}
+
+int mfs_stat(mfs_t *fs, const char *name, struct mfs_stat *st)
+{
+  if (fs == NULL || !fs->image_open)
+  {
+    return MFS_ENOTOPEN;
+  }
+  if (name == NULL || st == NULL)
+  {
+    return MFS_EINVAL;
+  }
+
+  pthread_rwlock_rdlock(&fs->image_lock);
+  pthread_rwlock_rdlock(&fs->dir_lock);
+
+  int ret = MFS_ENOENT;
+  int32_t entry = lookup(fs, (char *)name, 0);
+  if (entry != -1)
+  {
+    int32_t inode_index = fs->directory[entry].inode;
+    struct inode *file_inode = &fs->inodes[inode_index];
+
+    pthread_rwlock_rdlock(inode_lock(fs, inode_index));
+    st->size = file_inode->file_size;
+    st->blocks = file_inode->num_blocks;
+    st->extents = file_inode->num_extents;
+    st->attributes = file_inode->attribute;
+    pthread_rwlock_unlock(inode_lock(fs, inode_index));
+    ret = MFS_OK;
+  }
+
+  pthread_rwlock_unlock(&fs->dir_lock);
+  pthread_rwlock_unlock(&fs->image_lock);
+  return ret;
+}
+
+// Step through the directory. *pos starts at 0 and is moved past each file returned, hidden
+// ones included. Returns MFS_ENOENT once there are no more.
+int mfs_readdir(mfs_t *fs, int *pos, char name[65], struct mfs_stat *st)
+{
+  if (fs == NULL || !fs->image_open)
+  {
+    return MFS_ENOTOPEN;
+  }
+  if (pos == NULL || name == NULL || st == NULL || *pos < 0)
+  {
+    return MFS_EINVAL;
+  }
+
+  pthread_rwlock_rdlock(&fs->image_lock);
+  pthread_rwlock_rdlock(&fs->dir_lock);
+
+  int ret = MFS_ENOENT;
+  for (; *pos < fs->num_files; (*pos)++)
+  {
+    if (!fs->directory[*pos].in_use)
+    {
+      continue;
+    }
+
+    int32_t inode_index = fs->directory[*pos].inode;
+    struct inode *file_inode = &fs->inodes[inode_index];
+
+    memset(name, 0, 65);
+    strncpy(name, fs->directory[*pos].filename, 64);
+    pthread_rwlock_rdlock(inode_lock(fs, inode_index));
+    st->size = file_inode->file_size;
+    st->blocks = file_inode->num_blocks;
+    st->extents = file_inode->num_extents;
+    st->attributes = file_inode->attribute;
+    pthread_rwlock_unlock(inode_lock(fs, inode_index));
+
+    (*pos)++;
+    ret = MFS_OK;
+    break;
+  }
+
+  pthread_rwlock_unlock(&fs->dir_lock);
+  pthread_rwlock_unlock(&fs->image_lock);
+  return ret;
+}
+
+// The directory entry and blocks are only marked free, so undelete can still bring the file
+// back until they are reused
+int mfs_unlink(mfs_t *fs, const char *name)
+{
+  if (fs == NULL || !fs->image_open)
+  {
+    return MFS_ENOTOPEN;
+  }
+  if (name == NULL)
+  {
+    return MFS_EINVAL;
+  }
+  if (fs->read_only)
+  {
+    return MFS_EROFS;
+  }
+
+  pthread_rwlock_rdlock(&fs->image_lock);
+  pthread_rwlock_wrlock(&fs->dir_lock);
+
+  int ret = MFS_OK;
+  int32_t i = lookup(fs, (char *)name, 0);
+  int32_t inode_index = (i == -1) ? -1 : fs->directory[i].inode;
+  if (i == -1)
+  {
+    ret = MFS_ENOENT;
+  }
+  else if (fs->inodes[inode_index].attribute & READONLY)
+  {
+    ret = MFS_EROFS;
+  }
+
+  pthread_mutex_lock(&fs->handle_lock);
+  for (int handle = 0; ret == MFS_OK && handle < MFS_MAX_HANDLES; handle++)
+  {
+    if (fs->files[handle].flags != 0 && fs->files[handle].entry == i)
+    {
+      ret = MFS_EBUSY;
+    }
+  }
+  pthread_mutex_unlock(&fs->handle_lock);
+
+  if (ret == MFS_OK)
+  {
+    fs->directory[i].in_use = false;
+    fs->inodes[inode_index].in_use = 0;
+    set_free_inode(fs, inode_index, 1);
+    mark_dirty_range(fs, &fs->directory[i], sizeof(struct directoryEntry));
+    mark_dirty_range(fs, &fs->inodes[inode_index], sizeof(struct inode));
+
+    stamp_deleted(fs, inode_index);
+    free_file_blocks(fs, &fs->inodes[inode_index], 1);
+  }
+
+  pthread_rwlock_unlock(&fs->dir_lock);
+  pthread_rwlock_unlock(&fs->image_lock);
+
+  if (ret == MFS_OK && !defer_savefs)
+  {
+    pthread_rwlock_wrlock(&fs->image_lock);
+    journal_commit(fs);
+    cache_trim(fs);
+    pthread_rwlock_unlock(&fs->image_lock);
+  }
+  return ret;
+}
@@ -0,0 +1,101 @@
+#ifndef _LIBMFS_H_
+#define _LIBMFS_H_
+
+// The filesystem as a library. Link with libmfs.a and -pthread.
+//
+// Every call returns MFS_OK, a count of bytes, or one of the negative MFS_E codes below, and
+// none of them print anything. mfs_strerror turns a code into a message.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MFS_OK 0
+#define MFS_ENOTOPEN -1      // No image is open
+#define MFS_EBUSY -2         // The file is open through a handle
+#define MFS_EIO -3           // The image or a host file could not be read or written
+#define MFS_EBADIMAGE -4     // The file is not a valid image
+#define MFS_ENOENT -5        // No such file
+#define MFS_EEXIST -6        // The file already exists
+#define MFS_ENAMETOOLONG -7  // Filenames are at most 64 bytes
+#define MFS_EFBIG -8         // Files are at most 2 GiB less a byte
+#define MFS_ENOSPC -9        // Not enough free blocks
+#define MFS_EFRAGMENTED -10  // Free space is split into more runs than a file can hold
+#define MFS_ENFILE -11       // No free directory entry or inode
+#define MFS_EBADF -12        // Not an open handle, or not open for this kind of access
+#define MFS_EROFS -13        // The file is marked read-only, or the image was opened read-only
+#define MFS_EKEY -14         // The file is encrypted with a different key
+#define MFS_EINVAL -15       // Bad argument
+#define MFS_ENOMEM -16       // Out of memory
+#define MFS_EMFILE -17       // Every handle is in use
+
+// Flags for mfs_create and mfs_mount
+#define MFS_MAP 0x1 // Memory-map the image instead of reading it into memory
+
+// Flags for mfs_open
+#define MFS_READ 0x1
+#define MFS_WRITE 0x2
+#define MFS_CREATE 0x4   // Create the file empty if it doesn't exist
+#define MFS_TRUNCATE 0x8 // Drop the contents of the file, needs MFS_WRITE
+
+// Attributes reported by mfs_stat
+#define MFS_ATTR_HIDDEN 0x1
+#define MFS_ATTR_READONLY 0x2
+#define MFS_ATTR_ENCRYPTED 0x4
+#define MFS_ATTR_COMPRESSED 0x8
+
+#define MFS_MAX_HANDLES 64 // Files open through handles at once on one image
+
+typedef struct mfs mfs_t;
+
+// Geometry for mfs_create_geometry. A field left 0 takes its default, 1 KiB blocks, 65536
+// of them and 256 files. Block sizes are powers of two from 1 KiB to 64 KiB and the number of
+// blocks a multiple of 64. Files of up to pack_size bytes share blocks with others, half a
+// block by default, or none with MFS_NO_PACKING. With MFS_COMPRESS in flags files inserted by
+// the shell are stored compressed, and with MFS_DEDUP their blocks are stored once however
+// many files hold them. Files written through handles are stored as they are.
+struct mfs_geometry
+{
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t num_files;
+    uint32_t pack_size;
+    uint32_t flags;
+};
+
+#define MFS_NO_PACKING 0xffffffff
+
+#define MFS_COMPRESS 0x1
+#define MFS_DEDUP 0x2
+
+struct mfs_stat
+{
+    uint32_t size;
+    uint32_t blocks;
+    uint32_t extents;
+    uint8_t attributes;
+};
+
+// Images. Each open image has its own mfs_t and any number can be open at once, but an
+// image file must only be open once. Every call except mfs_unmount can be made from any
+// number of threads on the same image.
+int mfs_create(const char *image, int flags, mfs_t **fs);
+int mfs_create_geometry(const char *image, int flags, const struct mfs_geometry *geometry,
+                        mfs_t **fs);
+int mfs_mount(const char *image, int flags, mfs_t **fs);
+int mfs_sync(mfs_t *fs);
+int mfs_unmount(mfs_t *fs);
+
+// Files. mfs_open returns a handle. Writes are committed to the journal when their handle is
+// closed and reach the image file itself on mfs_sync.
+int mfs_open(mfs_t *fs, const char *name, int flags);
+int mfs_close(mfs_t *fs, int handle);
+ssize_t mfs_pread(mfs_t *fs, int handle, void *buf, size_t len, uint32_t offset);
+ssize_t mfs_pwrite(mfs_t *fs, int handle, const void *buf, size_t len, uint32_t offset);
+int mfs_stat(mfs_t *fs, const char *name, struct mfs_stat *st);
+int mfs_unlink(mfs_t *fs, const char *name);
+int mfs_readdir(mfs_t *fs, int *pos, char name[65], struct mfs_stat *st);
+
+const char *mfs_strerror(int err);
+
+#endif
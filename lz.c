@@ -0,0 +1,207 @@
+#include "lz.h"
+
+#include <string.h>
+
+// Every sequence is a token, whose top four bits count the literals and bottom four bits the
+// match length past LZ_MIN_MATCH, then the literals, a two-byte little-endian offset back to
+// the match and the rest of any length too long for its four bits. The last sequence has
+// literals only.
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+  return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// A length of 15 or more goes on in bytes of 255 ending with one below it
+static uint8_t *put_length(uint8_t *out, size_t len)
+{
+  for (; len >= 255; len -= 255)
+  {
+    *out++ = 255;
+  }
+  *out++ = len;
+  return out;
+}
+
+// Emit one sequence, literals and then a match unless match_len is 0. Returns the end of the
+// output, or NULL if it doesn't fit before out_end.
+static uint8_t *put_sequence(uint8_t *out, uint8_t *out_end, const uint8_t *literals,
+                             size_t literal_len, size_t offset, size_t match_len)
+{
+  size_t need = 1 + literal_len + literal_len / 255 + 1;
+  if (match_len > 0)
+  {
+    need += 2 + (match_len - LZ_MIN_MATCH) / 255 + 1;
+  }
+  if (need > (size_t)(out_end - out))
+  {
+    return NULL;
+  }
+
+  uint8_t *token = out++;
+  *token = (literal_len < 15 ? literal_len : 15) << 4;
+  if (literal_len >= 15)
+  {
+    out = put_length(out, literal_len - 15);
+  }
+  memcpy(out, literals, literal_len);
+  out += literal_len;
+
+  if (match_len > 0)
+  {
+    size_t extra = match_len - LZ_MIN_MATCH;
+    *out++ = offset;
+    *out++ = offset >> 8;
+    *token |= (extra < 15) ? extra : 15;
+    if (extra >= 15)
+    {
+      out = put_length(out, extra - 15);
+    }
+  }
+  return out;
+}
+
+// Compress len bytes at src into dst. Returns the compressed length, or 0 if it would take
+// more than cap bytes.
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  const uint8_t *end = src + len;
+  const uint8_t *anchor = src;
+  const uint8_t *ip = src;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + cap;
+  uint32_t misses = 0;
+
+  memset(table, 0, sizeof(table));
+  if (len > LZ_MATCH_LIMIT)
+  {
+    const uint8_t *match_limit = end - LZ_MATCH_LIMIT;
+    const uint8_t *extend_limit = end - LZ_LAST_LITERALS;
+    while (ip < match_limit)
+    {
+      uint32_t sequence = read32(ip);
+      uint32_t slot = lz_hash(sequence);
+      const uint8_t *ref = src + table[slot];
+      table[slot] = ip - src;
+
+      // data that keeps missing is stepped over faster
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != sequence)
+      {
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      size_t match_len = LZ_MIN_MATCH;
+      while (ip + match_len < extend_limit && ref[match_len] == ip[match_len])
+      {
+        match_len++;
+      }
+
+      op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_len);
+      if (op == NULL)
+      {
+        return 0;
+      }
+      ip += match_len;
+      anchor = ip;
+      if (ip < match_limit)
+      {
+        table[lz_hash(read32(ip - 2))] = ip - 2 - src;
+      }
+    }
+  }
+
+  op = put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+  return (op == NULL) ? 0 : (size_t)(op - dst);
+}
+
+// Read a length continued past its four bits. Returns -1 if it runs off the input.
+static int get_length(const uint8_t **in, const uint8_t *in_end, size_t *len)
+{
+  uint8_t byte;
+  do
+  {
+    if (*in >= in_end)
+    {
+      return -1;
+    }
+    byte = *(*in)++;
+    *len += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+// Decompress len bytes at src into dst, which holds cap bytes. Every length and offset is
+// checked, so damaged input is refused rather than read or written out of bounds. Returns the
+// decompressed length or -1.
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+  const uint8_t *ip = src;
+  const uint8_t *ip_end = src + len;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + cap;
+
+  while (ip < ip_end)
+  {
+    uint8_t token = *ip++;
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && get_length(&ip, ip_end, &literal_len) == -1)
+    {
+      return -1;
+    }
+    if (literal_len > (size_t)(ip_end - ip) || literal_len > (size_t)(op_end - op))
+    {
+      return -1;
+    }
+    memcpy(op, ip, literal_len);
+    op += literal_len;
+    ip += literal_len;
+    if (ip == ip_end)
+    {
+      break;
+    }
+
+    if (ip_end - ip < 2)
+    {
+      return -1;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && get_length(&ip, ip_end, &match_len) == -1)
+    {
+      return -1;
+    }
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(op_end - op))
+    {
+      return -1;
+    }
+
+    // a match may overlap the bytes it produces, repeating them
+    const uint8_t *ref = op - offset;
+    if (offset >= match_len)
+    {
+      memcpy(op, ref, match_len);
+    }
+    else
+    {
+      size_t i;
+      for (i = 0; i < match_len; i++)
+      {
+        op[i] = ref[i];
+      }
+    }
+    op += match_len;
+  }
+  return op - dst;
+}
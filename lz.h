@@ -0,0 +1,19 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A block codec in the LZ4 block format: sequences of a token, literals and a match copied
+// from up to 64 KiB back. Each block is compressed on its own, with nothing carried over.
+
+#define LZ_MIN_MATCH 4      // Shortest match worth a sequence
+#define LZ_LAST_LITERALS 5  // Bytes at the end of a block that are always literals
+#define LZ_MATCH_LIMIT 12   // No match starts closer to the end than this
+#define LZ_HASH_BITS 12     // Positions the compressor remembers, as a power of two
+#define LZ_MAX_OFFSET 65535
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif
@@ -1,624 +1,4530 @@
 #include "mfs.h"
 
-// UINT8_T BLOCKS
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
-uint8_t *free_blocks; // 65536 bytes = 64 blocks
-uint8_t *free_inodes; // 256 * 1
+// Passphrase given to the key command, each image derives its own key from it
+char *cipher_passphrase = NULL;
+uint8_t cipher_key_set = 0;
 
-struct directoryEntry *directory;
+// How every image commits its changes to its journal
+uint8_t journal_mode = JOURNAL_ORDERED;
 
-struct inode *inodes;
+// Set when a command fails so batch mode can stop and report it in the exit status
+uint8_t command_failed = 0;
 
-FILE *fp;
-char image_name[64];
-uint8_t image_open = 0;
+// In batch mode savefs only marks the image to be saved once the batch is done
+uint8_t defer_savefs = 0;
 
-// FUNCTIONS
-int32_t findFreeBlock()
+// Print an error message and remember that the current command failed
+void report_error(const char *format, ...)
 {
-  int i;
-  for (i = 0; i < NUM_BLOCKS; i++)
-  {
-    if (free_blocks[i])
-    {
-      return i + 1065; // PROF CHANGED IT TO 1065
-    }
-  }
-  return -1;
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  command_failed = 1;
 }
 
-int32_t findFreeInode()
+// DIRTY BLOCK TRACKING
+// Threads writing different files still share bitmap words, so the bits are set atomically
+void mark_dirty(struct mfs *fs, int32_t block)
 {
-  int i;
-  for (i = 0; i < NUM_FILES; i++)
-  {
-    if (free_inodes[i])
-    {
-      return i;
-    }
-  }
-  return -1;
+  uint64_t bit = (uint64_t)1 << (block % 64);
+  __atomic_fetch_or(&fs->dirty_blocks[block / 64], bit, __ATOMIC_RELAXED);
+  __atomic_fetch_or(&fs->journal_blocks[block / 64], bit, __ATOMIC_RELAXED);
 }
 
-int32_t findFreeInodeBlock(int32_t inode)
+// Mark every block overlapped by the len bytes at ptr, which must point into data
+void mark_dirty_range(struct mfs *fs, void *ptr, size_t len)
 {
-  int i;
-  for (i = 0; i < BLOCKS_PER_FILE; i++)
+  size_t offset = (uint8_t *)ptr - fs->data;
+  int32_t first = offset / fs->block_size;
+  int32_t last = (offset + len - 1) / fs->block_size;
+
+  int32_t block;
+  for (block = first; block <= last && block < fs->num_blocks; block++)
   {
-    if (inodes[inode].blocks[i] == -1)
-    {
-      return i;
-    }
+    mark_dirty(fs, block);
   }
-  return -1;
 }
 
-void init()
+// Forget that a block changed, for one freed before it was ever saved
+void clear_block_dirty(struct mfs *fs, int32_t block)
 {
-  directory = (struct directoryEntry *)&data[0][0];
-  inodes = (struct inode *)&data[20][0];
-  free_blocks = (uint8_t *)&data[1000][0];
-  free_inodes = (uint8_t *)&data[19][0];
+  uint64_t bit = (uint64_t)1 << (block % 64);
+  __atomic_fetch_and(&fs->dirty_blocks[block / 64], ~bit, __ATOMIC_RELAXED);
+  __atomic_fetch_and(&fs->journal_blocks[block / 64], ~bit, __ATOMIC_RELAXED);
+}
 
-  for (int i = 0; i < NUM_FILES; i++)
-  {
-    directory[i].in_use = 0;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
+void mark_all_dirty(struct mfs *fs)
+{
+  memset(fs->dirty_blocks, 0xff, fs->bitmap_words * sizeof(uint64_t));
+}
 
-    memset(directory[i].filename, 0, 64);
+void clear_dirty(struct mfs *fs)
+{
+  memset(fs->dirty_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
+}
+
+// Find the next run of set blocks in bitmap at or after *start. Runs separated by no more
+// than MAX_DIRTY_GAP clean blocks are merged since one larger write beats several small ones.
+// Returns the length of the run in blocks, 0 when nothing else is set.
+int32_t next_dirty_run(struct mfs *fs, uint64_t *bitmap, int32_t *start)
+{
+  int32_t block = *start;
 
-    int j;
-    for (j = 0; j < NUM_BLOCKS; j++)
+  // skip whole clean words, then count trailing zeros to land on the first dirty block
+  while (block < fs->num_blocks)
+  {
+    uint64_t word = bitmap[block / 64] >> (block % 64);
+    if (word)
     {
-      inodes[i].blocks[j] = -1;
+      block += __builtin_ctzll(word);
+      break;
     }
-    inodes[i].in_use = 0;
-    inodes[i].attribute = 0;
-    inodes[i].file_size = 0;
+    block = (block / 64 + 1) * 64;
   }
-
-  int j;
-  for (j = 0; j < NUM_BLOCKS; j++)
+  if (block >= fs->num_blocks)
   {
-    free_blocks[j] = 1;
+    return 0;
   }
-}
-
-uint32_t df()
-{
-  int j = 0;
-  int count = 0;
 
-  for (j = FIRST_DATA_BLOCK; j < NUM_BLOCKS; j++)
+  *start = block;
+  int32_t end = block;
+  int32_t gap = 0;
+  for (block = block + 1; block < fs->num_blocks && gap <= MAX_DIRTY_GAP; block++)
   {
-    if (free_blocks[j] == 1)
+    if (bitmap[block / 64] & ((uint64_t)1 << (block % 64)))
     {
-      count++;
+      end = block;
+      gap = 0;
+    }
+    else
+    {
+      gap++;
     }
   }
-
-  return count * BLOCK_SIZE;
+  return end - *start + 1;
 }
 
-void createfs(char *filename)
+// pwrite len blocks starting at block start back to their place in the image file. Clean
+// blocks a dirty run was joined across may not have been read in yet, so the run is cached
+// first, and nothing is written if they can't be.
+int write_blocks(struct mfs *fs, int32_t start, int32_t len)
 {
-  if (image_open == 1)
+  if (cache_blocks(fs, start, len) == NULL)
   {
-    closefs();
+    return -1;
   }
 
-  fp = fopen(filename, "w");
-
-  strncpy(image_name, filename, strlen(filename) + 1);
-
-  memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
-
-  init();
-
-  image_open = 1;
+  size_t bytes = (size_t)len * fs->block_size;
+  size_t written = 0;
+  while (written < bytes)
+  {
+    ssize_t ret = pwrite(fileno(fs->fp), block_data(fs, start) + written, bytes - written,
+                         (off_t)start * fs->block_size + written);
+    if (ret == -1)
+    {
+      return -1;
+    }
+    written += ret;
+  }
+  return 0;
+}
 
-  // Save empty struct data into file so it's recognized as a valid image file
-  savefs();
+// BLOCK CACHE
+// Where block lives in data, whether or not it has been read in
+uint8_t *block_data(struct mfs *fs, int32_t block)
+{
+  return fs->data + (size_t)block * fs->block_size;
 }
 
-void savefs()
+// Read in the frames from first to last that aren't loaded yet, each run of them with one
+// pread. A frame that can't be read stays unloaded. Called with cache_lock held.
+int cache_read(struct mfs *fs, int32_t first, int32_t last)
 {
-  if (image_open == 0)
+  int32_t frame = first;
+  while (frame <= last)
   {
-    printf("ERROR: Disk image is not open.\n");
-    return;
-  }
-
-  // close file and open in write mode
-  fclose(fp);
+    if (fs->frame_loaded[frame])
+    {
+      frame++;
+      continue;
+    }
+    int32_t end = frame;
+    while (end < last && !fs->frame_loaded[end + 1])
+    {
+      end++;
+    }
 
-  fp = fopen(image_name, "w");
+    uint8_t *dest = block_data(fs, frame * CACHE_FRAME);
+    off_t offset = (off_t)frame * CACHE_FRAME * fs->block_size;
+    size_t bytes = (size_t)(end - frame + 1) * CACHE_FRAME * fs->block_size;
+    size_t got = 0;
+    while (got < bytes)
+    {
+      ssize_t ret = pread(fileno(fs->fp), dest + got, bytes - got, offset + got);
+      if (ret <= 0)
+      {
+        return -1;
+      }
+      got += ret;
+    }
 
-  fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+    for (; frame <= end; frame++)
+    {
+      fs->frame_used[frame] = 1;
+      fs->frames_loaded++;
+      __atomic_store_n(&fs->frame_loaded[frame], 1, __ATOMIC_RELEASE);
+    }
+  }
+  return 0;
 }
 
-void openfs(char *filename)
+// Make sure the len blocks from start are in memory and return them, or NULL if they couldn't
+// be read in, when the caller must fail without touching them. A miss at the frame right
+// after the previous miss reads ahead, twice as far each time up to CACHE_READAHEAD frames.
+// Blocks must be cached before they are written as well as read, or a later miss would read
+// the old contents over them. Only cache_trim drops frames, so blocks stay in memory for the
+// rest of the call that cached them.
+uint8_t *cache_blocks(struct mfs *fs, int32_t start, int32_t len)
 {
+  if (fs->image_mapped || len <= 0)
+  {
+    return block_data(fs, start);
+  }
 
-  // verify the file exits
-  struct stat buf;
-  int ret = stat(filename, &buf);
-
-  if (ret == -1)
+  int32_t first = start / CACHE_FRAME;
+  int32_t last = (start + len - 1) / CACHE_FRAME;
+  int32_t frame;
+  for (frame = first; frame <= last; frame++)
   {
-    printf("ERROR: File doesn't exist.\n");
-    return;
+    if (!__atomic_load_n(&fs->frame_loaded[frame], __ATOMIC_ACQUIRE))
+    {
+      break;
+    }
+    __atomic_store_n(&fs->frame_used[frame], 1, __ATOMIC_RELAXED);
   }
-  // verify that the file is the right size
-  if (buf.st_size != IMAGE_FILE_SIZE)
+  if (frame > last)
   {
-    printf("ERROR: File is not a valid image file.\n");
-    return;
+    return block_data(fs, start);
   }
 
-  // If another file is open close it before opening new file
-  if (image_open == 1)
+  pthread_mutex_lock(&fs->cache_lock);
+  if (first == fs->readahead_next)
+  {
+    fs->readahead_window *= 2;
+    if (fs->readahead_window == 0)
+    {
+      fs->readahead_window = 1;
+    }
+    if (fs->readahead_window > CACHE_READAHEAD)
+    {
+      fs->readahead_window = CACHE_READAHEAD;
+    }
+  }
+  else
   {
-    closefs();
+    fs->readahead_window = 0;
   }
 
-  //assigns fp
-  fp = fopen(filename, "r");
-
-  strncpy(image_name, filename, strlen(filename));
-
-  fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+  int32_t end = last + fs->readahead_window;
+  if (end >= fs->num_frames)
+  {
+    end = fs->num_frames - 1;
+  }
+  // frames read ahead that fail don't fail the ones asked for
+  int ret = cache_read(fs, frame, end);
+  if (ret == -1 && end > last)
+  {
+    ret = cache_read(fs, frame, last);
+  }
+  fs->readahead_next = end + 1;
+  pthread_mutex_unlock(&fs->cache_lock);
 
-  image_open = 1;
+  return (ret == -1) ? NULL : block_data(fs, start);
 }
 
-void closefs()
+// Drop frames, oldest use first, until no more than cache_frames are loaded. Frames holding
+// changes not yet committed to the journal stay, committed changes are written back before
+// their frame goes. The metadata frames always stay. The caller must be the only one using
+// the image.
+void cache_trim(struct mfs *fs)
 {
-  if (image_open == 0)
+  if (fs->image_mapped)
   {
-    printf("Close: File not open.\n");
     return;
   }
 
-  fclose(fp);
+  int32_t first = (fs->first_data_block + CACHE_FRAME - 1) / CACHE_FRAME;
+  int32_t steps = 2 * fs->num_frames;
+  while (fs->frames_loaded > fs->cache_frames && steps-- > 0)
+  {
+    int32_t frame = fs->clock_hand;
+    fs->clock_hand = (frame + 1) % fs->num_frames;
+    if (frame < first || !fs->frame_loaded[frame])
+    {
+      continue;
+    }
+    if (fs->frame_used[frame])
+    {
+      fs->frame_used[frame] = 0;
+      continue;
+    }
 
-  image_open = 0;
+    int32_t block = frame * CACHE_FRAME;
+    uint64_t mask = (((uint64_t)1 << CACHE_FRAME) - 1) << (block % 64);
+    if (fs->journal_blocks[block / 64] & mask)
+    {
+      continue;
+    }
+    if (fs->dirty_blocks[block / 64] & mask)
+    {
+      if (write_blocks(fs, block, CACHE_FRAME) == -1)
+      {
+        continue;
+      }
+      fs->dirty_blocks[block / 64] &= ~mask;
+    }
 
-  memset(image_name, 0, 64);
+    madvise(block_data(fs, block), CACHE_FRAME * fs->block_size, MADV_DONTNEED);
+    fs->frame_loaded[frame] = 0;
+    fs->frames_loaded--;
+  }
 }
 
-void insert(char *filename)
+// JOURNAL
+// 64-bit FNV-1a, used to tell a complete journal record from one torn by a crash
+uint64_t checksum(uint8_t *buf, size_t len)
 {
-  // verify the filename isnt NULL
-
-  if (filename == NULL)
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < len; i++)
   {
-    printf("ERROR: Filename is NULL\n");
-    return;
+    hash ^= buf[i];
+    hash *= 0x100000001b3ULL;
   }
+  return hash;
+}
 
-  // verify the file exits
-  struct stat buf;
-  int ret = stat(filename, &buf);
+// Open the journal that belongs to image_name, creating it if it doesn't exist yet.
+// Mapped images are written back by the kernel whenever it likes so they aren't journaled,
+// openfs only opens their journal to replay what an unmapped session left in it.
+void journal_open(struct mfs *fs)
+{
+  char journal_name[72];
+  snprintf(journal_name, sizeof(journal_name), "%s.jnl", fs->image_name);
 
-  if (ret == -1)
-  {
-    printf("INSERT ERROR: File doesn't exist.\n");
-    return;
-  }
-  // verify that the file isnt too big
-  if (buf.st_size > MAX_FILE_SIZE)
+  fs->journal_fd = open(journal_name, O_RDWR | O_CREAT | O_APPEND, 0644);
+  fs->journal_sequence = 0;
+  memset(fs->journal_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
+}
+
+void journal_close(struct mfs *fs)
+{
+  if (fs->journal_fd != -1)
   {
-    printf("INSERT ERROR: File is too large.\n");
-    return;
+    close(fs->journal_fd);
+    fs->journal_fd = -1;
   }
+}
 
-  // verify that there is enough space
-  if (buf.st_size > df())
+// Apply every complete record in the journal to the in-memory image and mark the blocks
+// dirty so the next savefs checkpoints them. Replay stops at the first torn record.
+// Returns the number of records applied, or -1 if a block one changes couldn't be read in.
+int32_t journal_replay(struct mfs *fs)
+{
+  int32_t records = 0;
+  struct journalHeader header;
+
+  if (fs->journal_fd == -1)
   {
-    printf("INSERT ERROR: Not enough disk space.\n");
-    return;
+    return 0;
   }
 
-  // find an empty directory entry
-  int i = 0;
-  int directory_entry = -1;
-  for (i = 0; i < NUM_FILES; i++)
+  lseek(fs->journal_fd, 0, SEEK_SET);
+  while (read(fs->journal_fd, &header, sizeof(header)) == sizeof(header))
   {
-    if (directory[i].in_use == 0)
+    if (header.magic != JOURNAL_MAGIC || header.count > fs->num_blocks)
     {
-      directory_entry = i;
       break;
     }
+
+    size_t len = (size_t)header.count * (sizeof(int32_t) + fs->block_size);
+    uint8_t *record = malloc(len);
+    if (record == NULL || read(fs->journal_fd, record, len) != (ssize_t)len ||
+        checksum(record, len) != header.checksum)
+    {
+      free(record);
+      break;
+    }
+
+    int32_t *block_list = (int32_t *)record;
+    uint8_t *contents = record + header.count * sizeof(int32_t);
+    uint32_t i;
+    for (i = 0; i < header.count; i++)
+    {
+      if (block_list[i] >= 0 && block_list[i] < fs->num_blocks)
+      {
+        uint8_t *block = cache_blocks(fs, block_list[i], 1);
+        if (block == NULL)
+        {
+          free(record);
+          return -1;
+        }
+        memcpy(block, contents + (size_t)i * fs->block_size, fs->block_size);
+        mark_dirty(fs, block_list[i]);
+      }
+    }
+    free(record);
+
+    fs->journal_sequence = header.sequence + 1;
+    records++;
   }
-  if (directory_entry == -1)
+
+  // what was replayed is in the journal already and needn't be committed to it again
+  memset(fs->journal_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
+  return records;
+}
+
+// Make the changes of the last command durable. In ordered mode the changed data blocks are
+// written straight to the image first, then the changed metadata blocks are appended to the
+// journal as a single record. In data mode everything goes into the record.
+void journal_commit(struct mfs *fs)
+{
+  if (fs->journal_fd == -1 || journal_mode == JOURNAL_OFF)
   {
-    printf("ERROR: Could not find a free directory entry\n");
     return;
   }
 
-  // find free inodes and place the file
-  FILE *ifp = fopen(filename, "r");
-  printf("Reading %d bytes from %s\n", (int)buf.st_size, filename);
+  int32_t start;
+  int32_t len;
 
-  // Save off the size of the input file since we'll use it in a couple of places and
-  // also initialize our index variables to zero.
-  int32_t copy_size = buf.st_size;
+  if (journal_mode == JOURNAL_ORDERED)
+  {
+    // data blocks are either newly allocated or only ever rewritten whole, so it is safe
+    // to put them in place before the metadata that points at them is committed. Indirect
+    // and tail blocks are rewritten in part and wait for the metadata.
+    size_t bytes = fs->bitmap_words * sizeof(uint64_t);
+    uint64_t *data_blocks = malloc(bytes);
+    if (data_blocks == NULL)
+    {
+      report_error("JOURNAL ERROR: Out of memory.\n");
+      return;
+    }
+    memcpy(data_blocks, fs->journal_blocks, bytes);
+    memset(data_blocks, 0, (fs->first_data_block / 64) * sizeof(uint64_t));
+    data_blocks[fs->first_data_block / 64] &= ~(((uint64_t)1 << (fs->first_data_block % 64)) - 1);
+    size_t w;
+    for (w = 0; w < fs->bitmap_words; w++)
+    {
+      data_blocks[w] &= ~fs->tree_blocks[w];
+    }
 
-  // We want to copy and write in chunks of BLOCK_SIZE. So to do this
-  // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-  // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-  int32_t offset = 0;
+    int wrote = 0;
+    start = 0;
+    while ((len = next_dirty_run(fs, data_blocks, &start)) > 0)
+    {
+      // a run joined across an indirect or tail block stops short of it, and of the clean
+      // blocks before it, since that block has to wait for the journal
+      int32_t end;
+      for (end = start + 1; end < start + len; end++)
+      {
+        uint64_t bit = (uint64_t)1 << (end % 64);
+        if ((fs->journal_blocks[end / 64] & bit) && !(data_blocks[end / 64] & bit))
+        {
+          break;
+        }
+      }
+      while (!(data_blocks[(end - 1) / 64] & ((uint64_t)1 << ((end - 1) % 64))))
+      {
+        end--;
+      }
+      len = end - start;
+      if (write_blocks(fs, start, len) == -1)
+      {
+        report_error("JOURNAL ERROR: %s\n", strerror(errno));
+        free(data_blocks);
+        return;
+      }
+      start += len;
+      wrote = 1;
+    }
+    if (wrote)
+    {
+      fdatasync(fileno(fs->fp));
+    }
 
-  // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big
-  // memory pool. Why? We are simulating the way the file system stores file data in
-  // blocks of space on the disk. block_index will keep us pointing to the area of
-  // the area that we will read from or write to.
-  int32_t block_index = -1;
+    int i;
+    for (i = 0; i < fs->num_blocks / 64; i++)
+    {
+      fs->dirty_blocks[i] &= ~data_blocks[i];
+      fs->journal_blocks[i] &= ~data_blocks[i];
+    }
+    free(data_blocks);
+  }
 
-  // find a free inode
-  int32_t inode_index = findFreeInode();
-  if (inode_index == -1)
+  uint32_t count = 0;
+  int i;
+  for (i = 0; i < fs->num_blocks / 64; i++)
+  {
+    count += __builtin_popcountll(fs->journal_blocks[i]);
+  }
+  if (count == 0)
   {
-    printf("ERROR: Can not find a free inode.\n");
     return;
   }
 
-  // place the file info in the directory
-  directory[directory_entry].in_use = 1;
-  directory[directory_entry].inode = inode_index;
-  strncpy(directory[directory_entry].filename, filename, strlen(filename));
-
-  inodes[inode_index].file_size = buf.st_size;
-  inodes[inode_index].in_use = 1;
-  free_inodes[inode_index] = 0;
-
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file.
-  while (copy_size > 0)
+  // Build the whole record in one buffer so it reaches the journal in a single write
+  size_t len_list = count * sizeof(int32_t);
+  size_t record_len = sizeof(struct journalHeader) + len_list + (size_t)count * fs->block_size;
+  uint8_t *record = malloc(record_len);
+  if (record == NULL)
   {
-    fseek(ifp, offset, SEEK_SET);
-
-    // Read BLOCK_SIZE number of bytes from the input file and store them in our
-    // data array.
+    report_error("JOURNAL ERROR: Out of memory.\n");
+    return;
+  }
 
-    // find a free block
-    block_index = findFreeBlock();
+  struct journalHeader *header = (struct journalHeader *)record;
+  int32_t *block_list = (int32_t *)(record + sizeof(struct journalHeader));
+  uint8_t *contents = record + sizeof(struct journalHeader) + len_list;
 
-    if (block_index == -1)
+  uint32_t n = 0;
+  for (i = 0; i < fs->num_blocks / 64; i++)
+  {
+    uint64_t word = fs->journal_blocks[i];
+    while (word)
     {
-      printf("ERROR: Can not find a free block.\n");
-      return;
+      int32_t block = i * 64 + __builtin_ctzll(word);
+      block_list[n] = block;
+      // a block was cached to be changed and cache_trim keeps it until it is committed
+      memcpy(contents + (size_t)n * fs->block_size, block_data(fs, block), fs->block_size);
+      n++;
+      word &= word - 1;
     }
+  }
 
-    int32_t bytes = fread(data[block_index], BLOCK_SIZE, 1, ifp);
-
-    // save the block in the inode
-    int32_t inode_block = findFreeInodeBlock(inode_index);
-    inodes[inode_index].blocks[inode_block] = block_index;
+  header->magic = JOURNAL_MAGIC;
+  header->count = count;
+  header->sequence = fs->journal_sequence++;
+  header->checksum = checksum((uint8_t *)block_list, record_len - sizeof(struct journalHeader));
 
-    // If bytes == 0 and we haven't reached the end of the file then something is
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if (bytes == 0 && !feof(ifp))
+  // A record that only partly made it out is cut off again so later records stay reachable
+  off_t journal_end = lseek(fs->journal_fd, 0, SEEK_END);
+  size_t written = 0;
+  while (written < record_len)
+  {
+    ssize_t ret = write(fs->journal_fd, record + written, record_len - written);
+    if (ret == -1)
     {
-      printf("An error occured reading from the input file.\n");
+      report_error("JOURNAL ERROR: %s\n", strerror(errno));
+      ftruncate(fs->journal_fd, journal_end);
+      free(record);
       return;
     }
-
-    // Clear the EOF file flag.
-    clearerr(ifp);
-
-    // Reduce copy_size by the BLOCK_SIZE bytes.
-    copy_size -= BLOCK_SIZE;
-
-    // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset += BLOCK_SIZE;
-
-    // Increment the index into the block array
-    // DO NOT just increment block index in your file system
-    free_blocks[block_index - 1065] = 0;
-    free_blocks[block_index] = 0;
+    written += ret;
   }
+  fdatasync(fs->journal_fd);
+  free(record);
 
-  // We are done copying from the input file so close it out.
-  fclose(ifp);
+  memset(fs->journal_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
+  memset(fs->tree_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
 }
 
-void encrypt_block(uint8_t *str, char key, uint32_t len)
+// Everything in the journal has reached the image so start it over
+void journal_reset(struct mfs *fs)
 {
-  int i;
-  for (i = 0; i < len; i++)
+  memset(fs->journal_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
+  memset(fs->tree_blocks, 0, fs->bitmap_words * sizeof(uint64_t));
+  if (fs->journal_fd != -1)
   {
-    str[i] ^= key;
+    ftruncate(fs->journal_fd, 0);
+    fdatasync(fs->journal_fd);
+    fs->journal_sequence = 0;
   }
 }
 
-void encrypt(char *filename, char cypher)
+// FUNCTIONS
+// Return the first free block at or after block, -1 if there is none
+int32_t next_free_block(struct mfs *fs, int32_t block)
 {
-  int file_index = -1;
-
-  int i;
-  for (i = 0; i < NUM_FILES; i++)
+  while (block < fs->num_blocks)
   {
-    if (directory[i].in_use && !strcmp(filename, directory[i].filename))
+    uint64_t bits = fs->free_blocks[block / 64] >> (block % 64);
+    if (bits)
     {
-      file_index = i;
-      break;
+      return block + __builtin_ctzll(bits);
     }
+    block = (block / 64 + 1) * 64;
   }
+  return -1;
+}
 
-  if (file_index == -1)
+// Count the free blocks in a row starting at block, stopping at max
+int32_t free_run_length(struct mfs *fs, int32_t block, int32_t max)
+{
+  int32_t len = 0;
+  while (block < fs->num_blocks && len < max)
   {
-    printf("ERROR: File not found in file system\n");
-    return;
+    // the bits shifted in from the top read as used so a run never crosses the word
+    int32_t offset = block % 64;
+    uint64_t used = ~(fs->free_blocks[block / 64] >> offset);
+    int32_t run = used ? __builtin_ctzll(used) : 64;
+    len += run;
+    block += run;
+    if (offset + run < 64)
+    {
+      break;
+    }
   }
+  return (len < max) ? len : max;
+}
 
-  struct inode *file_inode = &inodes[directory[file_index].inode];
+// Next-fit search for a run of want free blocks, starting at free_block_hint and wrapping
+// around once. If no run is long enough the longest one seen is returned instead.
+// The run length is stored in *length and its first block returned, -1 if the disk is full.
+int32_t findFreeRun(struct mfs *fs, int32_t want, int32_t *length)
+{
+  int32_t best = -1;
+  int32_t best_len = 0;
 
-  if (!file_inode->in_use)
+  *length = 0;
+  if (*fs->free_block_count == 0)
   {
-    printf("ERROR: inode is not in use\n");
-    return;
+    return -1;
   }
 
-  i = 0;
-  uint32_t encrypt_size = file_inode->file_size;
-  int block_index = file_inode->blocks[0];
-
-  while (block_index != -1 && i < BLOCKS_PER_FILE && encrypt_size > 0)
+  int pass;
+  for (pass = 0; pass < 2 && best_len < want; pass++)
   {
-    uint32_t block_len;
+    int32_t end = (pass == 0) ? fs->num_blocks : fs->free_block_hint;
+    int32_t block = next_free_block(fs, (pass == 0) ? fs->free_block_hint : 0);
 
-    if (encrypt_size < BLOCK_SIZE)
-    {
-      block_len = encrypt_size;
-    }
-    else
+    while (block != -1 && block < end)
     {
-      block_len = BLOCK_SIZE;
+      int32_t len = free_run_length(fs, block, want);
+      if (len > best_len)
+      {
+        best = block;
+        best_len = len;
+        if (len == want)
+        {
+          break;
+        }
+      }
+      block = next_free_block(fs, block + len);
     }
+  }
 
-    encrypt_block(&data[block_index][0], cypher, block_len);
-
-    encrypt_size -= block_len;
-    i++;
-    block_index = file_inode->blocks[i];
+  if (best != -1)
+  {
+    fs->free_block_hint = (best + best_len) % fs->num_blocks;
   }
+  *length = best_len;
+  return best;
 }
 
-void retrieve(char *FName, char *NFName)
+int32_t findFreeInode(struct mfs *fs)
 {
-  if (FName == NULL)
+  int i;
+  for (i = 0; i < fs->num_files; i++)
   {
-    printf("ERROR: Filename is not here?");
-    return;
+    if (fs->free_inodes[i])
+    {
+      return i;
+    }
   }
-  int FFound = 0;
-  int DirEntry = -1;
-  for (int i = 0; i < NUM_FILES; i++)
+  return -1;
+}
+
+// Mark a block free (1) or used (0) in the free block bitmap, keep the free block count in
+// step and remember that both need saving. In an image that dedups a block held by more than
+// one file only loses one of them, and one being used again by a file brought back gains one.
+void set_free_block(struct mfs *fs, int32_t block, uint8_t value)
+{
+  uint64_t bit = (uint64_t)1 << (block % 64);
+  int is_free = (fs->free_blocks[block / 64] & bit) != 0;
+  struct blockRef *ref = fs->dedup ? &fs->block_refs[block] : NULL;
+  if (ref != NULL && !is_free && ref->refs > (value ? 1 : 0))
   {
-    if (directory[i].in_use && strcmp(directory[i].filename, FName) == 0)
+    if (value)
     {
-      FFound = 1;
-      DirEntry = i;
-      break;
+      ref->refs--;
+    }
+    else
+    {
+      ref->refs++;
     }
+    mark_dirty_range(fs, ref, sizeof(struct blockRef));
+    return;
   }
-  if (!FFound)
+  if (is_free == (value != 0))
   {
-    printf("ERROR: File not found\n");
     return;
   }
-  int32_t IIdx = directory[DirEntry].inode;
-  if (NFName == NULL)
+
+  if (value)
   {
-    NFName = FName;
+    fs->free_blocks[block / 64] |= bit;
+    (*fs->free_block_count)++;
   }
-  FILE *OutPFile = fopen(NFName, "w");
-  if (OutPFile == NULL)
+  else
   {
-    printf("ERROR:can't output file creation");
-    return;
+    fs->free_blocks[block / 64] &= ~bit;
+    (*fs->free_block_count)--;
   }
-  int32_t CSize = inodes[IIdx].file_size;
-  int32_t OffS = 0;
-  while (CSize > 0)
+  if (ref != NULL)
   {
-    int32_t BIdx = inodes[IIdx].blocks[OffS / BLOCK_SIZE];
-    int32_t BTW = (CSize > BLOCK_SIZE) ? BLOCK_SIZE : CSize;
-    fwrite(data[BIdx], BTW, 1, OutPFile);
-
-    CSize -= BLOCK_SIZE;
-    OffS += BLOCK_SIZE;
+    ref->refs = !value;
+    if (!value)
+    {
+      ref->claimed = ++*fs->dedup_clock;
+      mark_dirty_range(fs, fs->dedup_clock, sizeof(uint32_t));
+    }
+    mark_dirty_range(fs, ref, sizeof(struct blockRef));
   }
-  fclose(OutPFile);
+  mark_dirty_range(fs, &fs->free_blocks[block / 64], sizeof(uint64_t));
+  mark_dirty_range(fs, fs->free_block_count, sizeof(uint32_t));
 }
 
-void delete(char *filename)
+// Mark length blocks starting at start free (1) or used (0)
+void set_free_run(struct mfs *fs, int32_t start, int32_t length, uint8_t value)
 {
-  // verify the filename isnt NULL
-  if (filename == NULL)
+  int32_t block;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  for (block = start; block < start + length; block++)
   {
-    printf("ERROR: Filename is NULL. Cannot delete.\n");
-    return;
+    set_free_block(fs, block, value);
   }
+  pthread_mutex_unlock(&fs->alloc_lock);
+}
 
-  // FIND DIRECTORY IT IS UNDER
-  int directory_entry = -1;
-  for (int i = 0; i < NUM_FILES; i++)
+// Find a run of up to want free blocks like findFreeRun and mark it used in the same step,
+// so threads allocating at once never get the same blocks. Takes the allocator lock once
+// per run rather than once per block.
+int32_t claim_run(struct mfs *fs, int32_t want, int32_t *length)
+{
+  int32_t block;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  int32_t start = findFreeRun(fs, want, length);
+  for (block = start; start != -1 && block < start + *length; block++)
   {
-    if ((directory[i].in_use != 0) && (strcmp(directory[i].filename, filename) == 0))
-    {
-      // finds directory in use
-      directory_entry = i;
+    set_free_block(fs, block, 0);
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return start;
+}
 
-      //checks if the read attribute is set
-      if (inodes[i].attribute & READONLY)
-      {
-        printf("This file is marked read-only. Cannot be deleted.\n");
-      }
+// Update an entry of the free inode map and remember that its block needs saving
+void set_free_inode(struct mfs *fs, int32_t index, uint8_t value)
+{
+  fs->free_inodes[index] = value;
+  mark_dirty_range(fs, &fs->free_inodes[index], 1);
+}
+
+// EXTENT TREE
+// An inode holds EXTENTS_PER_FILE extents itself. A file with more keeps DIRECT_EXTENTS of
+// them there and gives the last three slots to indirect blocks, like the classic Unix inode:
+// one block of extents, one of block numbers of blocks of extents, and one of block numbers
+// of blocks like that. The start of the slot names the block, -1 until it is needed. The
+// extents come in the order of the file, across the inode first and then down each level.
+
+// Mark len bytes of an indirect block changed
+void mark_tree_dirty(struct mfs *fs, void *ptr, size_t len)
+{
+  int32_t block = ((uint8_t *)ptr - fs->data) / fs->block_size;
+  __atomic_fetch_or(&fs->tree_blocks[block / 64], (uint64_t)1 << (block % 64), __ATOMIC_RELAXED);
+  mark_dirty_range(fs, ptr, len);
+}
+
+// Whether the extents of a file go on into indirect blocks
+int has_tree(struct inode *file_inode)
+{
+  return file_inode->num_extents > EXTENTS_PER_FILE;
+}
+
+// Extents that the level of indirect block in slot DIRECT_EXTENTS + level leads to
+int64_t level_span(struct mfs *fs, int level)
+{
+  int64_t span = fs->block_size / sizeof(struct extent);
+  for (; level > 0; level--)
+  {
+    span *= fs->block_size / sizeof(int32_t);
+  }
+  return span;
+}
+
+// Find the extent at index in a file, which must be below num_extents, looking in path first
+// and leaving it at the block the extent was found in. Returns NULL if an indirect block on
+// the way couldn't be read in.
+struct extent *file_extent(struct mfs *fs, struct inode *file_inode, int32_t index,
+                           struct extentPath *path)
+{
+  if (index >= path->first && index < path->first + path->count)
+  {
+    return &path->extents[index - path->first];
+  }
+
+  if (!has_tree(file_inode) || index < DIRECT_EXTENTS)
+  {
+    path->first = 0;
+    path->count = has_tree(file_inode) ? DIRECT_EXTENTS : EXTENTS_PER_FILE;
+    path->extents = file_inode->extents;
+    return &file_inode->extents[index];
+  }
+
+  // Find the level the extent is under, then go down through the blocks of block numbers
+  int64_t rest = index - DIRECT_EXTENTS;
+  int level = 0;
+  while (rest >= level_span(fs, level))
+  {
+    rest -= level_span(fs, level);
+    level++;
+  }
+  int32_t block = file_inode->extents[DIRECT_EXTENTS + level].start;
+  for (; level > 0; level--)
+  {
+    int64_t span = level_span(fs, level - 1);
+    int32_t *pointers = (int32_t *)cache_blocks(fs, block, 1);
+    if (pointers == NULL)
+    {
+      return NULL;
+    }
+    block = pointers[rest / span];
+    rest %= span;
+  }
+
+  struct extent *extents = (struct extent *)cache_blocks(fs, block, 1);
+  if (extents == NULL)
+  {
+    return NULL;
+  }
+  path->first = index - rest;
+  path->count = fs->block_size / sizeof(struct extent);
+  path->extents = extents;
+  return &path->extents[rest];
+}
+
+// Claim a block for the tree, every entry -1. Returns the block or -1 if the image is full
+// or the block couldn't be read in.
+int32_t new_tree_block(struct mfs *fs)
+{
+  int32_t length;
+  int32_t block = claim_run(fs, 1, &length);
+  if (block == -1)
+  {
+    return -1;
+  }
+  uint8_t *contents = cache_blocks(fs, block, 1);
+  if (contents == NULL)
+  {
+    set_free_run(fs, block, 1, 1);
+    return -1;
+  }
+  memset(contents, 0xff, fs->block_size);
+  mark_tree_dirty(fs, contents, fs->block_size);
+  return block;
+}
+
+// Make sure the indirect blocks leading to the extent at index exist, the one after the last
+// of a file, claiming any that are missing. Returns -1 if the image has no room for them or
+// one of them couldn't be read in.
+int grow_tree(struct mfs *fs, struct inode *file_inode, int32_t index)
+{
+  // The first extent past the inode moves the last three slots out to the first block
+  if (index == EXTENTS_PER_FILE)
+  {
+    int32_t block = new_tree_block(fs);
+    if (block == -1)
+    {
+      return -1;
+    }
+    // new_tree_block just filled it, so it is cached
+    struct extent *moved = (struct extent *)block_data(fs, block);
+    memcpy(moved, &file_inode->extents[DIRECT_EXTENTS],
+           (EXTENTS_PER_FILE - DIRECT_EXTENTS) * sizeof(struct extent));
+    int level;
+    for (level = 0; level < INDIRECT_LEVELS; level++)
+    {
+      file_inode->extents[DIRECT_EXTENTS + level].start = (level == 0) ? block : -1;
+      file_inode->extents[DIRECT_EXTENTS + level].length = 0;
+    }
+    return 0;
+  }
+  if (index < EXTENTS_PER_FILE)
+  {
+    return 0;
+  }
+
+  int64_t rest = index - DIRECT_EXTENTS;
+  int level = 0;
+  while (level < INDIRECT_LEVELS && rest >= level_span(fs, level))
+  {
+    rest -= level_span(fs, level);
+    level++;
+  }
+  if (level == INDIRECT_LEVELS)
+  {
+    return -1;
+  }
+
+  // the slots in the inode are saved with it by the caller
+  int32_t *slot = &file_inode->extents[DIRECT_EXTENTS + level].start;
+  int in_inode = 1;
+  for (;;)
+  {
+    if (*slot == -1)
+    {
+      int32_t block = new_tree_block(fs);
+      if (block == -1)
+      {
+        return -1;
+      }
+      *slot = block;
+      if (!in_inode)
+      {
+        mark_tree_dirty(fs, slot, sizeof(int32_t));
+      }
+    }
+    if (level == 0)
+    {
+      return 0;
+    }
+    int64_t span = level_span(fs, level - 1);
+    int32_t *pointers = (int32_t *)cache_blocks(fs, *slot, 1);
+    if (pointers == NULL)
+    {
+      return -1;
+    }
+    slot = &pointers[rest / span];
+    rest %= span;
+    level--;
+    in_inode = 0;
+  }
+}
+
+// Add a run of blocks to the end of a file, growing the last extent when the run follows
+// straight on from it. Returns -1 if the file can't hold another extent, there is no room
+// for the indirect block it needs or the one the last extent is in couldn't be read in.
+int append_extent(struct mfs *fs, struct inode *file_inode, int32_t start, int32_t length)
+{
+  int32_t count = file_inode->num_extents;
+  struct extentPath path = {0};
+
+  struct extent *ext = (count > 0) ? file_extent(fs, file_inode, count - 1, &path) : NULL;
+  if (count > 0 && ext == NULL)
+  {
+    return -1;
+  }
+  if (ext != NULL && ext->start + ext->length == start)
+  {
+    ext->length += length;
+  }
+  else
+  {
+    if (grow_tree(fs, file_inode, count) == -1)
+    {
+      return -1;
+    }
+    file_inode->num_extents++;
+    path.count = 0;
+    ext = file_extent(fs, file_inode, count, &path);
+    if (ext == NULL)
+    {
+      file_inode->num_extents--;
+      return -1;
+    }
+    ext->start = start;
+    ext->length = length;
+  }
+
+  if (path.extents != file_inode->extents)
+  {
+    mark_tree_dirty(fs, ext, sizeof(struct extent));
+  }
+  file_inode->num_blocks += length;
+  return 0;
+}
+
+// Walk one indirect block and everything under it, level 0 being a block of extents that
+// starts with the extent at first. count is how many extents the file has.
+int visit_tree(struct mfs *fs, int32_t block, int level, int64_t first, int32_t count,
+               int (*visit)(struct mfs *fs, int32_t start, int32_t length, void *arg),
+               void *arg)
+{
+  if (block < fs->first_data_block || block >= fs->num_blocks)
+  {
+    return -1;
+  }
+  int ret = visit(fs, block, 1, arg);
+  if (ret != 0)
+  {
+    return ret;
+  }
+
+  if (level == 0)
+  {
+    struct extent *extents = (struct extent *)cache_blocks(fs, block, 1);
+    if (extents == NULL)
+    {
+      return -1;
+    }
+    int64_t i;
+    for (i = 0; i < level_span(fs, 0) && first + i < count && ret == 0; i++)
+    {
+      ret = visit(fs, extents[i].start, extents[i].length, arg);
+    }
+    return ret;
+  }
+
+  int32_t *pointers = (int32_t *)cache_blocks(fs, block, 1);
+  if (pointers == NULL)
+  {
+    return -1;
+  }
+  int64_t span = level_span(fs, level - 1);
+  int64_t i;
+  for (i = 0; i < fs->block_size / (int64_t)sizeof(int32_t) && first < count && ret == 0; i++)
+  {
+    ret = visit_tree(fs, pointers[i], level - 1, first, count, visit, arg);
+    first += span;
+  }
+  return ret;
+}
+
+// Call visit on every run of blocks a file holds, its extents and the indirect blocks they
+// are kept in. An indirect block is visited before anything is read from it, so visit can
+// refuse one that was reused since a file was deleted. Stops at the first visit that returns
+// nonzero and returns that, or -1 for a block number outside the image or an indirect block
+// that couldn't be read in.
+int visit_file_blocks(struct mfs *fs, struct inode *file_inode,
+                      int (*visit)(struct mfs *fs, int32_t start, int32_t length, void *arg),
+                      void *arg)
+{
+  int32_t count = file_inode->num_extents;
+  int32_t direct = has_tree(file_inode) ? DIRECT_EXTENTS : count;
+  int ret = 0;
+  int32_t i;
+
+  for (i = 0; i < direct && ret == 0; i++)
+  {
+    ret = visit(fs, file_inode->extents[i].start, file_inode->extents[i].length, arg);
+  }
+
+  int64_t first = DIRECT_EXTENTS;
+  int level;
+  for (level = 0; has_tree(file_inode) && level < INDIRECT_LEVELS && first < count && ret == 0;
+       level++)
+  {
+    ret = visit_tree(fs, file_inode->extents[DIRECT_EXTENTS + level].start, level, first,
+                     count, visit, arg);
+    first += level_span(fs, level);
+  }
+  return ret;
+}
+
+int set_free_visit(struct mfs *fs, int32_t start, int32_t length, void *arg)
+{
+  set_free_run(fs, start, length, *(uint8_t *)arg);
+  return 0;
+}
+
+// Mark every block of a file, indirect blocks included, free (1) or used (0), leaving the
+// inode as it is so a deleted file can still be brought back. A file packed into a tail
+// block lets go of its place there instead.
+void free_file_blocks(struct mfs *fs, struct inode *file_inode, uint8_t value)
+{
+  if (is_packed(file_inode))
+  {
+    if (file_inode->file_size > INLINE_SIZE)
+    {
+      tail_release(fs, (struct tailRef *)file_inode->extents, value);
+    }
+    return;
+  }
+  visit_file_blocks(fs, file_inode, set_free_visit, &value);
+}
+
+// Free the indirect blocks under block, at level, that hold no extent before keep. first is
+// the index of the first extent under it. Returns 1 if block itself was freed. The blocks
+// under one that can't be read in stay claimed, since nothing can tell which they are.
+int prune_tree(struct mfs *fs, int32_t block, int level, int64_t first, int32_t keep)
+{
+  int32_t *pointers = (level > 0) ? (int32_t *)cache_blocks(fs, block, 1) : NULL;
+  if (pointers != NULL)
+  {
+    int64_t span = level_span(fs, level - 1);
+    int64_t i;
+    for (i = 0; i < fs->block_size / (int64_t)sizeof(int32_t); i++)
+    {
+      if (pointers[i] != -1 && prune_tree(fs, pointers[i], level - 1, first + i * span, keep))
+      {
+        pointers[i] = -1;
+        mark_tree_dirty(fs, &pointers[i], sizeof(int32_t));
+      }
+    }
+  }
+  if (first >= keep)
+  {
+    set_free_run(fs, block, 1, 1);
+    return 1;
+  }
+  return 0;
+}
+
+// Free the indirect blocks of a file and leave its data blocks alone
+void free_tree_blocks(struct mfs *fs, struct inode *file_inode)
+{
+  int64_t first = DIRECT_EXTENTS;
+  int level;
+  for (level = 0; has_tree(file_inode) && level < INDIRECT_LEVELS; level++)
+  {
+    if (file_inode->extents[DIRECT_EXTENTS + level].start != -1)
+    {
+      prune_tree(fs, file_inode->extents[DIRECT_EXTENTS + level].start, level, first, 0);
+    }
+    first += level_span(fs, level);
+  }
+}
+
+// Cut a file down to its first keep blocks, freeing the blocks after them and any indirect
+// blocks no longer needed. A file left with few enough extents has them back in its inode.
+// A file with an indirect block that can't be read in is left as it is, holding its blocks.
+void truncate_extents(struct mfs *fs, struct inode *file_inode, int32_t keep)
+{
+  struct extentPath path = {0};
+  int32_t count = file_inode->num_extents;
+  int32_t blocks = 0;
+  int32_t kept = 0;
+  int32_t i;
+
+  // once every extent has been read the blocks they are in stay cached
+  for (i = 0; i < count; i++)
+  {
+    if (file_extent(fs, file_inode, i, &path) == NULL)
+    {
+      return;
+    }
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (blocks + ext->length <= keep)
+    {
+      blocks += ext->length;
+      kept = i + 1;
+      continue;
+    }
+
+    int32_t cut = (blocks < keep) ? keep - blocks : 0;
+    set_free_run(fs, ext->start + cut, ext->length - cut, 1);
+    blocks += ext->length;
+    if (cut > 0)
+    {
+      ext->length = cut;
+      kept = i + 1;
+      if (path.extents != file_inode->extents)
+      {
+        mark_tree_dirty(fs, ext, sizeof(struct extent));
+      }
+    }
+  }
+
+  if (has_tree(file_inode))
+  {
+    struct extent roots[INDIRECT_LEVELS];
+    memcpy(roots, &file_inode->extents[DIRECT_EXTENTS], sizeof(roots));
+
+    // the extents still in the first block move back into the inode
+    if (kept <= EXTENTS_PER_FILE)
+    {
+      memcpy(&file_inode->extents[DIRECT_EXTENTS], block_data(fs, roots[0].start),
+             (EXTENTS_PER_FILE - DIRECT_EXTENTS) * sizeof(struct extent));
+    }
+
+    int64_t first = DIRECT_EXTENTS;
+    int level;
+    for (level = 0; level < INDIRECT_LEVELS; level++)
+    {
+      int32_t limit = (kept <= EXTENTS_PER_FILE) ? 0 : kept;
+      if (roots[level].start != -1 && prune_tree(fs, roots[level].start, level, first, limit) &&
+          kept > EXTENTS_PER_FILE)
+      {
+        file_inode->extents[DIRECT_EXTENTS + level].start = -1;
+      }
+      first += level_span(fs, level);
+    }
+  }
+  if (kept <= EXTENTS_PER_FILE)
+  {
+    memset(&file_inode->extents[kept], 0, (EXTENTS_PER_FILE - kept) * sizeof(struct extent));
+  }
+
+  file_inode->num_extents = kept;
+  file_inode->num_blocks = (blocks < keep) ? blocks : keep;
+}
+
+// PACKED FILES
+// A file with a size but no blocks is packed, see struct tailRef. Tail blocks only ever have
+// files added at the end, so the bytes of a deleted file stay put until every file in the
+// block is gone and the block is freed. They are journaled with the metadata like indirect
+// blocks, since they are rewritten in part.
+int is_packed(struct inode *file_inode)
+{
+  return file_inode->num_blocks == 0 && file_inode->file_size > 0;
+}
+
+// Where the bytes of a packed file are, or NULL if its tail block couldn't be read in
+uint8_t *packed_data(struct mfs *fs, struct inode *file_inode)
+{
+  if (file_inode->file_size <= INLINE_SIZE)
+  {
+    return (uint8_t *)file_inode->extents;
+  }
+  struct tailRef *ref = (struct tailRef *)file_inode->extents;
+  uint8_t *tail = cache_blocks(fs, ref->block, 1);
+  return (tail == NULL) ? NULL : tail + ref->offset;
+}
+
+// Remember that the bytes of a packed file changed. They were just written, so its tail
+// block is cached.
+void mark_packed_dirty(struct mfs *fs, struct inode *file_inode)
+{
+  if (file_inode->file_size <= INLINE_SIZE)
+  {
+    mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  }
+  else
+  {
+    struct tailRef *ref = (struct tailRef *)file_inode->extents;
+    mark_tree_dirty(fs, block_data(fs, ref->block) + ref->offset, file_inode->file_size);
+  }
+}
+
+// Make room for size bytes of a file to be packed, in its inode if they fit and at the end
+// of the current tail block if not, starting a new one when that is full. The file must have
+// no blocks. Returns MFS_OK, or if a tail block was needed MFS_ENOSPC when the image is full
+// and MFS_EIO when it couldn't be read in or given a generation, leaving the inode as it was.
+int pack_reserve(struct mfs *fs, struct inode *file_inode, uint32_t size)
+{
+  if (size <= INLINE_SIZE)
+  {
+    memset(file_inode->extents, 0, sizeof(file_inode->extents));
+    return MFS_OK;
+  }
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  struct tailHeader *tail = NULL;
+  if (fs->tail_block != -1)
+  {
+    tail = (struct tailHeader *)cache_blocks(fs, fs->tail_block, 1);
+    if (tail != NULL && tail->used + size > (uint32_t)fs->block_size)
+    {
+      tail = NULL;
+    }
+  }
+  if (tail == NULL)
+  {
+    int32_t length;
+    int32_t block = findFreeRun(fs, 1, &length);
+    if (block == -1)
+    {
+      pthread_mutex_unlock(&fs->alloc_lock);
+      return MFS_ENOSPC;
+    }
+    uint32_t generation;
+    tail = (struct tailHeader *)cache_blocks(fs, block, 1);
+    if (tail == NULL ||
+        getrandom(&generation, sizeof(generation), 0) != sizeof(generation))
+    {
+      pthread_mutex_unlock(&fs->alloc_lock);
+      return MFS_EIO;
+    }
+    set_free_block(fs, block, 0);
+    tail->magic = TAIL_MAGIC;
+    tail->generation = generation;
+    tail->live = 0;
+    tail->used = sizeof(struct tailHeader);
+    fs->tail_block = block;
+  }
+
+  memset(file_inode->extents, 0, sizeof(file_inode->extents));
+  struct tailRef *ref = (struct tailRef *)file_inode->extents;
+  ref->block = fs->tail_block;
+  ref->offset = tail->used;
+  ref->generation = tail->generation;
+  tail->used += size;
+  tail->live++;
+  mark_tree_dirty(fs, tail, sizeof(struct tailHeader));
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return MFS_OK;
+}
+
+// Let go of (1) or take back (0) the packed bytes ref points to. The tail block is freed
+// with the last file in it, and kept if it can't be read in to tell.
+void tail_release(struct mfs *fs, struct tailRef *ref, uint8_t value)
+{
+  pthread_mutex_lock(&fs->alloc_lock);
+  struct tailHeader *tail = (struct tailHeader *)cache_blocks(fs, ref->block, 1);
+  if (tail == NULL)
+  {
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return;
+  }
+  if (value)
+  {
+    tail->live--;
+  }
+  else
+  {
+    tail->live++;
+  }
+  mark_tree_dirty(fs, tail, sizeof(struct tailHeader));
+  if (tail->live == 0)
+  {
+    set_free_block(fs, ref->block, 1);
+    if (fs->tail_block == ref->block)
+    {
+      fs->tail_block = -1;
+    }
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// Whether the tail block a deleted file was packed into still holds its bytes
+int tail_intact(struct mfs *fs, struct inode *file_inode)
+{
+  struct tailRef *ref = (struct tailRef *)file_inode->extents;
+  if (ref->block < fs->first_data_block || ref->block >= fs->num_blocks ||
+      free_run_length(fs, ref->block, 1) != 0)
+  {
+    return 0;
+  }
+  struct tailHeader *tail = (struct tailHeader *)cache_blocks(fs, ref->block, 1);
+  return tail != NULL && tail->magic == TAIL_MAGIC && tail->generation == ref->generation &&
+         ref->offset >= sizeof(struct tailHeader) &&
+         ref->offset + file_inode->file_size <= tail->used;
+}
+
+// COMPRESSED FILES
+// See CHUNK_RAW for how their blocks are laid out. They are written once, by insert, and
+// stored as they are again before anything changes them.
+
+// Copy len of the bytes stored in a file's blocks at offset out to buf, or with write in from
+// buf, without decrypting or decompressing them. The range must lie inside the blocks. The
+// extents are walked from cursor like copy_range does, and it is left at the last one used.
+// Returns 0, or -1 if the blocks couldn't be read in.
+int copy_stored(struct mfs *fs, struct inode *file_inode, uint32_t offset, uint8_t *buf,
+                uint32_t len, int write, uint64_t *cursor)
+{
+  struct extentPath path = {0};
+  uint32_t end = offset + len;
+  int32_t i = *cursor >> 32;
+  uint32_t extent_offset = (uint32_t)*cursor;
+
+  if (len == 0)
+  {
+    return 0;
+  }
+  if (i >= file_inode->num_extents || extent_offset > offset)
+  {
+    i = 0;
+    extent_offset = 0;
+  }
+
+  for (; i < file_inode->num_extents && extent_offset < end; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (ext == NULL)
+    {
+      return -1;
+    }
+    uint32_t extent_bytes = (uint32_t)ext->length * fs->block_size;
+    if (offset < extent_offset + extent_bytes)
+    {
+      uint32_t from = (offset > extent_offset) ? offset : extent_offset;
+      uint32_t to = (end < extent_offset + extent_bytes) ? end : extent_offset + extent_bytes;
+      int32_t first = ext->start + (from - extent_offset) / fs->block_size;
+      int32_t last = ext->start + (to - 1 - extent_offset) / fs->block_size;
+      uint8_t *disk = cache_blocks(fs, first, last - first + 1);
+      if (disk == NULL)
+      {
+        return -1;
+      }
+      disk += (from - extent_offset) % fs->block_size;
+      if (write)
+      {
+        memcpy(disk, buf + (from - offset), to - from);
+        mark_dirty_range(fs, disk, to - from);
+      }
+      else
+      {
+        memcpy(buf + (from - offset), disk, to - from);
+      }
+      *cursor = ((uint64_t)i << 32) | extent_offset;
+    }
+    extent_offset += extent_bytes;
+  }
+  return 0;
+}
+
+// Read len stored bytes of a compressed file at offset into buf, decrypted if the file is
+// encrypted. The keystream starts on a ChaCha20 block, so buf needs room for up to
+// CHACHA20_BLOCK bytes more than len. Returns where the bytes start in buf, or NULL if they
+// couldn't be read in.
+uint8_t *stored_bytes(struct mfs *fs, int32_t inode_index, struct inode *file_inode,
+                      uint32_t offset, uint32_t len, uint8_t *buf, uint64_t *cursor)
+{
+  int encrypted = file_inode->attribute & ENCRYPTED;
+  uint32_t lead = encrypted ? offset % CHACHA20_BLOCK : 0;
+
+  if (copy_stored(fs, file_inode, offset - lead, buf, lead + len, 0, cursor) == -1)
+  {
+    return NULL;
+  }
+  if (encrypted)
+  {
+    crypt_range(fs, inode_index, offset - lead, buf, lead + len);
+  }
+  return buf + lead;
+}
+
+// Write len bytes from buf into a compressed file's stored bytes at offset, encrypted on the
+// way if the file is encrypted so they never land in the image in the clear. Returns 0, or -1
+// if out of memory or the blocks couldn't be read in.
+int put_stored(struct mfs *fs, int32_t inode_index, struct inode *file_inode, uint32_t offset,
+               uint8_t *buf, uint32_t len, uint64_t *cursor)
+{
+  if (!(file_inode->attribute & ENCRYPTED))
+  {
+    return copy_stored(fs, file_inode, offset, buf, len, 1, cursor);
+  }
+
+  // the keystream starts on a ChaCha20 block, up to one of them before offset
+  uint32_t lead = offset % CHACHA20_BLOCK;
+  uint8_t *sealed = malloc(lead + len);
+  if (sealed == NULL)
+  {
+    return -1;
+  }
+  memset(sealed, 0, lead);
+  memcpy(sealed + lead, buf, len);
+  crypt_range(fs, inode_index, offset - lead, sealed, lead + len);
+  int ret = copy_stored(fs, file_inode, offset, sealed + lead, len, 1, cursor);
+  free(sealed);
+  return ret;
+}
+
+// Decompress a block of a compressed file into out, which holds a block. scratch needs room
+// for a block and CHACHA20_BLOCK bytes more. file_inode may be a copy of the inode. Returns
+// the bytes of the file in the block, or -1 if what is stored for it is damaged or couldn't
+// be read in.
+int inflate_block(struct mfs *fs, int32_t inode_index, struct inode *file_inode, int32_t block,
+                  uint8_t *out, uint8_t *scratch, uint64_t *cursor)
+{
+  uint32_t block_size = fs->block_size;
+  uint32_t count = (file_inode->file_size + block_size - 1) / block_size;
+  uint32_t map_bytes = count * sizeof(uint32_t);
+  uint32_t plain_len = file_inode->file_size - (uint32_t)block * block_size;
+  if (plain_len > block_size)
+  {
+    plain_len = block_size;
+  }
+
+  // the block runs from where the one before it ends
+  uint8_t map_buf[2 * sizeof(uint32_t) + CHACHA20_BLOCK];
+  uint32_t ends[2] = {0, 0};
+  memset(map_buf, 0, sizeof(map_buf));
+  uint32_t map_offset = (block == 0) ? 0 : (block - 1) * sizeof(uint32_t);
+  uint32_t map_len = (block == 0) ? sizeof(uint32_t) : sizeof(ends);
+  uint8_t *map = stored_bytes(fs, inode_index, file_inode, map_offset, map_len, map_buf, cursor);
+  if (map == NULL)
+  {
+    return -1;
+  }
+  memcpy((block == 0) ? &ends[1] : ends, map, map_len);
+
+  uint32_t start = ends[0] & ~CHUNK_RAW;
+  uint32_t end = ends[1] & ~CHUNK_RAW;
+  if (end < start || end - start > block_size ||
+      (uint64_t)map_bytes + end > (uint64_t)file_inode->num_blocks * block_size)
+  {
+    return -1;
+  }
+
+  uint8_t *chunk = stored_bytes(fs, inode_index, file_inode, map_bytes + start, end - start,
+                                scratch, cursor);
+  if (chunk == NULL)
+  {
+    return -1;
+  }
+  if (ends[1] & CHUNK_RAW)
+  {
+    if (end - start != plain_len)
+    {
+      return -1;
+    }
+    memcpy(out, chunk, plain_len);
+  }
+  else if (lz_decompress(chunk, end - start, out, plain_len) != (int)plain_len)
+  {
+    return -1;
+  }
+  return plain_len;
+}
+
+// Drop the decompressed blocks kept for an inode, before it holds another file
+void forget_inflated(struct mfs *fs, int32_t inode_index)
+{
+  int i;
+
+  pthread_mutex_lock(&fs->inflate_lock);
+  for (i = 0; i < INFLATE_CACHE; i++)
+  {
+    if (fs->inflated[i].inode == inode_index)
+    {
+      fs->inflated[i].inode = -1;
+    }
+  }
+  pthread_mutex_unlock(&fs->inflate_lock);
+}
+
+// Copy len bytes at offset in a compressed file out to buf. The range must lie inside the
+// file. Whole blocks are decompressed straight into buf, and blocks read in part go through
+// the image's cache of decompressed blocks. Returns MFS_OK, MFS_ENOMEM or MFS_EIO if the
+// file is damaged.
+int read_compressed(struct mfs *fs, int32_t inode_index, uint8_t *buf, uint32_t offset,
+                    uint32_t len, uint64_t *cursor)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  uint32_t block_size = fs->block_size;
+  uint32_t end = offset + len;
+  uint64_t hint = __atomic_load_n(cursor, __ATOMIC_RELAXED);
+  int ret = MFS_OK;
+  int i;
+
+  uint8_t *scratch = malloc(block_size + CHACHA20_BLOCK);
+  uint8_t *partial = malloc(block_size);
+  if (scratch == NULL || partial == NULL)
+  {
+    free(scratch);
+    free(partial);
+    return MFS_ENOMEM;
+  }
+
+  uint32_t from = offset;
+  while (from < end)
+  {
+    int32_t block = from / block_size;
+    uint32_t block_start = (uint32_t)block * block_size;
+    uint32_t to = (end - block_start < block_size) ? end : block_start + block_size;
+    if (from == block_start && (to == block_start + block_size || to == file_inode->file_size))
+    {
+      if (inflate_block(fs, inode_index, file_inode, block, buf + (from - offset), scratch,
+                        &hint) == -1)
+      {
+        ret = MFS_EIO;
+        break;
+      }
+      from = to;
+      continue;
+    }
+
+    int found = 0;
+    pthread_mutex_lock(&fs->inflate_lock);
+    for (i = 0; i < INFLATE_CACHE && !found; i++)
+    {
+      if (fs->inflated[i].inode == inode_index && fs->inflated[i].block == block)
+      {
+        memcpy(partial, fs->inflated[i].data, block_size);
+        found = 1;
+      }
+    }
+    pthread_mutex_unlock(&fs->inflate_lock);
+
+    if (!found)
+    {
+      if (inflate_block(fs, inode_index, file_inode, block, partial, scratch, &hint) == -1)
+      {
+        ret = MFS_EIO;
+        break;
+      }
+      pthread_mutex_lock(&fs->inflate_lock);
+      struct inflatedBlock *slot = &fs->inflated[fs->inflate_next];
+      fs->inflate_next = (fs->inflate_next + 1) % INFLATE_CACHE;
+      slot->inode = inode_index;
+      slot->block = block;
+      memcpy(slot->data, partial, block_size);
+      pthread_mutex_unlock(&fs->inflate_lock);
+    }
+    memcpy(buf + (from - offset), partial + (from - block_start), to - from);
+    from = to;
+  }
+  __atomic_store_n(cursor, hint, __ATOMIC_RELAXED);
+
+  free(scratch);
+  free(partial);
+  return ret;
+}
+
+// Fill a reserved compressed file from fd, compressing it a block at a time into its blocks
+// and giving back the blocks it doesn't need. Returns 0, -1 if fd or the image couldn't be
+// read, or 1 if the file doesn't shrink by at least a block, in which case it is no longer
+// marked compressed and is left to be filled as it is.
+int compress_file(struct mfs *fs, int32_t inode_index, int fd)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  struct extentPath path = {0};
+  uint32_t block_size = fs->block_size;
+  uint32_t size = file_inode->file_size;
+  int32_t count = (size + block_size - 1) / block_size;
+  uint32_t map_bytes = count * sizeof(uint32_t);
+  uint64_t limit = (uint64_t)(count - 1) * block_size;
+  uint64_t cursor = 0;
+  uint32_t used = 0; // bytes of compressed blocks after the map
+  int32_t block = 0;
+  int ret = 1;
+  int32_t i;
+
+  uint32_t *map = malloc(map_bytes);
+  uint8_t *in = malloc(READ_CHUNK);
+  uint8_t *out = malloc(block_size);
+  uint32_t offset;
+  for (offset = 0; map != NULL && in != NULL && out != NULL && offset < size;)
+  {
+    uint32_t bytes = (size - offset < READ_CHUNK) ? size - offset : READ_CHUNK;
+    uint32_t got = 0;
+    while (got < bytes)
+    {
+      ssize_t n = pread(fd, in + got, bytes - got, offset + got);
+      if (n <= 0)
+      {
+        break;
+      }
+      got += n;
+    }
+    if (got < bytes)
+    {
+      ret = -1;
+      break;
+    }
+
+    // a block is only stored compressed if that makes it smaller
+    uint32_t done;
+    for (done = 0; done < bytes; done += block_size, block++)
+    {
+      uint32_t plain_len = (bytes - done < block_size) ? bytes - done : block_size;
+      uint8_t *chunk = out;
+      uint32_t raw = 0;
+      size_t chunk_len = lz_compress(in + done, plain_len, out, plain_len - 1);
+      if (chunk_len == 0)
+      {
+        chunk = in + done;
+        chunk_len = plain_len;
+        raw = CHUNK_RAW;
+      }
+      if (map_bytes + used + chunk_len > limit)
+      {
+        break;
+      }
+      if (put_stored(fs, inode_index, file_inode, map_bytes + used, chunk, chunk_len,
+                     &cursor) == -1)
+      {
+        ret = -1;
+        break;
+      }
+      used += chunk_len;
+      map[block] = used | raw;
+    }
+    offset += bytes;
+    if (done < bytes)
+    {
+      break;
+    }
+    if (offset == size)
+    {
+      ret = 0;
+    }
+  }
+
+  if (ret == 1)
+  {
+    file_inode->attribute &= ~COMPRESSED;
+    mark_dirty_range(fs, file_inode, sizeof(struct inode));
+    for (i = 0; i < file_inode->num_extents; i++)
+    {
+      struct extent *ext = file_extent(fs, file_inode, i, &path);
+      if (ext == NULL)
+      {
+        break;
+      }
+      mark_dirty_range(fs, block_data(fs, ext->start), (size_t)ext->length * fs->block_size);
+    }
+  }
+  else if (ret == 0)
+  {
+    // the map goes in front and the rest of the last block is zeroed, left unencrypted so
+    // no keystream past the stored bytes is given away
+    uint64_t map_cursor = 0;
+    uint32_t stored = map_bytes + used;
+    int32_t keep = (stored + block_size - 1) / block_size;
+    memset(out, 0, block_size);
+    uint32_t pad = (uint32_t)keep * block_size - stored;
+    if (put_stored(fs, inode_index, file_inode, 0, (uint8_t *)map, map_bytes,
+                   &map_cursor) == -1 ||
+        copy_stored(fs, file_inode, stored, out, pad, 1, &cursor) == -1)
+    {
+      ret = -1;
+    }
+    else
+    {
+      truncate_extents(fs, file_inode, keep);
+      mark_dirty_range(fs, file_inode, sizeof(struct inode));
+    }
+  }
+
+  free(map);
+  free(in);
+  free(out);
+  return ret;
+}
+
+// Store a compressed file as it is again, so it can be changed in place. Every block is
+// decompressed straight into new blocks and the old ones are freed once they all are. An
+// encrypted file moves to a new generation, since its compressed bytes used the keystream the
+// plain ones would. Returns MFS_OK or an MFS_E code, in which case the file is left compressed.
+int inflate_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  struct inode before = *file_inode;
+  uint32_t block_size = fs->block_size;
+  int32_t need = (file_inode->file_size + block_size - 1) / block_size;
+  int ret = MFS_OK;
+
+  if ((uint64_t)need * block_size > df(fs))
+  {
+    return MFS_ENOSPC;
+  }
+  // an encrypted file's blocks are decompressed and encrypted in the block after scratch
+  int encrypted = file_inode->attribute & ENCRYPTED;
+  uint8_t *scratch = malloc(2 * (size_t)block_size + CHACHA20_BLOCK);
+  if (scratch == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+  uint8_t *plain = scratch + block_size + CHACHA20_BLOCK;
+  if (encrypted && new_generation(fs, inode_index) == -1)
+  {
+    free(scratch);
+    return MFS_EIO;
+  }
+  uint32_t generation = file_inode->generation;
+
+  memset(file_inode->extents, 0, sizeof(file_inode->extents));
+  file_inode->num_extents = 0;
+  file_inode->num_blocks = 0;
+  while (file_inode->num_blocks < need)
+  {
+    int32_t length;
+    int32_t start = claim_run(fs, need - file_inode->num_blocks, &length);
+    if (start != -1 && append_extent(fs, file_inode, start, length) == -1)
+    {
+      set_free_run(fs, start, length, 1);
+      start = -1;
+    }
+    if (start == -1)
+    {
+      ret = MFS_EFRAGMENTED;
+      break;
+    }
+  }
+
+  struct extentPath path = {0};
+  uint64_t cursor = 0;
+  int32_t block = 0;
+  int32_t i;
+  for (i = 0; ret == MFS_OK && i < file_inode->num_extents; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    uint8_t *dest = (ext == NULL) ? NULL : cache_blocks(fs, ext->start, ext->length);
+    if (dest == NULL)
+    {
+      ret = MFS_EIO;
+      break;
+    }
+    size_t extent_bytes = (size_t)ext->length * block_size;
+    int32_t j;
+    for (j = 0; j < ext->length; j++)
+    {
+      uint8_t *out = dest + (size_t)j * block_size;
+      uint8_t *into = encrypted ? plain : out;
+      file_inode->generation = before.generation;
+      int bytes = inflate_block(fs, inode_index, &before, block + j, into, scratch, &cursor);
+      file_inode->generation = generation;
+      if (bytes == -1)
+      {
+        ret = MFS_EIO;
+        break;
+      }
+      memset(into + bytes, 0, block_size - bytes);
+      if (encrypted)
+      {
+        crypt_range(fs, inode_index, (uint32_t)(block + j) * block_size, plain, bytes);
+        memcpy(out, plain, block_size);
+      }
+    }
+    mark_dirty_range(fs, dest, extent_bytes);
+    block += ext->length;
+  }
+  free(scratch);
+
+  if (ret != MFS_OK)
+  {
+    truncate_extents(fs, file_inode, 0);
+    *file_inode = before;
+    return ret;
+  }
+  file_inode->attribute &= ~COMPRESSED;
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  free_file_blocks(fs, &before, 1);
+  return MFS_OK;
+}
+
+// DEDUP
+// See struct blockRef. Blocks are shared by insert and never changed in place while they are,
+// a file is given copies of its own first. A block that drops out of every file is freed like
+// any other and its index entry goes stale, so the index never has to be cleaned up.
+
+// 64-bit hash of a block, whose length is a multiple of 32. Four lanes of multiply and rotate
+// run side by side, so it goes at about the speed of reading the block.
+uint64_t block_hash(const uint8_t *data, size_t len)
+{
+  const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+  const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+  uint64_t lane[4] = {prime1 + prime2, prime2, 0, -prime1};
+  size_t i;
+  int j;
+
+  for (i = 0; i + 32 <= len; i += 32)
+  {
+    for (j = 0; j < 4; j++)
+    {
+      uint64_t word;
+      memcpy(&word, data + i + j * 8, sizeof(word));
+      lane[j] += word * prime2;
+      lane[j] = ((lane[j] << 31) | (lane[j] >> 33)) * prime1;
+    }
+  }
+
+  uint64_t hash = len;
+  for (j = 0; j < 4; j++)
+  {
+    hash = (hash ^ lane[j]) * prime1;
+    hash = (hash << 27) | (hash >> 37);
+  }
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+// Fill blocks with the block number of every block of a file in order. Returns 0, or -1 if
+// an indirect block couldn't be read in.
+int list_blocks(struct mfs *fs, struct inode *file_inode, int32_t *blocks)
+{
+  struct extentPath path = {0};
+  int32_t k = 0;
+  int32_t i;
+  int32_t j;
+
+  for (i = 0; i < file_inode->num_extents; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (ext == NULL)
+    {
+      return -1;
+    }
+    for (j = 0; j < ext->length; j++)
+    {
+      blocks[k++] = ext->start + j;
+    }
+  }
+  return 0;
+}
+
+// Rebuild the extents of a file from blocks, the block number of each of its blocks in order.
+// Its indirect blocks are made again and the old ones freed, the data blocks are left to the
+// caller. Returns 0, or -1 if there was no room for the indirect blocks, leaving the file as
+// it was.
+int remap_file(struct mfs *fs, struct inode *file_inode, int32_t *blocks)
+{
+  struct inode before = *file_inode;
+  int32_t count = file_inode->num_blocks;
+  int32_t start = 0;
+  int32_t k;
+
+  memset(file_inode->extents, 0, sizeof(file_inode->extents));
+  file_inode->num_extents = 0;
+  file_inode->num_blocks = 0;
+  for (k = 1; k <= count; k++)
+  {
+    if (k < count && blocks[k] == blocks[k - 1] + 1)
+    {
+      continue;
+    }
+    if (append_extent(fs, file_inode, blocks[start], k - start) == -1)
+    {
+      free_tree_blocks(fs, file_inode);
+      *file_inode = before;
+      return -1;
+    }
+    start = k;
+  }
+  free_tree_blocks(fs, &before);
+  return 0;
+}
+
+// Whether an index entry still names the block it was made for, which nothing has changed
+// since, as long as it stays shared
+int entry_current(struct mfs *fs, struct dedupEntry *entry)
+{
+  int32_t block = entry->block;
+  return block >= fs->first_data_block && block < fs->num_blocks &&
+         free_run_length(fs, block, 1) == 0 && fs->block_refs[block].refs > 0 &&
+         fs->block_refs[block].claimed == entry->claimed;
+}
+
+// Find a block in the index with the same bytes as data, the contents of own, whose hash is
+// hash, and take a reference to it. If there is none own goes into the index in the first
+// empty or stale slot. Returns the block the file should hold. Called with alloc_lock held.
+int32_t share_block(struct mfs *fs, int32_t own, uint8_t *data, uint64_t hash)
+{
+  uint32_t check = hash >> 32;
+  uint32_t slot = (uint32_t)hash % fs->dedup_slots;
+  struct dedupEntry *spare = NULL;
+  int probe;
+
+  for (probe = 0; probe < DEDUP_PROBES; probe++, slot = (slot + 1) % fs->dedup_slots)
+  {
+    struct dedupEntry *entry = &fs->dedup_index[slot];
+    if (entry->block == 0 || !entry_current(fs, entry))
+    {
+      spare = (spare == NULL) ? entry : spare;
+      if (entry->block == 0)
+      {
+        break;
+      }
+      continue;
+    }
+
+    // the whole block is compared, so a hash that collides never shares the wrong one
+    struct blockRef *ref = &fs->block_refs[entry->block];
+    uint8_t *held = (entry->check == check) ? cache_blocks(fs, entry->block, 1) : NULL;
+    if (held != NULL && ref->refs < UINT32_MAX && memcmp(held, data, fs->block_size) == 0)
+    {
+      ref->refs++;
+      mark_dirty_range(fs, ref, sizeof(struct blockRef));
+      return entry->block;
+    }
+  }
+
+  if (spare != NULL)
+  {
+    spare->check = check;
+    spare->block = own;
+    spare->claimed = fs->block_refs[own].claimed;
+    mark_dirty_range(fs, spare, sizeof(struct dedupEntry));
+  }
+  return own;
+}
+
+// Point every block of a newly filled file that has the same bytes as a block in the index
+// at that block, and give its own back before it is ever written out. The blocks it keeps go
+// into the index for the files after it. Only the file's own blocks and the index change, so
+// different files can be deduped at the same time.
+void dedup_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  int32_t count = file_inode->num_blocks;
+  int32_t shared = 0;
+  int32_t k;
+
+  int32_t *own = malloc(2 * (size_t)count * sizeof(int32_t));
+  if (own == NULL)
+  {
+    return;
+  }
+  int32_t *blocks = own + count;
+  if (list_blocks(fs, file_inode, own) == -1)
+  {
+    free(own);
+    return;
+  }
+
+  // the file was just filled so its blocks are cached
+  for (k = 0; k < count; k++)
+  {
+    uint8_t *data = block_data(fs, own[k]);
+    uint64_t hash = block_hash(data, fs->block_size);
+    pthread_mutex_lock(&fs->alloc_lock);
+    blocks[k] = share_block(fs, own[k], data, hash);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    shared += (blocks[k] != own[k]);
+  }
+
+  // without room for the indirect blocks the file keeps its own
+  if (shared > 0 && remap_file(fs, file_inode, blocks) == -1)
+  {
+    for (k = 0; k < count; k++)
+    {
+      if (blocks[k] != own[k])
+      {
+        set_free_run(fs, blocks[k], 1, 1);
+      }
+    }
+    shared = 0;
+  }
+  for (k = 0; k < count && shared > 0; k++)
+  {
+    if (blocks[k] != own[k])
+    {
+      clear_block_dirty(fs, own[k]);
+      set_free_run(fs, own[k], 1, 1);
+    }
+  }
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  free(own);
+}
+
+// Give a file copies of its own of the blocks it shares from first up to but not including
+// last, so they can be changed in place. The blocks it already holds alone are claimed again,
+// so a deleted file that shared them can't be brought back with what is written over them.
+// Returns how many blocks were copied, which means the extents changed, or an MFS_E code, in
+// which case the file is left as it was.
+int unshare_blocks(struct mfs *fs, int32_t inode_index, int32_t first, int32_t last)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  int32_t count = file_inode->num_blocks;
+  int32_t shared = 0;
+  int32_t k;
+
+  last = (last < count) ? last : count;
+  if (!fs->dedup || first >= last || is_packed(file_inode))
+  {
+    return 0;
+  }
+
+  int32_t *old = malloc(2 * (size_t)count * sizeof(int32_t));
+  if (old == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+  int32_t *blocks = old + count;
+  if (list_blocks(fs, file_inode, old) == -1)
+  {
+    free(old);
+    return MFS_EIO;
+  }
+  memcpy(blocks, old, count * sizeof(int32_t));
+
+  // the blocks to copy are marked -1 until they have a new block
+  pthread_mutex_lock(&fs->alloc_lock);
+  for (k = first; k < last; k++)
+  {
+    struct blockRef *ref = &fs->block_refs[old[k]];
+    if (ref->refs > 1)
+    {
+      blocks[k] = -1;
+      shared++;
+    }
+    else
+    {
+      ref->claimed = ++*fs->dedup_clock;
+      mark_dirty_range(fs, ref, sizeof(struct blockRef));
+    }
+  }
+  if (shared < last - first)
+  {
+    mark_dirty_range(fs, fs->dedup_clock, sizeof(uint32_t));
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  int ret = shared;
+  if ((uint64_t)shared * fs->block_size > df(fs))
+  {
+    ret = MFS_ENOSPC;
+  }
+  int32_t copied = 0;
+  k = first;
+  while (ret >= 0 && copied < shared)
+  {
+    int32_t length;
+    int32_t start = claim_run(fs, shared - copied, &length);
+    if (start == -1)
+    {
+      ret = MFS_EFRAGMENTED;
+      break;
+    }
+    int32_t block;
+    for (block = start; block < start + length; block++, k++, copied++)
+    {
+      while (blocks[k] != -1)
+      {
+        k++;
+      }
+      blocks[k] = block;
+      uint8_t *copy = cache_blocks(fs, block, 1);
+      uint8_t *shared_block = cache_blocks(fs, old[k], 1);
+      if (copy == NULL || shared_block == NULL)
+      {
+        ret = MFS_EIO;
+        continue;
+      }
+      memcpy(copy, shared_block, fs->block_size);
+      mark_dirty_range(fs, copy, fs->block_size);
+    }
+  }
+  if (ret >= 0 && shared > 0 && remap_file(fs, file_inode, blocks) == -1)
+  {
+    ret = MFS_EFRAGMENTED;
+  }
+
+  // the copies are given back if the file couldn't take them, the shared blocks if it did
+  for (k = first; k < last; k++)
+  {
+    if (blocks[k] != old[k] && blocks[k] != -1)
+    {
+      set_free_run(fs, (ret >= 0) ? old[k] : blocks[k], 1, 1);
+    }
+  }
+  if (ret > 0)
+  {
+    mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  }
+  free(old);
+  return ret;
+}
+
+// Remember when the file in an inode was deleted, so undelete can tell whether its blocks
+// were claimed again since
+void stamp_deleted(struct mfs *fs, int32_t inode_index)
+{
+  if (fs->dedup)
+  {
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->deleted_at[inode_index] = *fs->dedup_clock;
+    mark_dirty_range(fs, &fs->deleted_at[inode_index], sizeof(uint32_t));
+    pthread_mutex_unlock(&fs->alloc_lock);
+  }
+}
+
+// DIRECTORY INDEX
+// 32-bit FNV-1a of a filename, which is at most 64 characters and may not be terminated
+uint32_t name_hash(char *filename)
+{
+  uint32_t hash = 0x811c9dc5;
+  int i;
+  for (i = 0; i < 64 && filename[i] != '\0'; i++)
+  {
+    hash ^= (uint8_t)filename[i];
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+void dir_index_add(struct mfs *fs, int32_t entry)
+{
+  uint32_t slot = name_hash(fs->directory[entry].filename) % fs->dir_index_size;
+  while (fs->dir_index[slot] != -1)
+  {
+    slot = (slot + 1) % fs->dir_index_size;
+  }
+  fs->dir_index[slot] = entry;
+}
+
+// Take an entry out of the index. Must be called before its filename changes.
+void dir_index_remove(struct mfs *fs, int32_t entry)
+{
+  uint32_t slot = name_hash(fs->directory[entry].filename) % fs->dir_index_size;
+  while (fs->dir_index[slot] != entry)
+  {
+    if (fs->dir_index[slot] == -1)
+    {
+      return;
+    }
+    slot = (slot + 1) % fs->dir_index_size;
+  }
+  fs->dir_index[slot] = -1;
+
+  // Entries further along the probe run may have been placed past the hole we just made.
+  // Move back any whose home slot no longer reaches them.
+  uint32_t hole = slot;
+  uint32_t next = (slot + 1) % fs->dir_index_size;
+  while (fs->dir_index[next] != -1)
+  {
+    uint32_t home = name_hash(fs->directory[fs->dir_index[next]].filename) % fs->dir_index_size;
+    if ((next - home + fs->dir_index_size) % fs->dir_index_size >=
+        (next - hole + fs->dir_index_size) % fs->dir_index_size)
+    {
+      fs->dir_index[hole] = fs->dir_index[next];
+      fs->dir_index[next] = -1;
+      hole = next;
+    }
+    next = (next + 1) % fs->dir_index_size;
+  }
+}
+
+// Index every directory entry that has a name. Called whenever a new image is loaded.
+void dir_index_build(struct mfs *fs)
+{
+  memset(fs->dir_index, 0xff, fs->dir_index_size * sizeof(int32_t));
+
+  int i;
+  for (i = 0; i < fs->num_files; i++)
+  {
+    if (fs->directory[i].filename[0] != '\0')
+    {
+      dir_index_add(fs, i);
+    }
+  }
+}
+
+int free_run_visit(struct mfs *fs, int32_t start, int32_t length, void *arg)
+{
+  if (start < fs->first_data_block || length < 1 || length > fs->num_blocks - start)
+  {
+    return -1;
+  }
+  return free_run_length(fs, start, length) != length;
+}
+
+// In an image that dedups a block a deleted file held may still be held by others. Either
+// way it is as it was as long as it wasn't claimed again since the file was deleted at *arg.
+int held_run_visit(struct mfs *fs, int32_t start, int32_t length, void *arg)
+{
+  uint32_t deleted_at = *(uint32_t *)arg;
+  int32_t block;
+
+  if (start < fs->first_data_block || length < 1 || length > fs->num_blocks - start)
+  {
+    return -1;
+  }
+  for (block = start; block < start + length; block++)
+  {
+    struct blockRef *ref = &fs->block_refs[block];
+    if ((int32_t)(ref->claimed - deleted_at) > 0 ||
+        (free_run_length(fs, block, 1) == 0 && ref->refs == 0))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A deleted entry can be brought back as long as its inode and blocks weren't reused
+int recoverable(struct mfs *fs, int32_t entry)
+{
+  int32_t inode = fs->directory[entry].inode;
+  if (inode < 0 || inode >= fs->num_files || fs->inodes[inode].in_use)
+  {
+    return 0;
+  }
+  if (is_packed(&fs->inodes[inode]))
+  {
+    return fs->inodes[inode].file_size <= INLINE_SIZE || tail_intact(fs, &fs->inodes[inode]);
+  }
+  if (fs->dedup)
+  {
+    return visit_file_blocks(fs, &fs->inodes[inode], held_run_visit, &fs->deleted_at[inode]) == 0;
+  }
+  return visit_file_blocks(fs, &fs->inodes[inode], free_run_visit, NULL) == 0;
+}
+
+// Find the directory entry of a file. With deleted set only deleted entries that can still
+// be recovered are matched, otherwise only files in use. Returns -1 if there is none.
+int32_t lookup(struct mfs *fs, char *filename, int deleted)
+{
+  uint32_t slot = name_hash(filename) % fs->dir_index_size;
+  while (fs->dir_index[slot] != -1)
+  {
+    int32_t entry = fs->dir_index[slot];
+    if (strncmp(fs->directory[entry].filename, filename, 64) == 0)
+    {
+      if (!deleted && fs->directory[entry].in_use)
+      {
+        return entry;
+      }
+      if (deleted && !fs->directory[entry].in_use && recoverable(fs, entry))
+      {
+        return entry;
+      }
+    }
+    slot = (slot + 1) % fs->dir_index_size;
+  }
+  return -1;
+}
+
+// GEOMETRY
+// Lay out an image of num_blocks blocks of block_size bytes holding up to num_files files.
+// The superblock takes block 0, then come the directory, the free inode map, the inodes, the
+// free block map, the free block count and the dedup tables if the image has them, each
+// starting on a block of its own.
+void plan_geometry(struct superblock *geometry, uint32_t block_size, uint32_t num_blocks,
+                   uint32_t num_files, uint32_t pack_size, uint32_t flags)
+{
+  memset(geometry, 0, sizeof(struct superblock));
+  geometry->magic = SUPERBLOCK_MAGIC;
+  geometry->version = SUPERBLOCK_VERSION;
+  geometry->block_size = block_size;
+  geometry->num_blocks = num_blocks;
+  geometry->num_files = num_files;
+  geometry->pack_size = pack_size;
+  geometry->flags = flags;
+  geometry->kdf_rounds = KDF_ROUNDS;
+
+  uint64_t bs = block_size;
+  geometry->directory_block = 1;
+  geometry->free_inode_block = geometry->directory_block +
+                               (num_files * sizeof(struct directoryEntry) + bs - 1) / bs;
+  geometry->inode_block = geometry->free_inode_block + (num_files + bs - 1) / bs;
+  geometry->free_map_block = geometry->inode_block +
+                             (num_files * sizeof(struct inode) + bs - 1) / bs;
+  geometry->free_count_block = geometry->free_map_block + (num_blocks / 8 + bs - 1) / bs;
+  geometry->first_data_block = geometry->free_count_block + 1;
+  if (flags & SUPERBLOCK_DEDUP)
+  {
+    uint32_t ref_block;
+    uint32_t index_block;
+    geometry->dedup_block = geometry->first_data_block;
+    geometry->first_data_block = dedup_layout(geometry, &ref_block, &index_block);
+  }
+  geometry->checksum = checksum((uint8_t *)geometry, offsetof(struct superblock, checksum));
+}
+
+// Check that a superblock is intact and describes a layout we can open. Returns 0 or -1.
+// Version 1 superblocks are from before packing and have pack_size 0. Versions 1 and 2 have
+// their checksum where flags is now and version 3 where kdf_rounds is. They are brought up to
+// date in memory with flags 0 before version 3 and no salt, which is all zeros.
+int check_geometry(struct superblock *geometry)
+{
+  if (geometry->magic != SUPERBLOCK_MAGIC || geometry->version < 1 ||
+      geometry->version > SUPERBLOCK_VERSION)
+  {
+    return -1;
+  }
+  if (geometry->version < 4)
+  {
+    size_t end = (geometry->version < 3) ? offsetof(struct superblock, flags)
+                                         : offsetof(struct superblock, kdf_rounds);
+    uint64_t stored;
+    memcpy(&stored, (uint8_t *)geometry + end, sizeof(stored));
+    if (stored != checksum((uint8_t *)geometry, end))
+    {
+      return -1;
+    }
+    if (geometry->version < 3)
+    {
+      geometry->flags = 0;
+      geometry->dedup_block = 0;
+    }
+    geometry->kdf_rounds = KDF_ROUNDS;
+    memset(geometry->salt, 0, sizeof(geometry->salt));
+    geometry->checksum = checksum((uint8_t *)geometry, offsetof(struct superblock, checksum));
+  }
+  else if (geometry->checksum !=
+           checksum((uint8_t *)geometry, offsetof(struct superblock, checksum)))
+  {
+    return -1;
+  }
+
+  uint32_t bs = geometry->block_size;
+  if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0 ||
+      geometry->num_blocks == 0 || geometry->num_blocks > MAX_NUM_BLOCKS ||
+      geometry->num_blocks % 64 != 0 || geometry->num_files == 0 ||
+      geometry->num_files > MAX_NUM_FILES ||
+      (off_t)bs * geometry->num_blocks > MAX_IMAGE_SIZE ||
+      geometry->pack_size > bs - sizeof(struct tailHeader) ||
+      (geometry->version == 1 && geometry->pack_size != 0) || geometry->kdf_rounds == 0 ||
+      (geometry->flags & ~(SUPERBLOCK_COMPRESS | SUPERBLOCK_DEDUP)) != 0)
+  {
+    return -1;
+  }
+
+  // Only the layout plan_geometry makes is understood
+  struct superblock expect;
+  plan_geometry(&expect, bs, geometry->num_blocks, geometry->num_files, geometry->pack_size,
+                geometry->flags);
+  expect.version = geometry->version;
+  expect.kdf_rounds = geometry->kdf_rounds;
+  memcpy(expect.salt, geometry->salt, sizeof(expect.salt));
+  expect.checksum = checksum((uint8_t *)&expect, offsetof(struct superblock, checksum));
+  if (memcmp(&expect, geometry, sizeof(struct superblock)) != 0 ||
+      expect.first_data_block >= expect.num_blocks)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// The geometry of an image from before the superblock
+void legacy_geometry(struct superblock *geometry)
+{
+  memset(geometry, 0, sizeof(struct superblock));
+  geometry->block_size = 1024;
+  geometry->num_blocks = 65536;
+  geometry->num_files = 256;
+  geometry->directory_block = 0;
+  geometry->free_inode_block = LEGACY_FREE_INODE_BLOCK;
+  geometry->inode_block = LEGACY_INODE_BLOCK;
+  geometry->free_map_block = LEGACY_FREE_MAP_BLOCK;
+  geometry->free_count_block = LEGACY_FREE_COUNT_BLOCK;
+  geometry->first_data_block = LEGACY_METADATA_BLOCKS;
+  geometry->kdf_rounds = KDF_ROUNDS;
+}
+
+// Whether the metadata of an image opened with the legacy geometry is in that layout. Any
+// 64 MiB file without a superblock is taken for one, including images from before the
+// layout settled, whose inodes and free maps are elsewhere or of another size. The free
+// count has to match the free map, which keeps the metadata in use, and every directory
+// entry and inode has to be in range. Returns 0 or -1.
+int check_legacy(struct mfs *fs)
+{
+  int32_t free = 0;
+  int32_t i;
+  int32_t j;
+
+  for (i = 0; i < fs->num_blocks / 64; i++)
+  {
+    free += __builtin_popcountll(fs->free_blocks[i]);
+  }
+  int32_t first_free = next_free_block(fs, 0);
+  if ((uint32_t)free != *fs->free_block_count ||
+      (first_free != -1 && first_free < fs->first_data_block))
+  {
+    return -1;
+  }
+
+  for (i = 0; i < fs->num_files; i++)
+  {
+    struct directoryEntry *entry = &fs->directory[i];
+    struct inode *file_inode = &fs->inodes[i];
+    if (fs->free_inodes[i] > 1 || (uint16_t)entry->in_use > 1 ||
+        entry->inode < -1 || entry->inode >= fs->num_files ||
+        (entry->filename[0] == '\0') != (entry->inode == -1) ||
+        (entry->in_use && entry->inode == -1))
+    {
+      return -1;
+    }
+    if ((uint16_t)file_inode->in_use > 1 || file_inode->num_extents < 0 ||
+        file_inode->num_extents > EXTENTS_PER_FILE || file_inode->num_blocks < 0 ||
+        file_inode->num_blocks > fs->num_blocks - fs->first_data_block ||
+        file_inode->file_size > (uint64_t)file_inode->num_blocks * fs->block_size)
+    {
+      return -1;
+    }
+    int32_t blocks = 0;
+    for (j = 0; j < file_inode->num_extents; j++)
+    {
+      struct extent *ext = &file_inode->extents[j];
+      if (ext->start < fs->first_data_block || ext->length <= 0 ||
+          ext->length > fs->num_blocks - ext->start)
+      {
+        return -1;
+      }
+      blocks += ext->length;
+    }
+    if (blocks != file_inode->num_blocks)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Take on a geometry and allocate everything sized by it. Returns 0 or -1 if out of memory.
+int set_geometry(struct mfs *fs, struct superblock *geometry)
+{
+  free_geometry(fs);
+
+  fs->geometry = *geometry;
+  fs->legacy = (geometry->magic != SUPERBLOCK_MAGIC);
+  fs->block_size = geometry->block_size;
+  fs->num_blocks = geometry->num_blocks;
+  fs->num_files = geometry->num_files;
+  fs->first_data_block = geometry->first_data_block;
+  fs->pack_size = geometry->pack_size;
+  fs->compress = (geometry->flags & SUPERBLOCK_COMPRESS) != 0;
+  fs->dedup = (geometry->flags & SUPERBLOCK_DEDUP) != 0;
+  derive_key(fs);
+  fs->dedup_slots = fs->num_blocks;
+  fs->tail_block = -1;
+  fs->image_size = (off_t)fs->block_size * fs->num_blocks;
+  fs->num_frames = fs->num_blocks / CACHE_FRAME;
+  fs->cache_frames = CACHE_SIZE / ((size_t)CACHE_FRAME * fs->block_size);
+  if (fs->cache_frames < 1)
+  {
+    fs->cache_frames = 1;
+  }
+
+  fs->bitmap_words = fs->num_blocks / 64;
+  fs->dir_index_size = 2 * fs->num_files;
+  fs->dirty_blocks = calloc(fs->bitmap_words, sizeof(uint64_t));
+  fs->journal_blocks = calloc(fs->bitmap_words, sizeof(uint64_t));
+  fs->tree_blocks = calloc(fs->bitmap_words, sizeof(uint64_t));
+  fs->frame_loaded = calloc(fs->num_frames, 1);
+  fs->frame_used = calloc(fs->num_frames, 1);
+  fs->dir_index = calloc(fs->dir_index_size, sizeof(int32_t));
+  fs->inflated_data = malloc((size_t)INFLATE_CACHE * fs->block_size);
+  if (fs->dirty_blocks == NULL || fs->journal_blocks == NULL || fs->tree_blocks == NULL ||
+      fs->frame_loaded == NULL || fs->frame_used == NULL || fs->dir_index == NULL ||
+      fs->inflated_data == NULL)
+  {
+    free_geometry(fs);
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < INFLATE_CACHE; i++)
+  {
+    fs->inflated[i].inode = -1;
+    fs->inflated[i].data = fs->inflated_data + (size_t)i * fs->block_size;
+  }
+  fs->inflate_next = 0;
+  return 0;
+}
+
+void free_geometry(struct mfs *fs)
+{
+  free(fs->dirty_blocks);
+  free(fs->journal_blocks);
+  free(fs->tree_blocks);
+  free(fs->frame_loaded);
+  free(fs->frame_used);
+  free(fs->dir_index);
+  free(fs->inflated_data);
+  fs->dirty_blocks = NULL;
+  fs->journal_blocks = NULL;
+  fs->tree_blocks = NULL;
+  fs->frame_loaded = NULL;
+  fs->frame_used = NULL;
+  fs->dir_index = NULL;
+  fs->inflated_data = NULL;
+}
+
+// Find where the blockRefs and the index of an image that dedups start, after dedup_clock
+// and the inode delete times at dedup_block. Returns the block after the index.
+uint32_t dedup_layout(struct superblock *geometry, uint32_t *ref_block, uint32_t *index_block)
+{
+  uint64_t bs = geometry->block_size;
+  *ref_block = geometry->dedup_block +
+               ((1 + (uint64_t)geometry->num_files) * sizeof(uint32_t) + bs - 1) / bs;
+  *index_block = *ref_block +
+                 ((uint64_t)geometry->num_blocks * sizeof(struct blockRef) + bs - 1) / bs;
+  return *index_block +
+         ((uint64_t)geometry->num_blocks * sizeof(struct dedupEntry) + bs - 1) / bs;
+}
+
+// Point the metadata structures at their blocks in whatever data currently refers to.
+// Must be called every time data is moved to a new buffer or mapping.
+void set_layout(struct mfs *fs)
+{
+  struct superblock *geometry = &fs->geometry;
+  fs->directory = (struct directoryEntry *)block_data(fs, geometry->directory_block);
+  fs->inodes = (struct inode *)block_data(fs, geometry->inode_block);
+  fs->free_blocks = (uint64_t *)block_data(fs, geometry->free_map_block);
+  fs->free_block_count = (uint32_t *)block_data(fs, geometry->free_count_block);
+  fs->free_inodes = block_data(fs, geometry->free_inode_block);
+  if (fs->dedup)
+  {
+    uint32_t ref_block;
+    uint32_t index_block;
+    dedup_layout(geometry, &ref_block, &index_block);
+    fs->dedup_clock = (uint32_t *)block_data(fs, geometry->dedup_block);
+    fs->deleted_at = fs->dedup_clock + 1;
+    fs->block_refs = (struct blockRef *)block_data(fs, ref_block);
+    fs->dedup_index = (struct dedupEntry *)block_data(fs, index_block);
+  }
+}
+
+void init(struct mfs *fs)
+{
+  set_layout(fs);
+  if (!fs->legacy)
+  {
+    memcpy(fs->data, &fs->geometry, sizeof(struct superblock));
+  }
+
+  for (int i = 0; i < fs->num_files; i++)
+  {
+    fs->directory[i].in_use = 0;
+    fs->directory[i].inode = -1;
+    fs->free_inodes[i] = 1;
+
+    memset(fs->directory[i].filename, 0, 64);
+
+    memset(fs->inodes[i].extents, 0, sizeof(fs->inodes[i].extents));
+    fs->inodes[i].num_extents = 0;
+    fs->inodes[i].num_blocks = 0;
+    fs->inodes[i].in_use = 0;
+    fs->inodes[i].attribute = 0;
+    fs->inodes[i].file_size = 0;
+  }
+
+  // Every block past the metadata starts out free
+  memset(fs->free_blocks, 0xff, fs->num_blocks / 8);
+  memset(fs->free_blocks, 0, (fs->first_data_block / 64) * sizeof(uint64_t));
+  fs->free_blocks[fs->first_data_block / 64] &= ~(((uint64_t)1 << (fs->first_data_block % 64)) - 1);
+  *fs->free_block_count = fs->num_blocks - fs->first_data_block;
+  fs->free_block_hint = fs->first_data_block;
+}
+
+uint64_t df(struct mfs *fs)
+{
+  return (uint64_t)*fs->free_block_count * fs->block_size;
+}
+
+// The bytes in every file together, and the bytes of the data blocks holding them, which is
+// less when files are packed or compressed
+void df_used(struct mfs *fs, uint64_t *logical, uint64_t *physical)
+{
+  int32_t i;
+
+  *logical = 0;
+  for (i = 0; i < fs->num_files; i++)
+  {
+    if (fs->inodes[i].in_use)
+    {
+      *logical += fs->inodes[i].file_size;
+    }
+  }
+  *physical = (uint64_t)(fs->num_blocks - fs->first_data_block - *fs->free_block_count) *
+              fs->block_size;
+}
+
+// Map the whole image file shared and read-write so data, directory, inodes and the free
+// maps live in the page cache. Only the pages we touch are ever faulted in.
+int map_image(struct mfs *fs)
+{
+  void *map = mmap(NULL, fs->image_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fileno(fs->fp), 0);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+
+  fs->data = map;
+  fs->image_mapped = 1;
+  set_layout(fs);
+  return 0;
+}
+
+// Give the image address space of its own for the block cache to read frames into. It is
+// mapped privately so cache_trim can hand frames back to the kernel, and only the frames
+// that are loaded take up memory.
+int alloc_image(struct mfs *fs)
+{
+  void *buffer = mmap(NULL, fs->image_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (buffer == MAP_FAILED)
+  {
+    return -1;
+  }
+
+  fs->image_buffer = buffer;
+  fs->data = fs->image_buffer;
+  memset(fs->frame_loaded, 0, fs->num_frames);
+  fs->frames_loaded = 0;
+  fs->clock_hand = 0;
+  fs->readahead_next = -1;
+  fs->readahead_window = 0;
+  set_layout(fs);
+  return 0;
+}
+
+// Drop the mapping and point data back at the in-memory buffer
+void unmap_image(struct mfs *fs)
+{
+  munmap(fs->data, fs->image_size);
+  fs->data = fs->image_buffer;
+  fs->image_mapped = 0;
+  set_layout(fs);
+}
+
+// Create a new empty image laid out by geometry and leave it open. Returns MFS_OK or an MFS_E
+// code.
+int createfs(struct mfs *fs, char *filename, int use_mmap, struct superblock *geometry)
+{
+  // every image gets a salt of its own, so a passphrase guessed for one holds for no other
+  if (getrandom(geometry->salt, sizeof(geometry->salt), 0) != sizeof(geometry->salt))
+  {
+    return MFS_EIO;
+  }
+  geometry->checksum = checksum((uint8_t *)geometry, offsetof(struct superblock, checksum));
+  if (set_geometry(fs, geometry) == -1)
+  {
+    return MFS_ENOMEM;
+  }
+
+  fs->fp = fopen(filename, "w+");
+  if (fs->fp == NULL)
+  {
+    free_geometry(fs);
+    return MFS_EIO;
+  }
+  fs->read_only = 0;
+
+  memset(fs->image_name, 0, 64);
+  strncpy(fs->image_name, filename, 63);
+
+  // Size the file up front so savefs only ever has to write blocks in place
+  if (ftruncate(fileno(fs->fp), fs->image_size) == -1)
+  {
+    free_geometry(fs);
+    fclose(fs->fp);
+    return MFS_EIO;
+  }
+
+  if (use_mmap)
+  {
+    // A journal left behind by an earlier image of the same name must never be replayed
+    // into this one, and a mapped image doesn't reset it on save
+    char journal_name[72];
+    snprintf(journal_name, sizeof(journal_name), "%s.jnl", fs->image_name);
+    unlink(journal_name);
+
+    // A freshly truncated file reads back as zeros so there is nothing to clear
+    if (map_image(fs) == -1)
+    {
+      free_geometry(fs);
+      fclose(fs->fp);
+      return MFS_EIO;
+    }
+  }
+  else
+  {
+    if (alloc_image(fs) == -1)
+    {
+      free_geometry(fs);
+      fclose(fs->fp);
+      return MFS_ENOMEM;
+    }
+    if (cache_blocks(fs, 0, fs->first_data_block) == NULL)
+    {
+      munmap(fs->image_buffer, fs->image_size);
+      fs->image_buffer = NULL;
+      free_geometry(fs);
+      fclose(fs->fp);
+      return MFS_EIO;
+    }
+    journal_open(fs);
+  }
+
+  init(fs);
+  dir_index_build(fs);
+
+  fs->image_open = 1;
+
+  // Save the empty metadata so the file is recognized as a valid image. The rest of the
+  // freshly truncated file already reads back as zeros. A crash before then leaves no image
+  // to recover, so none of it is journaled, and a journal left by an earlier image of the
+  // same name is emptied.
+  int32_t block;
+  for (block = 0; block < fs->first_data_block; block++)
+  {
+    mark_dirty(fs, block);
+  }
+  journal_reset(fs);
+  return savefs(fs);
+}
+
+// Write every changed block to the image file. Returns MFS_OK or an MFS_E code.
+int savefs(struct mfs *fs)
+{
+  if (fs->image_open == 0)
+  {
+    return MFS_ENOTOPEN;
+  }
+
+  int32_t start = 0;
+  int32_t len;
+
+  // A mapped image is already the file, the kernel only has to flush the dirty pages. msync
+  // takes whole pages, which blocks smaller than a page don't start on.
+  if (fs->image_mapped)
+  {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    while ((len = next_dirty_run(fs, fs->dirty_blocks, &start)) > 0)
+    {
+      uintptr_t first = (uintptr_t)block_data(fs, start) & ~(page - 1);
+      uintptr_t end = (uintptr_t)block_data(fs, start) + (size_t)len * fs->block_size;
+      end = (end + page - 1) & ~(page - 1);
+      if (msync((void *)first, end - first, MS_SYNC) == -1)
+      {
+        return MFS_EIO;
+      }
+      start += len;
+    }
+    clear_dirty(fs);
+    fs->savefs_pending = 0;
+    return MFS_OK;
+  }
+
+  // Whatever isn't in the journal yet goes there first, so a crash part way through writing
+  // the image in place is recovered from the journal. Batches and the server save without
+  // committing each command.
+  journal_commit(fs);
+
+  // Write only the runs of blocks that changed since the image was opened or last saved.
+  // The file is updated in place so an interrupted save never leaves it truncated.
+  while ((len = next_dirty_run(fs, fs->dirty_blocks, &start)) > 0)
+  {
+    if (write_blocks(fs, start, len) == -1)
+    {
+      return MFS_EIO;
+    }
+    start += len;
+  }
+  clear_dirty(fs);
+  fs->savefs_pending = 0;
+
+  // Only once the image itself is on disk can the journal that covered it be dropped
+  if (fs->journal_fd != -1)
+  {
+    fdatasync(fileno(fs->fp));
+  }
+  journal_reset(fs);
+  cache_trim(fs);
+  return MFS_OK;
+}
+
+// Open an existing image, bringing back whatever its journal holds. The number of journal
+// records recovered is left in journal_recovered. Returns MFS_OK or an MFS_E code.
+int openfs(struct mfs *fs, char *filename, int use_mmap)
+{
+
+  // verify the file exits
+  struct stat buf;
+  int ret = stat(filename, &buf);
+
+  if (ret == -1)
+  {
+    return MFS_ENOENT;
+  }
+
+  //assigns fp, falling back to read-only so an image we can not write can still be viewed
+  fs->fp = fopen(filename, "r+");
+  int writable = (fs->fp != NULL);
+  if (fs->fp == NULL && !use_mmap)
+  {
+    fs->fp = fopen(filename, "r");
+  }
+  if (fs->fp == NULL)
+  {
+    return MFS_EIO;
+  }
+
+  // The layout comes from the superblock. A file without one can still be an image from
+  // before it, which has a size of its own.
+  struct superblock geometry;
+  if (pread(fileno(fs->fp), &geometry, sizeof(geometry), 0) != sizeof(geometry) ||
+      check_geometry(&geometry) == -1)
+  {
+    if (buf.st_size != LEGACY_IMAGE_SIZE)
+    {
+      fclose(fs->fp);
+      return MFS_EBADIMAGE;
+    }
+    legacy_geometry(&geometry);
+  }
+  if (buf.st_size != (off_t)geometry.block_size * geometry.num_blocks)
+  {
+    fclose(fs->fp);
+    return MFS_EBADIMAGE;
+  }
+  if (set_geometry(fs, &geometry) == -1)
+  {
+    fclose(fs->fp);
+    return MFS_ENOMEM;
+  }
+
+  memset(fs->image_name, 0, 64);
+  strncpy(fs->image_name, filename, 63);
+
+  if (use_mmap)
+  {
+    if (map_image(fs) == -1)
+    {
+      free_geometry(fs);
+      fclose(fs->fp);
+      return MFS_EIO;
+    }
+  }
+  else
+  {
+    // Only the metadata is read now, file contents are read in as they are used
+    if (alloc_image(fs) == -1)
+    {
+      free_geometry(fs);
+      fclose(fs->fp);
+      return MFS_ENOMEM;
+    }
+    if (cache_blocks(fs, 0, fs->first_data_block) == NULL)
+    {
+      munmap(fs->image_buffer, fs->image_size);
+      fs->image_buffer = NULL;
+      free_geometry(fs);
+      fclose(fs->fp);
+      return MFS_EIO;
+    }
+  }
+  fs->read_only = !writable;
+  if (writable)
+  {
+    journal_open(fs);
+  }
+
+  clear_dirty(fs);
+  fs->free_block_hint = fs->first_data_block;
+  fs->image_open = 1;
+
+  // Commands committed to the journal but never saved are brought back and checkpointed. If
+  // that can't be done the image isn't opened, and the journal is kept for another try. A
+  // file taken for an image from before the superblock is only trusted once what it holds
+  // checks out, before anything is written to it.
+  fs->journal_recovered = journal_replay(fs);
+  ret = MFS_OK;
+  if (fs->journal_recovered == -1)
+  {
+    ret = MFS_EIO;
+  }
+  else if (fs->legacy && check_legacy(fs) == -1)
+  {
+    ret = MFS_EBADIMAGE;
+  }
+  if (ret != MFS_OK)
+  {
+    fs->image_open = 0;
+    journal_close(fs);
+    if (fs->image_mapped)
+    {
+      unmap_image(fs);
+    }
+    fclose(fs->fp);
+    munmap(fs->image_buffer, fs->image_size);
+    fs->image_buffer = NULL;
+    free_geometry(fs);
+    return ret;
+  }
+  if (fs->journal_recovered > 0)
+  {
+    ret = savefs(fs);
+  }
+
+  // A mapped image isn't journaled, so its journal is only kept until what it held is in the
+  // image. Left behind, a later unmapped open would replay it over newer changes.
+  if (fs->image_mapped)
+  {
+    if (ret == MFS_OK)
+    {
+      journal_reset(fs);
+    }
+    journal_close(fs);
+  }
+
+  dir_index_build(fs);
+  return MFS_OK;
+}
+
+// Close the open image. Returns MFS_OK or the MFS_E code of the final save.
+int closefs(struct mfs *fs)
+{
+  int ret = MFS_OK;
+
+  if (fs->image_open == 0)
+  {
+    return MFS_ENOTOPEN;
+  }
+
+  // Whatever a batch left unsaved or uncommitted goes out before the image is closed
+  if (fs->savefs_pending)
+  {
+    ret = savefs(fs);
+  }
+  else
+  {
+    journal_commit(fs);
+  }
+
+  if (fs->image_mapped)
+  {
+    unmap_image(fs);
+  }
+
+  journal_close(fs);
+  fclose(fs->fp);
+  if (fs->image_buffer != NULL)
+  {
+    munmap(fs->image_buffer, fs->image_size);
+    fs->image_buffer = NULL;
+  }
+
+  free_geometry(fs);
+  fs->image_open = 0;
+
+  memset(fs->image_name, 0, 64);
+  return ret;
+}
+
+// ENCRYPTION
+// Take on a passphrase for the images opened from now on, or drop it if passphrase is NULL.
+// Images already open take it on with derive_key. Returns 0 or -1 if out of memory.
+int set_passphrase(const char *passphrase)
+{
+  char *copy = NULL;
+  if (passphrase != NULL && (copy = strdup(passphrase)) == NULL)
+  {
+    return -1;
+  }
+  if (cipher_passphrase != NULL)
+  {
+    memset(cipher_passphrase, 0, strlen(cipher_passphrase));
+    free(cipher_passphrase);
+  }
+  cipher_passphrase = copy;
+  cipher_key_set = (copy != NULL);
+  return 0;
+}
+
+// Stretch the passphrase into the image's key with PBKDF2 over its salt, so a guess costs
+// kdf_rounds HMACs and holds for that image alone. Files remember the key by key_check, the
+// start of a MAC over the salt, which gives nothing of the keystream away.
+void derive_key(struct mfs *fs)
+{
+  uint8_t key[32];
+  uint8_t mac[SHA256_DIGEST];
+  int i;
+
+  if (!cipher_key_set)
+  {
+    memset(fs->cipher_key, 0, sizeof(fs->cipher_key));
+    fs->key_check = 0;
+    return;
+  }
+
+  pbkdf2_sha256((const uint8_t *)cipher_passphrase, strlen(cipher_passphrase),
+                fs->geometry.salt, sizeof(fs->geometry.salt), fs->geometry.kdf_rounds, key,
+                sizeof(key));
+  for (i = 0; i < 8; i++)
+  {
+    fs->cipher_key[i] = key[4 * i] | key[4 * i + 1] << 8 | key[4 * i + 2] << 16 |
+                        (uint32_t)key[4 * i + 3] << 24;
+  }
+  hmac_sha256(key, sizeof(key), fs->geometry.salt, sizeof(fs->geometry.salt), mac);
+  fs->key_check = mac[0] | mac[1] << 8 | mac[2] << 16 | (uint32_t)mac[3] << 24;
+  memset(key, 0, sizeof(key));
+}
+
+int key_matches(struct mfs *fs, int32_t inode_index)
+{
+  return cipher_key_set && fs->key_check == fs->inodes[inode_index].key_check;
+}
+
+// Draw a new generation for a file so its keystream starts over. Returns -1 if no random
+// bytes could be had, leaving the generation as it was.
+int new_generation(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  uint32_t generation;
+
+  if (getrandom(&generation, sizeof(generation), 0) != sizeof(generation))
+  {
+    return -1;
+  }
+  file_inode->generation = generation;
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  return 0;
+}
+
+void *crypt_worker(void *arg)
+{
+  struct cryptJob *job = arg;
+  chacha20_xor(job->key, job->nonce, job->counter, job->buf, job->len);
+  return NULL;
+}
+
+// Encrypt or decrypt len bytes of a file held in buf, starting offset bytes into the file.
+// offset must fall on a block boundary. The keystream depends only on the inode, its
+// generation and the position in the file so large ranges are split across threads.
+void crypt_range(struct mfs *fs, int32_t inode_index, uint32_t offset, uint8_t *buf, size_t len)
+{
+  struct cryptJob jobs[MAX_CRYPT_THREADS];
+  pthread_t threads[MAX_CRYPT_THREADS];
+
+  int count = len / CRYPT_CHUNK_MIN;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (count > cpus)
+  {
+    count = cpus;
+  }
+  if (count > MAX_CRYPT_THREADS)
+  {
+    count = MAX_CRYPT_THREADS;
+  }
+  if (count < 1)
+  {
+    count = 1;
+  }
+
+  // every share but the last is a whole number of blocks
+  size_t share = (len / count + fs->block_size - 1) / fs->block_size * fs->block_size;
+  size_t done = 0;
+  int i;
+  for (i = 0; i < count && done < len; i++)
+  {
+    jobs[i].key = fs->cipher_key;
+    jobs[i].nonce[0] = inode_index;
+    jobs[i].nonce[1] = fs->inodes[inode_index].generation;
+    jobs[i].nonce[2] = 0x0073666d;
+    jobs[i].counter = (offset + done) / CHACHA20_BLOCK;
+    jobs[i].buf = buf + done;
+    jobs[i].len = (len - done < share) ? len - done : share;
+    done += jobs[i].len;
+  }
+  count = i;
+
+  // The calling thread takes the first share itself
+  int started = 1;
+  for (i = 1; i < count; i++)
+  {
+    if (pthread_create(&threads[i], NULL, crypt_worker, &jobs[i]) != 0)
+    {
+      break;
+    }
+    started++;
+  }
+  crypt_worker(&jobs[0]);
+  for (i = started; i < count; i++)
+  {
+    crypt_worker(&jobs[i]);
+  }
+  for (i = 1; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// Copy bytes from offset in fd into the run of blocks starting at block start, for the file
+// at inode_index. A mapped image is the file itself so the kernel copies straight into it
+// with copy_file_range and the data never passes through us. Otherwise the run is filled with
+// large preads. An encrypted file is read into a buffer of our own and encrypted there, so
+// its plaintext never lands in the image. The rest of its last block is left plain zeros.
+int ingest_extent(struct mfs *fs, int32_t inode_index, int fd, off_t offset, int32_t start,
+                  size_t bytes)
+{
+  size_t run = (bytes + fs->block_size - 1) / fs->block_size * fs->block_size;
+  size_t copied = 0;
+
+  if (fs->inodes[inode_index].attribute & ENCRYPTED)
+  {
+    uint8_t *dest = cache_blocks(fs, start, run / fs->block_size);
+    uint8_t *plain = malloc(READ_CHUNK);
+    int ret = (dest == NULL || plain == NULL) ? -1 : 0;
+    size_t done = 0;
+    while (ret == 0 && done < run)
+    {
+      size_t chunk = (run - done < READ_CHUNK) ? run - done : READ_CHUNK;
+      size_t want = (bytes - done < chunk) ? bytes - done : chunk;
+      size_t got = 0;
+      while (got < want)
+      {
+        ssize_t n = pread(fd, plain + got, want - got, offset + done + got);
+        if (n <= 0)
+        {
+          break;
+        }
+        got += n;
+      }
+      if (got < want)
+      {
+        ret = -1;
+        break;
+      }
+      memset(plain + want, 0, chunk - want);
+      crypt_range(fs, inode_index, offset + done, plain, want);
+      memcpy(dest + done, plain, chunk);
+      done += chunk;
+    }
+    free(plain);
+    return ret;
+  }
+
+  if (fs->image_mapped)
+  {
+    loff_t off_in = offset;
+    loff_t off_out = (loff_t)start * fs->block_size;
+    while (copied < bytes)
+    {
+      ssize_t ret = copy_file_range(fd, &off_in, fileno(fs->fp), &off_out, bytes - copied, 0);
+      if (ret <= 0)
+      {
+        // not every kernel and filesystem pairing can do it, pread the rest instead
+        break;
+      }
+      copied += ret;
+    }
+  }
+
+  uint8_t *dest = cache_blocks(fs, start, run / fs->block_size);
+  if (dest == NULL)
+  {
+    return -1;
+  }
+  while (copied < bytes)
+  {
+    ssize_t ret = pread(fd, dest + copied, bytes - copied, offset + copied);
+    if (ret <= 0)
+    {
+      return -1;
+    }
+    copied += ret;
+  }
+  return 0;
+}
+
+// Claim a directory entry, an inode and the blocks for a file of size bytes and fill in its
+// metadata. The blocks are marked dirty here so filling them later needs no shared state.
+// Returns the inode, or an MFS_E code if the file can't be placed, leaving the image unchanged.
+int32_t reserve_file(struct mfs *fs, char *filename, off_t size)
+{
+  if (strlen(filename) > 64)
+  {
+    return MFS_ENAMETOOLONG;
+  }
+
+  // verify that the file isnt too big
+  if (size > MAX_FILE_SIZE)
+  {
+    return MFS_EFBIG;
+  }
+
+  // verify that there is enough space
+  if (size > df(fs))
+  {
+    return MFS_ENOSPC;
+  }
+
+  // find an empty directory entry
+  int i = 0;
+  int directory_entry = -1;
+  for (i = 0; i < fs->num_files; i++)
+  {
+    if (fs->directory[i].in_use == 0)
+    {
+      directory_entry = i;
+      break;
+    }
+  }
+  if (directory_entry == -1)
+  {
+    return MFS_ENFILE;
+  }
+
+  // find a free inode
+  int32_t inode_index = findFreeInode(fs);
+  if (inode_index == -1)
+  {
+    return MFS_ENFILE;
+  }
+
+  // an encrypted file's keystream must be new, a file can't be stored without one
+  uint32_t generation = 0;
+  if (cipher_key_set && getrandom(&generation, sizeof(generation), 0) != sizeof(generation))
+  {
+    return MFS_EIO;
+  }
+
+  // Reserve the blocks as a few long runs before anything is written so a file that can't
+  // be placed leaves the image as it was. The extents are built in a copy, since the inode
+  // may still hold a deleted file that can be brought back until this one takes it.
+  struct inode reserved;
+  memset(&reserved, 0, sizeof(reserved));
+
+  // a small enough file is packed instead
+  int32_t need = (size + fs->block_size - 1) / fs->block_size;
+  if (size > 0 && size <= fs->pack_size)
+  {
+    int ret = pack_reserve(fs, &reserved, size);
+    if (ret != MFS_OK)
+    {
+      return ret;
+    }
+    need = 0;
+  }
+  while (reserved.num_blocks < need)
+  {
+    int32_t length;
+    int32_t start = claim_run(fs, need - reserved.num_blocks, &length);
+    if (start != -1 && append_extent(fs, &reserved, start, length) == -1)
+    {
+      set_free_run(fs, start, length, 1);
+      start = -1;
+    }
+    if (start == -1)
+    {
+      truncate_extents(fs, &reserved, 0);
+      return MFS_EFRAGMENTED;
+    }
+  }
+  struct inode *file_inode = &fs->inodes[inode_index];
+  memcpy(file_inode->extents, reserved.extents, sizeof(reserved.extents));
+  file_inode->num_extents = reserved.num_extents;
+  file_inode->num_blocks = reserved.num_blocks;
+
+  // place the file info in the directory, dropping the deleted file the entry held before
+  dir_index_remove(fs, directory_entry);
+  fs->directory[directory_entry].in_use = 1;
+  fs->directory[directory_entry].inode = inode_index;
+  memset(fs->directory[directory_entry].filename, 0, 64);
+  memcpy(fs->directory[directory_entry].filename, filename, strlen(filename));
+  mark_dirty_range(fs, &fs->directory[directory_entry], sizeof(struct directoryEntry));
+  dir_index_add(fs, directory_entry);
+
+  file_inode->file_size = size;
+  file_inode->in_use = 1;
+  file_inode->attribute = 0;
+  if (cipher_key_set)
+  {
+    file_inode->generation = generation;
+    file_inode->attribute |= ENCRYPTED;
+    file_inode->key_check = fs->key_check;
+  }
+  if (fs->compress && need > 1)
+  {
+    file_inode->attribute |= COMPRESSED;
+    forget_inflated(fs, inode_index);
+  }
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  set_free_inode(fs, inode_index, 0);
+
+  // a compressed file marks the blocks it keeps as it fills them
+  struct extentPath path = {0};
+  for (i = 0; i < file_inode->num_extents && !(file_inode->attribute & COMPRESSED); i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    mark_dirty_range(fs, block_data(fs, ext->start), (size_t)ext->length * fs->block_size);
+  }
+  return inode_index;
+}
+
+// Copy the contents of a reserved file in from fd. Only the file's own blocks are touched so
+// different files can be filled at the same time. Returns -1 if fd or the image couldn't be
+// read.
+int fill_file(struct mfs *fs, int32_t inode_index, int fd)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  struct extentPath path = {0};
+  int i;
+
+  if (is_packed(file_inode))
+  {
+    // the bytes are read in, and encrypted if the file is, before they go into the image
+    uint32_t size = file_inode->file_size;
+    uint8_t *dest = packed_data(fs, file_inode);
+    uint8_t *in = malloc(size);
+    size_t copied = 0;
+    while (dest != NULL && in != NULL && copied < size)
+    {
+      ssize_t ret = pread(fd, in + copied, size - copied, copied);
+      if (ret <= 0)
+      {
+        break;
+      }
+      copied += ret;
+    }
+    if (copied == size)
+    {
+      if (file_inode->attribute & ENCRYPTED)
+      {
+        crypt_range(fs, inode_index, 0, in, size);
+      }
+      memcpy(dest, in, size);
+      mark_packed_dirty(fs, file_inode);
+    }
+    free(in);
+    return (copied == size) ? 0 : -1;
+  }
+
+  // a compressed file that doesn't shrink is filled as it is below
+  int dedup = fs->dedup && !(file_inode->attribute & ENCRYPTED);
+  if (file_inode->attribute & COMPRESSED)
+  {
+    int ret = compress_file(fs, inode_index, fd);
+    if (ret == 0 && dedup)
+    {
+      dedup_file(fs, inode_index);
+    }
+    if (ret != 1)
+    {
+      return ret;
+    }
+  }
+
+  // The blocks of an extent are next to each other in data so each one is filled in one
+  // go. Whatever is left of the last block past the end of the file is zeroed.
+  size_t copy_size = file_inode->file_size;
+  off_t offset = 0;
+  for (i = 0; i < file_inode->num_extents; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    uint8_t *dest = (ext == NULL) ? NULL : cache_blocks(fs, ext->start, ext->length);
+    if (dest == NULL)
+    {
+      return -1;
+    }
+    size_t extent_bytes = (size_t)ext->length * fs->block_size;
+    size_t bytes = extent_bytes;
+
+    if (bytes > copy_size)
+    {
+      memset(dest + copy_size, 0, bytes - copy_size);
+      bytes = copy_size;
+    }
+    if (ingest_extent(fs, inode_index, fd, offset, ext->start, bytes) == -1)
+    {
+      return -1;
+    }
+    copy_size -= bytes;
+    offset += bytes;
+  }
+  if (dedup)
+  {
+    dedup_file(fs, inode_index);
+  }
+  return 0;
+}
+
+// Give back everything reserve_file took for a file that couldn't be filled. The entry leaves
+// the directory for good, so undelete can't bring back blocks that were never written. It is
+// found by its inode, since another file may have the same name.
+void release_file(struct mfs *fs, int32_t inode_index)
+{
+  struct inode *file_inode = &fs->inodes[inode_index];
+  int32_t entry;
+  for (entry = 0; entry < fs->num_files; entry++)
+  {
+    if (fs->directory[entry].in_use && fs->directory[entry].inode == inode_index)
+    {
+      break;
+    }
+  }
+  if (entry == fs->num_files)
+  {
+    return;
+  }
+
+  dir_index_remove(fs, entry);
+  memset(&fs->directory[entry], 0, sizeof(struct directoryEntry));
+  mark_dirty_range(fs, &fs->directory[entry], sizeof(struct directoryEntry));
+
+  free_file_blocks(fs, file_inode, 1);
+  memset(file_inode, 0, sizeof(struct inode));
+  mark_dirty_range(fs, file_inode, sizeof(struct inode));
+  set_free_inode(fs, inode_index, 1);
+}
+
+void insert(struct mfs *fs, char *filename)
+{
+  // verify the filename isnt NULL
+
+  if (filename == NULL)
+  {
+    report_error("ERROR: Filename is NULL\n");
+    return;
+  }
+
+  // verify the file exits
+  struct stat buf;
+  int ret = stat(filename, &buf);
+
+  if (ret == -1)
+  {
+    report_error("INSERT ERROR: File doesn't exist.\n");
+    return;
+  }
+
+  int ifd = open(filename, O_RDONLY);
+  if (ifd == -1)
+  {
+    report_error("INSERT ERROR: Can not open %s.\n", filename);
+    return;
+  }
+
+  int32_t inode_index = reserve_file(fs, filename, buf.st_size);
+  if (inode_index < 0)
+  {
+    report_error("INSERT ERROR: %s.\n", mfs_strerror(inode_index));
+    close(ifd);
+    return;
+  }
+  printf("Reading %d bytes from %s\n", (int)buf.st_size, filename);
+
+  if (fill_file(fs, inode_index, ifd) == -1)
+  {
+    report_error("An error occured reading from the input file.\n");
+    release_file(fs, inode_index);
+  }
+
+  // We are done copying from the input file so close it out.
+  close(ifd);
+}
+
+// Open one insert-many source and read it into the page cache, so the copy threads find it
+// there. Only the first INSERT_READAHEAD bytes are read before the item is handed on, the
+// kernel is asked to go on with the rest. Sets fd and size and returns the state the item
+// moves to.
+int insert_open(struct insertItem *item)
+{
+  struct stat buf;
+  int fd = open(item->path, O_RDONLY);
+
+  if (fd != -1 && fstat(fd, &buf) == 0 && S_ISREG(buf.st_mode))
+  {
+    off_t ahead = (buf.st_size < INSERT_READAHEAD) ? buf.st_size : INSERT_READAHEAD;
+    readahead(fd, 0, ahead);
+    if (buf.st_size > ahead)
+    {
+      posix_fadvise(fd, ahead, buf.st_size - ahead, POSIX_FADV_WILLNEED);
+    }
+    item->fd = fd;
+    item->size = buf.st_size;
+    return ITEM_OPENED;
+  }
+  if (fd != -1)
+  {
+    close(fd);
+  }
+  return ITEM_FAILED;
+}
+
+// Stage 1 of insert-many. Claims sources in order and opens and reads them, staying at most
+// INSERT_WINDOW files in front of the allocator so the open files stay bounded.
+void *insert_reader(void *arg)
+{
+  struct insertPipeline *pipe = arg;
+
+  pthread_mutex_lock(&pipe->lock);
+  while (1)
+  {
+    while (pipe->next_open < pipe->count && pipe->next_open - pipe->consumed >= INSERT_WINDOW)
+    {
+      pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    if (pipe->next_open >= pipe->count)
+    {
+      break;
+    }
+    struct insertItem *item = &pipe->items[pipe->next_open++];
+    pthread_mutex_unlock(&pipe->lock);
+
+    int state = insert_open(item);
+
+    pthread_mutex_lock(&pipe->lock);
+    item->state = state;
+    pthread_cond_broadcast(&pipe->changed);
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+// Stage 3 of insert-many. Fills the files the allocator has reserved, one at a time.
+void *insert_copier(void *arg)
+{
+  struct insertPipeline *pipe = arg;
+  struct mfs *fs = pipe->fs;
+
+  pthread_mutex_lock(&pipe->lock);
+  while (1)
+  {
+    while (pipe->next_copy == pipe->queued && !pipe->allocated)
+    {
+      pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    if (pipe->next_copy == pipe->queued)
+    {
+      break;
+    }
+    struct insertItem *item = &pipe->items[pipe->copy_queue[pipe->next_copy++]];
+    pthread_mutex_unlock(&pipe->lock);
+
+    int ret = fill_file(fs, item->inode, item->fd);
+    close(item->fd);
+
+    // the allocator may still be placing files, so the entry is given back once it is done
+    pthread_mutex_lock(&pipe->lock);
+    if (ret == -1)
+    {
+      report_error("INSERT ERROR: Could not read %s.\n", item->path);
+      item->state = ITEM_UNREAD;
+      pipe->failed++;
+    }
+    else
+    {
+      pipe->files++;
+      pipe->bytes += item->size;
+    }
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+}
+
+// Insert many host files in one pipeline. Reader threads open the sources and read them into
+// the page cache ahead of time, this thread alone reserves directory entries, inodes and
+// blocks for them in order, and copy threads fill the reserved blocks from the page cache
+// while the next files are being placed.
+void insert_many(struct mfs *fs, char **paths, int32_t count)
+{
+  struct insertPipeline pipe;
+  struct timespec begin;
+  struct timespec end;
+  pthread_t readers[INSERT_THREADS];
+  pthread_t copiers[INSERT_THREADS];
+  int num_readers = 0;
+  int num_copiers = 0;
+  int32_t i;
+
+  memset(&pipe, 0, sizeof(pipe));
+  pipe.items = calloc(count, sizeof(struct insertItem));
+  pipe.copy_queue = calloc(count, sizeof(int32_t));
+  if (pipe.items == NULL || pipe.copy_queue == NULL)
+  {
+    report_error("INSERT ERROR: Out of memory.\n");
+    free(pipe.items);
+    free(pipe.copy_queue);
+    return;
+  }
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.changed, NULL);
+  pipe.fs = fs;
+  pipe.count = count;
+  for (i = 0; i < count; i++)
+  {
+    pipe.items[i].path = paths[i];
+    pipe.items[i].fd = -1;
+  }
+
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > INSERT_THREADS)
+  {
+    workers = INSERT_THREADS;
+  }
+  if (workers < 1)
+  {
+    workers = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  for (i = 0; i < workers; i++)
+  {
+    if (pthread_create(&readers[num_readers], NULL, insert_reader, &pipe) == 0)
+    {
+      num_readers++;
+    }
+    if (pthread_create(&copiers[num_copiers], NULL, insert_copier, &pipe) == 0)
+    {
+      num_copiers++;
+    }
+  }
+
+  // Stage 2, the allocator, takes the sources strictly in order so files land in the
+  // directory in the order they were named. Each pass places every source opened so far, up
+  // to INSERT_WINDOW of them, and hands them to the copy threads together. Block runs are
+  // still claimed a file at a time under alloc_lock, which copy threads sharing blocks in an
+  // image that dedups take as well, as do library calls on the same image.
+  int32_t first = 0;
+  while (first < count)
+  {
+    int32_t last = first + 1;
+    pthread_mutex_lock(&pipe.lock);
+    if (num_readers == 0)
+    {
+      // no reader threads could be started so open the sources here
+      last = (count - first < INSERT_WINDOW) ? count : first + INSERT_WINDOW;
+      for (i = first; i < last; i++)
+      {
+        pipe.items[i].state = insert_open(&pipe.items[i]);
+      }
+    }
+    while (pipe.items[first].state == ITEM_PENDING)
+    {
+      pthread_cond_wait(&pipe.changed, &pipe.lock);
+    }
+    while (last < count && last - first < INSERT_WINDOW && pipe.items[last].state != ITEM_PENDING)
+    {
+      last++;
+    }
+    pthread_mutex_unlock(&pipe.lock);
+
+    for (i = first; i < last; i++)
+    {
+      struct insertItem *item = &pipe.items[i];
+      item->inode = MFS_EIO;
+      if (item->state == ITEM_FAILED)
+      {
+        report_error("INSERT ERROR: Can not open %s.\n", item->path);
+        continue;
+      }
+      item->inode = reserve_file(fs, item->path, item->size);
+      if (item->inode < 0)
+      {
+        report_error("INSERT ERROR: %s: %s.\n", item->path, mfs_strerror(item->inode));
+        close(item->fd);
+      }
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    for (i = first; i < last; i++)
+    {
+      if (pipe.items[i].inode < 0)
+      {
+        pipe.failed++;
+      }
       else
       {
-        // DELETE PROCESS
-        directory[i].in_use = false;           // sets inuse directory to false
-        inodes[directory[i].inode].in_use = 0; // sets inode to free
-        free_inodes[directory[i].inode] = 1;
+        pipe.copy_queue[pipe.queued++] = i;
+      }
+    }
+    pipe.consumed = last;
+    pthread_cond_broadcast(&pipe.changed);
+    pthread_mutex_unlock(&pipe.lock);
+    first = last;
+  }
+
+  pthread_mutex_lock(&pipe.lock);
+  pipe.allocated = 1;
+  pthread_cond_broadcast(&pipe.changed);
+  pthread_mutex_unlock(&pipe.lock);
+
+  if (num_copiers == 0)
+  {
+    insert_copier(&pipe);
+  }
+  for (i = 0; i < num_readers; i++)
+  {
+    pthread_join(readers[i], NULL);
+  }
+  for (i = 0; i < num_copiers; i++)
+  {
+    pthread_join(copiers[i], NULL);
+  }
+  for (i = 0; i < count; i++)
+  {
+    if (pipe.items[i].state == ITEM_UNREAD)
+    {
+      release_file(fs, pipe.items[i].inode);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  printf("Inserted %d files, %llu bytes in %.3f s (%.1f MiB/s)\n", pipe.files,
+         (unsigned long long)pipe.bytes, seconds,
+         seconds > 0 ? pipe.bytes / seconds / 1048576 : 0.0);
+  if (pipe.failed)
+  {
+    report_error("INSERT ERROR: %d files could not be inserted.\n", pipe.failed);
+  }
+
+  pthread_mutex_destroy(&pipe.lock);
+  pthread_cond_destroy(&pipe.changed);
+  free(pipe.items);
+  free(pipe.copy_queue);
+}
+
+// Expand the argument of insert-many, a glob or with -l a file listing one path per line,
+// and insert everything it names
+void insert_many_command(struct mfs *fs, char *option, char *argument)
+{
+  char **paths = NULL;
+  int32_t count = 0;
+  glob_t matches;
+  int globbed = 0;
+
+  if (strcmp("-l", option) == 0)
+  {
+    if (argument == NULL)
+    {
+      report_error("INSERT ERROR: no list file specified\n");
+      return;
+    }
+    FILE *list_file = fopen(argument, "r");
+    if (list_file == NULL)
+    {
+      report_error("INSERT ERROR: Can not open %s.\n", argument);
+      return;
+    }
+
+    char line[PATH_MAX];
+    int32_t capacity = 0;
+    while (fgets(line, sizeof(line), list_file))
+    {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0')
+      {
+        continue;
+      }
+      if (count == capacity)
+      {
+        capacity = capacity ? capacity * 2 : 64;
+        paths = realloc(paths, capacity * sizeof(char *));
+      }
+      paths[count++] = strdup(line);
+    }
+    fclose(list_file);
+  }
+  else
+  {
+    if (glob(option, 0, NULL, &matches) != 0)
+    {
+      report_error("INSERT ERROR: No files match %s.\n", option);
+      return;
+    }
+    globbed = 1;
+    paths = matches.gl_pathv;
+    count = matches.gl_pathc;
+  }
+
+  if (count > 0)
+  {
+    insert_many(fs, paths, count);
+  }
+
+  if (globbed)
+  {
+    globfree(&matches);
+  }
+  else
+  {
+    int32_t i;
+    for (i = 0; i < count; i++)
+    {
+      free(paths[i]);
+    }
+    free(paths);
+  }
+}
+
+// XOR KERNELS
+// Every kernel XORs len bytes at str with key. encrypt_block uses the widest one the CPU
+// supports, picked by select_xor_kernel.
+void (*xor_kernel)(uint8_t *, char, uint32_t) = encrypt_block_word;
+
+void encrypt_block_scalar(uint8_t *str, char key, uint32_t len)
+{
+  int i;
+  for (i = 0; i < len; i++)
+  {
+    str[i] ^= key;
+  }
+}
+
+// Portable kernel, XORs eight bytes at a time with the key repeated across a word
+void encrypt_block_word(uint8_t *str, char key, uint32_t len)
+{
+  uint64_t wide_key = (uint8_t)key * 0x0101010101010101ULL;
+  uint32_t i = 0;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, str + i, 8);
+    word ^= wide_key;
+    memcpy(str + i, &word, 8);
+  }
+  encrypt_block_scalar(str + i, key, len - i);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void encrypt_block_sse2(uint8_t *str, char key, uint32_t len)
+{
+  __m128i wide_key = _mm_set1_epi8(key);
+  uint32_t i = 0;
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i *p = (__m128i *)(str + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), wide_key));
+  }
+  encrypt_block_scalar(str + i, key, len - i);
+}
+
+__attribute__((target("avx2")))
+void encrypt_block_avx2(uint8_t *str, char key, uint32_t len)
+{
+  __m256i wide_key = _mm256_set1_epi8(key);
+  uint32_t i = 0;
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i *p = (__m256i *)(str + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), wide_key));
+  }
+  encrypt_block_scalar(str + i, key, len - i);
+}
+
+__attribute__((target("avx512f")))
+void encrypt_block_avx512(uint8_t *str, char key, uint32_t len)
+{
+  __m512i wide_key = _mm512_set1_epi8(key);
+  uint32_t i = 0;
+  for (; i + 64 <= len; i += 64)
+  {
+    _mm512_storeu_si512(str + i, _mm512_xor_si512(_mm512_loadu_si512(str + i), wide_key));
+  }
+  encrypt_block_scalar(str + i, key, len - i);
+}
+#endif
+
+// Compare a kernel against the scalar loop over a spread of lengths and misalignments.
+// Returns 1 if every result matches.
+int xor_self_check(void (*kernel)(uint8_t *, char, uint32_t))
+{
+  uint8_t expect[DEFAULT_BLOCK_SIZE + 64];
+  uint8_t got[DEFAULT_BLOCK_SIZE + 64];
+  uint32_t i;
+
+  for (i = 0; i < sizeof(expect); i++)
+  {
+    expect[i] = (uint8_t)(i * 131 + 7);
+  }
+  memcpy(got, expect, sizeof(got));
+
+  uint32_t offset;
+  uint32_t len;
+  for (offset = 0; offset < 64; offset += 13)
+  {
+    for (len = 0; len + offset <= sizeof(expect); len += 97)
+    {
+      encrypt_block_scalar(expect + offset, (char)(len + 0x5a), len);
+      kernel(got + offset, (char)(len + 0x5a), len);
+      if (memcmp(expect, got, sizeof(expect)) != 0)
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Pick the widest XOR kernel this CPU runs, keeping the portable one if it fails its check
+void select_xor_kernel()
+{
+  xor_kernel = encrypt_block_word;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && xor_self_check(encrypt_block_avx512))
+  {
+    xor_kernel = encrypt_block_avx512;
+  }
+  else if (__builtin_cpu_supports("avx2") && xor_self_check(encrypt_block_avx2))
+  {
+    xor_kernel = encrypt_block_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2") && xor_self_check(encrypt_block_sse2))
+  {
+    xor_kernel = encrypt_block_sse2;
+  }
+#endif
+}
+
+void encrypt_block(uint8_t *str, char key, uint32_t len)
+{
+  xor_kernel(str, key, len);
+}
+
+void encrypt(struct mfs *fs, char *filename, char cypher)
+{
+  int i;
+  int file_index = lookup(fs, filename, 0);
+
+  if (file_index == -1)
+  {
+    report_error("ERROR: File not found in file system\n");
+    return;
+  }
+
+  int32_t inode_index = fs->directory[file_index].inode;
+  struct inode *file_inode = &fs->inodes[inode_index];
+
+  if (!file_inode->in_use)
+  {
+    report_error("ERROR: inode is not in use\n");
+    return;
+  }
+
+  // the contents are XORed, so a compressed file is stored as it is first
+  if (file_inode->attribute & COMPRESSED)
+  {
+    int ret = MFS_EKEY;
+    if (!(file_inode->attribute & ENCRYPTED) || key_matches(fs, inode_index))
+    {
+      ret = inflate_file(fs, inode_index);
+    }
+    if (ret != MFS_OK)
+    {
+      report_error("ERROR: %s.\n", mfs_strerror(ret));
+      return;
+    }
+  }
+
+  // and blocks it shares with other files are copied, so only this one changes
+  int ret = unshare_blocks(fs, inode_index, 0, file_inode->num_blocks);
+  if (ret < 0)
+  {
+    report_error("ERROR: %s.\n", mfs_strerror(ret));
+    return;
+  }
+
+  if (is_packed(file_inode))
+  {
+    uint8_t *packed = packed_data(fs, file_inode);
+    if (packed == NULL)
+    {
+      report_error("ERROR: %s.\n", mfs_strerror(MFS_EIO));
+      return;
+    }
+    encrypt_block(packed, cypher, file_inode->file_size);
+    mark_packed_dirty(fs, file_inode);
+    return;
+  }
+
+  // every extent is read in before any is changed, so a file is never left half XORed
+  struct extentPath path = {0};
+  for (i = 0; i < file_inode->num_extents; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (ext == NULL || cache_blocks(fs, ext->start, ext->length) == NULL)
+    {
+      report_error("ERROR: %s.\n", mfs_strerror(MFS_EIO));
+      return;
+    }
+  }
+
+  // Each extent is contiguous in data so it is XORed in one call
+  uint32_t encrypt_size = file_inode->file_size;
+  for (i = 0; i < file_inode->num_extents && encrypt_size > 0; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    uint32_t extent_len = ext->length * fs->block_size;
+    if (encrypt_size < extent_len)
+    {
+      extent_len = encrypt_size;
+    }
+
+    uint8_t *blocks = block_data(fs, ext->start);
+    encrypt_block(blocks, cypher, extent_len);
+    mark_dirty_range(fs, blocks, extent_len);
+
+    encrypt_size -= extent_len;
+  }
+}
+
+// Check whether any of len blocks starting at start changed since the image was saved
+int blocks_dirty(struct mfs *fs, int32_t start, int32_t len)
+{
+  int32_t block;
+  for (block = start; block < start + len; block++)
+  {
+    if (fs->dirty_blocks[block / 64] & ((uint64_t)1 << (block % 64)))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Decrypt a file an extent at a time into a buffer and write it to out_fd
+int output_encrypted_file(struct mfs *fs, struct inode *file_inode, int out_fd)
+{
+  int32_t inode_index = file_inode - fs->inodes;
+  struct extentPath path = {0};
+  size_t remaining = file_inode->file_size;
+  uint32_t file_offset = 0;
+  int i;
+
+  // a packed file is decrypted like one extent
+  int packed = is_packed(file_inode);
+  for (i = 0; (i < file_inode->num_extents || packed) && remaining > 0; i++)
+  {
+    struct extent whole = {0, 1};
+    struct extent *ext = packed ? &whole : file_extent(fs, file_inode, i, &path);
+    uint8_t *stored = packed ? packed_data(fs, file_inode)
+                             : (ext == NULL) ? NULL : cache_blocks(fs, ext->start, ext->length);
+    if (stored == NULL)
+    {
+      errno = EIO;
+      return -1;
+    }
+    size_t bytes = (size_t)ext->length * fs->block_size;
+    if (bytes > remaining)
+    {
+      bytes = remaining;
+    }
+
+    uint8_t *plain = malloc(bytes);
+    if (plain == NULL)
+    {
+      return -1;
+    }
+    memcpy(plain, stored, bytes);
+    crypt_range(fs, inode_index, file_offset, plain, bytes);
+
+    size_t written = 0;
+    while (written < bytes)
+    {
+      ssize_t ret = write(out_fd, plain + written, bytes - written);
+      if (ret == -1)
+      {
+        free(plain);
+        return -1;
+      }
+      written += ret;
+    }
+    free(plain);
+
+    remaining -= bytes;
+    file_offset += (uint32_t)ext->length * fs->block_size;
+  }
+  return 0;
+}
+
+// Decompress a file, decrypting it too if it is encrypted, READ_CHUNK bytes at a time and
+// write it to out_fd
+int output_compressed_file(struct mfs *fs, struct inode *file_inode, int out_fd)
+{
+  int32_t inode_index = file_inode - fs->inodes;
+  uint64_t cursor = 0;
+  uint32_t offset = 0;
+
+  uint8_t *plain = malloc(READ_CHUNK);
+  if (plain == NULL)
+  {
+    return -1;
+  }
+  while (offset < file_inode->file_size)
+  {
+    uint32_t bytes = file_inode->file_size - offset;
+    if (bytes > READ_CHUNK)
+    {
+      bytes = READ_CHUNK;
+    }
+    if (read_compressed(fs, inode_index, plain, offset, bytes, &cursor) != MFS_OK)
+    {
+      free(plain);
+      errno = EIO;
+      return -1;
+    }
+
+    size_t written = 0;
+    while (written < bytes)
+    {
+      ssize_t ret = write(out_fd, plain + written, bytes - written);
+      if (ret == -1)
+      {
+        free(plain);
+        return -1;
+      }
+      written += ret;
+    }
+    offset += bytes;
+  }
+  free(plain);
+  return 0;
+}
 
-        // FREE INODES
-        int blockNum = 0;
-        for (int j = 0; j < BLOCKS_PER_FILE; j++)
+// Write out count extents of a file gathered in iov, with copy_file_range from the image
+// when on_disk says it holds them
+int output_extents(struct mfs *fs, struct iovec *iov, int count, int on_disk, int out_fd)
+{
+  int i;
+  int first = 0;
+  if (on_disk)
+  {
+    for (; first < count; first++)
+    {
+      loff_t off_in = (uint8_t *)iov[first].iov_base - fs->data;
+      size_t copied = 0;
+      while (copied < iov[first].iov_len)
+      {
+        ssize_t ret = copy_file_range(fileno(fs->fp), &off_in, out_fd, NULL,
+                                      iov[first].iov_len - copied, 0);
+        if (ret <= 0)
         {
-          // set blockNum to inodes's directory[i] block
-          blockNum = inodes[directory[i].inode].blocks[j];
-          if (blockNum != -1) // if block is in use
-          {
-            free_blocks[blockNum - 1065] = 1; // set free_blocks blockNum to 1
-            free_blocks[blockNum] = 1;
-          }
+          break;
         }
+        copied += ret;
+      }
+
+      // whatever the kernel wouldn't copy is written from memory below
+      iov[first].iov_base = (uint8_t *)iov[first].iov_base + copied;
+      iov[first].iov_len -= copied;
+      if (iov[first].iov_len > 0)
+      {
         break;
       }
     }
   }
-}
-
-void undelete(char *filename)
-{
-  // verify the filename isnt NULL
-  if (filename == NULL)
+
+  // Whatever goes out of memory has to be read in first
+  for (i = first; i < count; i++)
+  {
+    size_t offset = (uint8_t *)iov[i].iov_base - fs->data;
+    int32_t block = offset / fs->block_size;
+    if (cache_blocks(fs, block, (offset + iov[i].iov_len - 1) / fs->block_size - block + 1) ==
+        NULL)
+    {
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  while (first < count)
+  {
+    ssize_t ret = writev(out_fd, &iov[first], count - first);
+    if (ret == -1)
+    {
+      return -1;
+    }
+
+    // step past what was written, which may end part way through an extent
+    while (first < count && (size_t)ret >= iov[first].iov_len)
+    {
+      ret -= iov[first].iov_len;
+      first++;
+    }
+    if (first < count)
+    {
+      iov[first].iov_base = (uint8_t *)iov[first].iov_base + ret;
+      iov[first].iov_len -= ret;
+    }
+  }
+  return 0;
+}
+
+// Write the contents of a file to out_fd. When the image file holds the current contents,
+// because it is mapped or the blocks are clean, the kernel copies each extent from the image
+// with copy_file_range. Otherwise all the extents go out of data in writev calls.
+int output_file(struct mfs *fs, struct inode *file_inode, int out_fd)
+{
+  if (file_inode->attribute & COMPRESSED)
+  {
+    return output_compressed_file(fs, file_inode, out_fd);
+  }
+  if (file_inode->attribute & ENCRYPTED)
+  {
+    return output_encrypted_file(fs, file_inode, out_fd);
+  }
+
+  // a packed file goes out of memory, its blocks may be shared
+  if (is_packed(file_inode))
+  {
+    struct iovec packed = {packed_data(fs, file_inode), file_inode->file_size};
+    if (packed.iov_base == NULL)
+    {
+      errno = EIO;
+      return -1;
+    }
+    return output_extents(fs, &packed, 1, 0, out_fd);
+  }
+
+  // the extents go out OUTPUT_BATCH at a time, however many the file has
+  struct iovec iov[OUTPUT_BATCH];
+  struct extentPath path = {0};
+  int count = 0;
+  int on_disk = 1;
+  size_t remaining = file_inode->file_size;
+  int i;
+
+  for (i = 0; i < file_inode->num_extents && remaining > 0; i++)
+  {
+    struct extent *ext = file_extent(fs, file_inode, i, &path);
+    if (ext == NULL)
+    {
+      errno = EIO;
+      return -1;
+    }
+    size_t bytes = (size_t)ext->length * fs->block_size;
+    if (bytes > remaining)
+    {
+      bytes = remaining;
+    }
+    iov[count].iov_base = block_data(fs, ext->start);
+    iov[count].iov_len = bytes;
+    count++;
+    remaining -= bytes;
+
+    if (!fs->image_mapped && blocks_dirty(fs, ext->start, ext->length))
+    {
+      on_disk = 0;
+    }
+
+    if (count == OUTPUT_BATCH || remaining == 0 || i == file_inode->num_extents - 1)
+    {
+      if (output_extents(fs, iov, count, on_disk, out_fd) == -1)
+      {
+        return -1;
+      }
+      count = 0;
+      on_disk = 1;
+    }
+  }
+  return 0;
+}
+
+void retrieve(struct mfs *fs, char *FName, char *NFName)
+{
+  if (FName == NULL)
+  {
+    report_error("ERROR: Filename is not here?");
+    return;
+  }
+  int DirEntry = lookup(fs, FName, 0);
+  if (DirEntry == -1)
+  {
+    report_error("ERROR: File not found\n");
+    return;
+  }
+  int32_t IIdx = fs->directory[DirEntry].inode;
+  if ((fs->inodes[IIdx].attribute & ENCRYPTED) && !key_matches(fs, IIdx))
+  {
+    report_error("ERROR: File is encrypted with a different key\n");
+    return;
+  }
+  if (NFName == NULL)
+  {
+    NFName = FName;
+  }
+  int OutFd = open(NFName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (OutFd == -1)
   {
-    printf("UNDELETE: Can not find the file.\n");
+    report_error("ERROR:can't output file creation");
     return;
   }
+  if (output_file(fs, &fs->inodes[IIdx], OutFd) == -1)
+  {
+    report_error("ERROR: %s\n", strerror(errno));
+  }
+  close(OutFd);
+}
 
-  // FIND DIRECTORY IT IS UNDER
-  int directory_entry = -1;
-  for (int i = 0; i < NUM_FILES; i++)
+// Claim files off the job one at a time and write each to hostdir
+void *export_worker(void *arg)
+{
+  struct exportJob *job = arg;
+  struct mfs *fs = job->fs;
+  int32_t claimed;
+
+  while ((claimed = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
   {
-    if ((directory[i].in_use == 0) && (strcmp(directory[i].filename, filename) == 0))
+    int32_t entry = job->entries[claimed];
+    int32_t inode_index = fs->directory[entry].inode;
+
+    // a filename inserted with a path keeps it, flattened into one name
+    char name[65];
+    memset(name, 0, sizeof(name));
+    strncpy(name, fs->directory[entry].filename, 64);
+    char *slash;
+    while ((slash = strchr(name, '/')) != NULL)
     {
-      // finds directory in use
-      directory_entry = i;
+      *slash = '_';
+    }
 
-      // UNDELETE PROCESS
-      directory[i].in_use = true;            // sets inuse directory to true
-      inodes[directory[i].inode].in_use = 1; // sets inode to in_use
-      free_inodes[directory[i].inode] = 0;   // sets free_inodes to 0
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", job->hostdir, name);
 
-      // FREE INODES
-      int blockNum = 0;
-      for (int j = 0; j < BLOCKS_PER_FILE; j++)
-      {
-        // set blockNum to inodes's directory block
-        blockNum = inodes[directory[i].inode].blocks[j];
-        if (blockNum != -1) // if block is in use
-        {
-          free_blocks[blockNum - 1065] = 0; // set free_blocks blockNum to 0
-          free_blocks[blockNum] = 0;
-        }
-      }
-      break;
+    int out_fd = -1;
+    if (!(fs->inodes[inode_index].attribute & ENCRYPTED) || key_matches(fs, inode_index))
+    {
+      out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (out_fd == -1 || output_file(fs, &fs->inodes[inode_index], out_fd) == -1)
+    {
+      report_error("EXPORT ERROR: Could not write %s\n", path);
+      __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+      __atomic_fetch_add(&job->files, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&job->bytes, fs->inodes[inode_index].file_size, __ATOMIC_RELAXED);
+    }
+    if (out_fd != -1)
+    {
+      close(out_fd);
     }
   }
+  return NULL;
 }
 
-void read_file(char *filename, int start, int len)
+// Write every file whose name matches pattern, or every file if there is no pattern, into
+// hostdir. The files are shared out over a pool of workers which each keep at most one
+// output file open, so no more than MAX_EXPORT_FDS are ever open at once.
+void export_files(struct mfs *fs, char *hostdir, char *pattern)
 {
+  struct exportJob job;
+  struct timespec begin;
+  struct timespec end;
   int i;
-  int file_index = -1;
-  for (i = 0; i < NUM_FILES; i++)
+
+  memset(&job, 0, sizeof(job));
+  job.fs = fs;
+  job.hostdir = hostdir;
+  job.entries = malloc(fs->num_files * sizeof(int32_t));
+  if (job.entries == NULL)
+  {
+    report_error("EXPORT ERROR: Out of memory.\n");
+    return;
+  }
+  for (i = 0; i < fs->num_files; i++)
   {
-    if (directory[i].in_use && strcmp(filename, directory[i].filename) == 0)
+    char name[65];
+    memset(name, 0, sizeof(name));
+    strncpy(name, fs->directory[i].filename, 64);
+
+    if (fs->directory[i].in_use && (pattern == NULL || fnmatch(pattern, name, 0) == 0))
     {
-      file_index = i;
-      break;
+      job.entries[job.count++] = i;
     }
   }
-  if (file_index == -1)
+  if (job.count == 0)
+  {
+    printf("EXPORT: No files found.\n");
+    free(job.entries);
+    return;
+  }
+
+  if (mkdir(hostdir, 0755) == -1 && errno != EEXIST)
   {
-    printf("ERROR: file not found in disk image\n");
+    report_error("EXPORT ERROR: Can not create %s.\n", hostdir);
+    free(job.entries);
     return;
   }
 
-  struct inode *file_inode = &inodes[directory[i].inode];
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > MAX_EXPORT_FDS)
+  {
+    workers = MAX_EXPORT_FDS;
+  }
+  if (workers > job.count)
+  {
+    workers = job.count;
+  }
+  if (workers < 1)
+  {
+    workers = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
 
-  int block_index = file_inode->blocks[(start + 1) / BLOCK_SIZE];
+  // The calling thread works through the job alongside the pool
+  pthread_t threads[MAX_EXPORT_FDS];
+  int started = 0;
+  for (i = 1; i < workers; i++)
+  {
+    if (pthread_create(&threads[started], NULL, export_worker, &job) != 0)
+    {
+      break;
+    }
+    started++;
+  }
+  export_worker(&job);
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
 
-  for (i = start; i < (len + start) && i < file_inode->file_size; i++)
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  printf("Exported %d files, %llu bytes in %.3f s (%.1f MiB/s)\n", job.files,
+         (unsigned long long)job.bytes, seconds,
+         seconds > 0 ? job.bytes / seconds / 1048576 : 0.0);
+  if (job.failed)
   {
-    printf("%x ", data[block_index][i % BLOCK_SIZE]);
-    block_index = file_inode->blocks[(i + 1) / BLOCK_SIZE];
+    report_error("EXPORT ERROR: %d files could not be written.\n", job.failed);
   }
-  printf("\n");
+  free(job.entries);
+}
+
+void undelete(struct mfs *fs, char *filename)
+{
+  // verify the filename isnt NULL
+  if (filename == NULL)
+  {
+    report_error("UNDELETE: Can not find the file.\n");
+    return;
+  }
+
+  // FIND DIRECTORY IT IS UNDER
+  int i = lookup(fs, filename, 1);
+  if (i == -1)
+  {
+    report_error("UNDELETE: Can not find the file.\n");
+    return;
+  }
+
+  // UNDELETE PROCESS
+  fs->directory[i].in_use = true;            // sets inuse directory to true
+  fs->inodes[fs->directory[i].inode].in_use = 1; // sets inode to in_use
+  set_free_inode(fs, fs->directory[i].inode, 0); // sets free_inodes to 0
+  mark_dirty_range(fs, &fs->directory[i], sizeof(struct directoryEntry));
+  mark_dirty_range(fs, &fs->inodes[fs->directory[i].inode], sizeof(struct inode));
+
+  // CLAIM BLOCKS
+  free_file_blocks(fs, &fs->inodes[fs->directory[i].inode], 0);
 }
 
-void attrib(char *typeAttrib, char *filename)
+void attrib(struct mfs *fs, char *typeAttrib, char *filename)
 {
   // FIND DIRECTORY IT IS IN
-  int directory_entry = -1;
-  for (int i = 0; i < NUM_FILES; i++)
+  int i = lookup(fs, filename, 0);
+  if (i == -1)
   {
-    if ((directory[i].in_use != 0) && (strcmp(directory[i].filename, filename) == 0))
-    {
-      // finds directory in use
-      directory_entry = i;
+    report_error("ATTRIB: File not found.\n");
+    return;
+  }
 
-      // USE ATTRIBUTES
-      if (strcmp("+h", typeAttrib) == 0)
-      {
-        inodes[directory[i].inode].attribute |= HIDDEN;
-      }
-      else if (strcmp("-h", typeAttrib) == 0)
-      {
-        inodes[directory[i].inode].attribute &= ~HIDDEN;
-      }
-      else if (strcmp("+r", typeAttrib) == 0)
-      {
-        inodes[directory[i].inode].attribute |= READONLY;
-      }
-      else if (strcmp("-r", typeAttrib) == 0)
-      {
-        inodes[directory[i].inode].attribute &= ~READONLY;
-      }
-      else
-      {
-        printf("ATTRIB: File not found.\n");
-      }
-    }
+  // USE ATTRIBUTES
+  mark_dirty_range(fs, &fs->inodes[fs->directory[i].inode], sizeof(struct inode));
+  if (strcmp("+h", typeAttrib) == 0)
+  {
+    fs->inodes[fs->directory[i].inode].attribute |= HIDDEN;
+  }
+  else if (strcmp("-h", typeAttrib) == 0)
+  {
+    fs->inodes[fs->directory[i].inode].attribute &= ~HIDDEN;
+  }
+  else if (strcmp("+r", typeAttrib) == 0)
+  {
+    fs->inodes[fs->directory[i].inode].attribute |= READONLY;
+  }
+  else if (strcmp("-r", typeAttrib) == 0)
+  {
+    fs->inodes[fs->directory[i].inode].attribute &= ~READONLY;
   }
 }
 
 void print_bin(uint8_t value)
 {
-  int bin = 0;
   int i;
 
-  // using switch case because there's very limited possible values
-  switch(value)
+  // most significant bit first
+  for (i = 7; i >= 0; i--)
   {
-    case 0:
-      printf("00000000\n");
-      break;
-    case 1:
-      printf("00000001\n");
-      break;
-    case 2:
-      printf("00000010\n");
-      break;
-    case 3:
-      printf("00000011\n");
-      break;
-    default:
-      break;
+    printf("%d", (value >> i) & 1);
   }
+  printf("\n");
 }
 
-void list(char *token, char * token2)
+void list(struct mfs *fs, char *token, char * token2)
 {
   // flags for parameters
   int hidden = 0;
@@ -654,36 +4560,36 @@ void list(char *token, char * token2)
   int i;
   int not_found = 1;
 
-  for (i = 0; i < NUM_FILES; i++)
+  for (i = 0; i < fs->num_files; i++)
   {
-    if (directory[i].in_use)
+    if (fs->directory[i].in_use)
     {
       not_found = 0;
       char filename[65];
       memset(filename, 0, 65);
-      strncpy(filename, directory[i].filename, strlen(directory[i].filename));
+      memcpy(filename, fs->directory[i].filename, 64);
 
       // if it is not hidden print out and does not have '-a'
-      if ((!(inodes[i].attribute & HIDDEN)) && (attribute8Bit == 0))
+      if ((!(fs->inodes[i].attribute & HIDDEN)) && (attribute8Bit == 0))
       {
         printf("%s\n", filename);
       }
       // if the hidden flag is triggered and '-a' is not triggered
-      else if ((inodes[i].attribute & HIDDEN) && (hidden == 1) && (attribute8Bit == 0))
+      else if ((fs->inodes[i].attribute & HIDDEN) && (hidden == 1) && (attribute8Bit == 0))
       {
         printf("%s\n", filename);
       }
       // if the attribute is triggered (8-bit) and not hidden
-      else if ((attribute8Bit == 1) && !(inodes[i].attribute & HIDDEN))
+      else if ((attribute8Bit == 1) && !(fs->inodes[i].attribute & HIDDEN))
       {
         printf("%s ", filename);
-        print_bin(inodes[directory[i].inode].attribute);
+        print_bin(fs->inodes[fs->directory[i].inode].attribute);
       }
       // if both flags trigger and hidden
-      else if ((attribute8Bit == 1) && (inodes[i].attribute & HIDDEN) && (hidden == 1))
+      else if ((attribute8Bit == 1) && (fs->inodes[i].attribute & HIDDEN) && (hidden == 1))
       {
         printf("%s ", filename);
-        print_bin(inodes[directory[i].inode].attribute);
+        print_bin(fs->inodes[fs->directory[i].inode].attribute);
       }
     }
   }
@@ -692,311 +4598,3 @@ void list(char *token, char * token2)
     printf("LIST: No files found.\n");
   }
 }
-
-void free_tokens(char *token[], int token_count)
-{
-  int i;
-  for (i = 0; i < token_count; i++)
-  {
-    if (token[i] != NULL)
-    {
-      free(token[i]);
-      token[i] = NULL;
-    }
-  }
-}
-
-// MAIN
-int main()
-{
-  char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
-  init();
-  fp = NULL;
-  while (1)
-  {
-    // Print out the msh prompt
-    printf("mfs> ");
-
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while (!fgets(command_string, MAX_COMMAND_SIZE, stdin));
-
-    /* Parse input */
-    char **token = calloc(MAX_NUM_ARGUMENTS, sizeof(char *));
-
-    for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
-    {
-      token[i] = NULL;
-    }
-
-    int token_count = 0;
-
-    // Pointer to point to the token
-    // parsed by strsep
-    char *argument_ptr = NULL;
-
-    char *working_string = strdup(command_string);
-
-    // we are going to move the working_string pointer so
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *head_ptr = working_string;
-
-    // Tokenize the input strings with whitespace used as the delimiter
-    while (((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
-           (token_count < MAX_NUM_ARGUMENTS))
-    {
-      token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
-      if (strlen(token[token_count]) == 0)
-      {
-        free(token[token_count]);
-        token[token_count] = NULL;
-      }
-      token_count++;
-    }
-
-    // Checks for blank input before proceding to prevent segmentation faults
-    if (token[0] == NULL);
-    // QUIT
-    else if (!strcmp(token[0], "quit"))
-    {
-      // Cleanup allocatec memory and exit program
-      if (image_open == 1)
-      {
-        closefs();
-      }
-      free_tokens(token, token_count);
-      free(token);
-      free(head_ptr);
-      free(command_string);
-      exit(EXIT_SUCCESS);
-    }
-    // CREATEFS
-    else if (strcmp("createfs", token[0]) == 0)
-    {
-      if (token[1] == NULL)
-      {
-        printf("CREATEFS: Filename not provided.\n");
-      }
-      else
-      {
-        createfs(token[1]);
-      }
-    }
-    // SAVEFS
-    else if (strcmp("savefs", token[0]) == 0)
-    {
-      savefs();
-    }
-    // CLOSE
-    else if (strcmp("close", token[0]) == 0)
-    {
-      closefs();
-    }
-    // OPEN
-    else if (strcmp("open", token[0]) == 0)
-    {
-      if (token[1] == NULL)
-      {
-        printf("OPEN ERROR: There is no filename specified.\n");
-      }
-      else
-      {
-        openfs(token[1]);
-      }
-    }
-    // LIST
-    else if (strcmp("list", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-      else
-      {
-        list(token[1], token[2]);
-      }
-    }
-    // DF
-    else if (strcmp("df", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-      else
-      {
-        printf("%d bytes free\n", df());
-      }
-    }
-    // INSERT
-    else if (strcmp("insert", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-      else if (token[1] == NULL)
-      {
-        printf("ERROR: no filename specified\n");
-      }
-      else
-      {
-        //checks filename length
-        if(strlen(token[1]) <= 64)
-        {
-          insert(token[1]);
-        }
-        else
-        {
-          printf("INSERT ERROR: Filename is too long.\n");
-        }
-      }
-    }
-    // ENCRYPT AND DECRYPT
-    else if (strcmp("encrypt", token[0]) == 0 || strcmp("decrypt", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-      else if (token[1] == NULL)
-      {
-        printf("ERROR: no filename specified\n");
-      }
-      else if (token[2] == NULL)
-      {
-        printf("ERROR: no cypher specified\n");
-      }
-      else if (strlen(token[2]) > 1)
-      {
-        printf("ERROR: cypher is not valid, cypher should include a single 1-byte value only\n");
-      }
-      else
-      {
-        encrypt(token[1], token[2][0]);
-      }
-    }
-    // RETRIEVE
-    else if (strcmp("retrieve", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-
-      else if (token[1] == NULL)
-      {
-        printf("ERROR: no filename specified\n");
-      }
-      else
-      {
-        retrieve(token[1], token[2]);
-      }
-    }
-    // DELETE
-    else if (strcmp("delete", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-      else if (token[1] == NULL)
-      {
-        printf("ERROR: no filename specified.\n");
-      }
-      else
-      {
-        delete (token[1]);
-      }
-    }
-    // UNDELETE
-    else if (strcmp("undelete", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ERROR: Disk image is not opened.\n");
-      }
-      else if (token[1] == NULL)
-      {
-        printf("ERROR: no filename specified.\n");
-      }
-      else
-      {
-        undelete(token[1]);
-      }
-    }
-    // ATTRIB
-    else if (strcmp("attrib", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("ATTRIB ERROR: Disk image is not opened.\n");
-      }
-      else if (token[1] == NULL)
-      {
-        printf("ATTRIB ERROR: attribute not specified.\n");
-      }
-      else if (token[2] == NULL)
-      {
-        printf("ATTRIB ERROR: no filename specified.\n");
-      }
-      else if (strcmp("+h", token[1]) == 0)
-      {
-        attrib(token[1], token[2]);
-      }
-      else if (strcmp("-h", token[1]) == 0)
-      {
-        attrib(token[1], token[2]);
-      }
-      else if (strcmp("+r", token[1]) == 0)
-      {
-        attrib(token[1], token[2]);
-      }
-      else if (strcmp("-r", token[1]) == 0)
-      {
-        attrib(token[1], token[2]);
-      }
-      else
-      {
-        printf("Something has gone wrong. Cannot set attribute\n");
-      }
-    }
-    // READ
-    else if (strcmp("read", token[0]) == 0)
-    {
-      if (!image_open)
-      {
-        printf("READ ERROR: Disk image is not opened.\n");
-      }
-      else if (token[1] == NULL)
-      {
-        printf("READ ERROR: Filename not specified\n");
-      }
-      else if (token[2] == NULL)
-      {
-        printf("READ ERROR: Starting byte not specified\n");
-      }
-      else if (token[3] == NULL)
-      {
-        printf("READ ERROR: Number of bytes not specified\n");
-      }
-      else
-      {
-        read_file(token[1], atoi(token[2]), atoi(token[3]));
-      }
-    }
-    else // COMMAND NOT FOUND
-    {
-      printf("ERROR: Command not found.\n");
-    }
-
-    free_tokens(token, token_count);
-    free(token);
-    free(head_ptr);
-  }
-}
-
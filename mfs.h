@@ -1,6 +1,8 @@
 #ifndef _MFS_H_
 #define _MFS_H_
 
+#define _GNU_SOURCE // copy_file_range
+
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -10,6 +12,26 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <time.h>
+#include <stdarg.h>
+#include <glob.h>
+#include <getopt.h>
+
+#include "chacha20.h"
+#include "sha256.h"
+#include "lz.h"
+#include "libmfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define WHITESPACE " \t\n" // We want to split our command line up into tokens
                            // so we need to define what delimits our tokens.
@@ -18,34 +40,148 @@
 
 #define MAX_COMMAND_SIZE 255 // The maximum command-line size
 
-#define MAX_NUM_ARGUMENTS 5 // Mav File System only supports ten arguments
+#define MAX_NUM_ARGUMENTS 10 // Mav File System only supports ten arguments
 
-#define NUM_BLOCKS 65536 // File System supports this number of blocks
+#define DEFAULT_BLOCK_SIZE 1024 // Geometry createfs uses for whatever it isn't given
+#define DEFAULT_NUM_BLOCKS 65536
+#define DEFAULT_NUM_FILES 256
 
-#define BLOCK_SIZE 1024 // The size of each block
+#define MIN_BLOCK_SIZE 1024  // Block sizes are powers of two between these
+#define MAX_BLOCK_SIZE 65536
+#define MAX_NUM_BLOCKS (1 << 30)
+#define MAX_NUM_FILES (1 << 20)
+#define MAX_IMAGE_SIZE ((off_t)1 << 40) // 1 TiB
 
-#define IMAGE_FILE_SIZE 67108864 // Defines expected size for disk image
+#define SUPERBLOCK_MAGIC 0x5346534d // "MFSS" at the start of block 0
+#define SUPERBLOCK_VERSION 4
 
-#define BLOCKS_PER_FILE 1024    
+#define SUPERBLOCK_COMPRESS 0x1 // Files are inserted compressed
+#define SUPERBLOCK_DEDUP 0x2    // Blocks of inserted files are stored once, see struct blockRef
 
-#define NUM_FILES 256 // Max number of files
+#define KDF_ROUNDS 200000 // PBKDF2-HMAC-SHA256 rounds new images derive keys with
 
-#define FIRST_DATA_BLOCK 790
+// Images made before the superblock are exactly 64 MiB of 1 KiB blocks with 256 files. The
+// directory is at block 0, then the free inode map, inodes, free block map and free count.
+#define LEGACY_IMAGE_SIZE 67108864
+#define LEGACY_FREE_INODE_BLOCK 19
+#define LEGACY_INODE_BLOCK 20
+#define LEGACY_FREE_MAP_BLOCK 90
+#define LEGACY_FREE_COUNT_BLOCK 98
+#define LEGACY_METADATA_BLOCKS 99
 
-#define MAX_FILE_SIZE 1048576 // Max file size in bytes
+#define EXTENTS_PER_FILE 32 // Extent slots in an inode
+#define DIRECT_EXTENTS 29   // Slots still holding extents once the last three hold indirect blocks
+#define INDIRECT_LEVELS 3   // Single, double and triple indirect blocks
+#define OUTPUT_BATCH 32     // Extents retrieve hands to one writev
+
+#define TAIL_MAGIC 0x4c494154 // "TAIL", starts every tail block
+
+#define MAX_FILE_SIZE 0x7fffffff // Max file size in bytes, so its blocks fit a uint32_t offset
  
+#define MAX_DIRTY_GAP 4 // Clean blocks savefs will rewrite to join two dirty runs
+
+#define CACHE_FRAME 16 // Blocks the block cache reads in and drops together
+
+#define CACHE_SIZE 16777216 // Bytes of frames an image keeps in memory once it is trimmed
+
+#define CACHE_READAHEAD 64 // Most frames a sequential miss reads ahead
+
+#define METADATA_BLOCKS 99 // Blocks below this hold the directory, inodes and free maps
+
+#define JOURNAL_MAGIC 0x4a53464d // "MFSJ" marks the start of every journal record
+
+#define JOURNAL_OFF 0     // Changes only reach the image on savefs
+#define JOURNAL_ORDERED 1 // Data blocks are written in place before metadata is journaled
+#define JOURNAL_DATA 2    // Data and metadata blocks are both journaled
+
+
 #define HIDDEN 0x1
 
 #define READONLY 0x2
 
+#define ENCRYPTED 0x4 // Blocks are stored encrypted with the session key
+
+#define COMPRESSED 0x8 // Blocks hold the file compressed, see CHUNK_RAW
+
+#define CRYPT_CHUNK_MIN 262144 // Smallest share of a file worth handing to its own thread
+
+#define MAX_CRYPT_THREADS 8
+
+#define INSERT_WINDOW 64 // Sources insert-many opens ahead of the allocator
+
+#define INSERT_READAHEAD 16777216 // Bytes of each source insert-many reads before placing it
+
+#define INSERT_THREADS 8 // Reader and copy threads insert-many runs of each kind
+
+#define ITEM_PENDING 0 // insert-many source not opened yet
+#define ITEM_OPENED 1  // insert-many source open and ready to be placed
+#define ITEM_FAILED 2  // insert-many source could not be opened
+#define ITEM_UNREAD 3  // insert-many source placed but could not be read into its blocks
+
+#define READ_CHUNK 65536 // Bytes read decrypts and formats at a time
+
+#define INFLATE_CACHE 16 // Decompressed blocks an image keeps for reads of part of a block
+
+#define DEDUP_PROBES 16 // Index slots insert looks at for a block before storing it anyway
+
+#define INODE_LOCKS 256 // Locks the inodes of an image are spread over
+
+#define SHELL_IMAGES 16 // Images the shell can have open at once
+
+#define MAX_EXPORT_FDS 16 // Output files export keeps open at once, one per worker
+
+
+// EXTENT
+// A run of length blocks starting at block start
+struct extent
+{
+    int32_t start;
+    int32_t length;
+};
 
 // INODE
 struct inode
 {
-    int32_t blocks[BLOCKS_PER_FILE];
+    struct extent extents[EXTENTS_PER_FILE];
+    int32_t num_extents; // extents in use, the next one is appended here
+    int32_t num_blocks;  // blocks held by all the extents together
     short in_use;
     uint8_t attribute; // holds hidden and read-only attributes
     uint32_t file_size;
+    uint32_t generation; // random per insert so no two files share a keystream
+    uint32_t key_check;  // the key_check of the image's key the file was encrypted with
+};
+
+// PACKED FILE
+// A file of up to pack_size bytes has no blocks. If it fits in the inode's extent slots its
+// bytes are kept there, otherwise they are packed into a tail block shared with other small
+// files and the slots hold a tailRef to them.
+#define INLINE_SIZE (EXTENTS_PER_FILE * sizeof(struct extent))
+
+struct tailRef
+{
+    int32_t block;
+    uint32_t offset;     // of the bytes in the block
+    uint32_t generation; // of the tail block when they were packed into it
+};
+
+// Starts every tail block, followed by the packed files one after another
+struct tailHeader
+{
+    uint32_t magic;
+    uint32_t generation; // new every time the block becomes a tail block
+    uint32_t live;       // files packed in it, the block is freed along with the last one
+    uint32_t used;       // bytes taken, the header included, new files go after them
+};
+
+// EXTENT PATH
+// Where a walk over the extents of a file last looked, so going on to the next extent doesn't
+// go down through the indirect blocks again. Zeroed before the walk starts.
+struct extentPath
+{
+    int32_t first; // index of the first extent at extents
+    int32_t count; // extents there, 0 when nothing has been looked up yet
+    struct extent *extents;
 };
 
 // DIRECTORY
@@ -56,26 +192,412 @@ struct directoryEntry
     int32_t inode; // holds index for first inode
 };
 
-int32_t findFreeBlock();
-int32_t findFreeInode();
-int32_t findFreeInodeBlock(int32_t inode);
-void init();
-uint32_t df();
-void createFS(char *filename);
-void savefs();
-void openfs(char *filename);
-void closefs();
-void insert(char *filename);
+// DEDUP
+// An image that dedups starts its tables at dedup_block with dedup_clock and the clock when
+// the file in each inode was deleted. A blockRef for every block follows, then the index, an
+// open addressed hash of block contents with a dedupEntry slot for every block.
+struct blockRef
+{
+    uint32_t refs;    // files holding the block, 0 while it is free
+    uint32_t claimed; // dedup_clock when it was claimed, new every time it is
+};
+
+struct dedupEntry
+{
+    uint32_t check;   // top half of the hash of the block, the bottom half picks the slot
+    int32_t block;    // 0 for an empty slot, since block 0 is the superblock
+    uint32_t claimed; // of the block when it went in, the entry is stale once that changes
+};
+
+// SUPERBLOCK
+// The geometry of an image and where its metadata lives, at the start of block 0. Block
+// numbers count from the start of the image. Metadata ends at first_data_block.
+struct superblock
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t num_files;
+    uint32_t directory_block;
+    uint32_t free_inode_block;
+    uint32_t inode_block;
+    uint32_t free_map_block;
+    uint32_t free_count_block;
+    uint32_t first_data_block;
+    uint32_t pack_size; // files up to this many bytes are packed, 0 for none
+    uint32_t flags;     // SUPERBLOCK_ flags, there was no room for them before version 3
+    uint32_t dedup_block; // where the dedup tables start, 0 when the image doesn't dedup
+    uint32_t kdf_rounds;  // PBKDF2 rounds keys for the image are derived with
+    uint8_t salt[16];     // random per image, all zeros before version 4
+    uint64_t checksum;  // of everything before it
+};
+
+// COMPRESSED FILE
+// The blocks of a compressed file hold a map of one uint32_t for each block of its contents,
+// followed by those blocks one after another, compressed with lz_compress. Entry i of the map
+// is where block i ends, counted from the end of the map, with CHUNK_RAW set if the block is
+// stored as it is because it didn't shrink. Encryption covers the map and blocks together.
+#define CHUNK_RAW 0x80000000
+
+// A block of a compressed file kept decompressed, inode is -1 while the slot is empty
+struct inflatedBlock
+{
+    int32_t inode;
+    int32_t block;
+    uint8_t *data;
+};
+
+// JOURNAL RECORD
+// Followed by count block numbers and then count blocks of contents. checksum covers
+// both so a record torn by a crash is recognized and dropped on replay.
+struct journalHeader
+{
+    uint32_t magic;
+    uint32_t count;
+    uint64_t sequence;
+    uint64_t checksum;
+};
+
+// OPEN FILE
+// A file opened through the library, flags is 0 for a free handle
+struct openFile
+{
+    int32_t entry;
+    int32_t inode;
+    int flags;
+    int written; // changed since it was opened, so closing it commits the journal
+    uint64_t cursor; // the last extent a read or write reached, above the offset it starts at
+};
+
+// FILESYSTEM
+// Everything about one open image, handed out by the library as an mfs_t. Any number of
+// them can be open at once.
+struct mfs
+{
+    // image_buffer is address space for the whole image, filled in a frame at a time by the
+    // block cache. When an image is opened in mmap mode data points straight into a
+    // MAP_SHARED mapping of the file instead and the kernel does the caching.
+    uint8_t *image_buffer;
+    uint8_t *data;
+    uint64_t *free_blocks; // one bit per block, a set bit means the block is free
+    uint32_t *free_block_count;
+    int32_t free_block_hint; // findFreeRun resumes its search here
+    int32_t tail_block; // the tail block small files are packed into next, -1 for a new one
+    uint8_t *free_inodes; // one byte per inode
+    struct directoryEntry *directory;
+    struct inode *inodes;
+
+    // The geometry, from the superblock or the legacy layout. Everything sized by it below is
+    // allocated by set_geometry when the image is opened.
+    struct superblock geometry;
+    int legacy; // laid out from before the superblock, which isn't written back
+    int32_t block_size;
+    int32_t num_blocks;
+    int32_t num_files;
+    int32_t first_data_block;
+    uint32_t pack_size; // files up to this size are packed, 0 when the image doesn't pack
+    uint8_t compress;   // insert compresses files
+    uint8_t dedup;      // insert shares blocks, see struct blockRef
+    uint32_t cipher_key[8]; // derived from cipher_passphrase and the image's salt
+    uint32_t key_check;     // of cipher_key, the start of a MAC over the salt under it
+    int32_t num_frames;
+    int32_t cache_frames; // frames cache_trim keeps
+    off_t image_size;
+
+    // One bit per block, set when the in-memory copy of the block differs from the image file
+    uint64_t *dirty_blocks;
+
+    // One bit per block, set when the block changed since the last journal commit
+    uint64_t *journal_blocks;
+
+    // One bit per block, set when an indirect block changed since the last journal commit.
+    // They are journaled with the metadata rather than written ahead of it like file data.
+    uint64_t *tree_blocks;
+    size_t bitmap_words;
+
+    // Open addressed hash of filename to directory entry, -1 marks an empty slot. Holds every
+    // entry with a name, deleted ones included, so undelete can find them too. It has twice
+    // as many slots as there are files.
+    int32_t *dir_index;
+    uint32_t dir_index_size;
+
+    FILE *fp;
+    char image_name[64];
+    uint8_t image_open;
+    uint8_t image_mapped;
+    uint8_t read_only; // the file couldn't be opened for writing, so nothing may change
+
+    // Block cache. A frame is read in by cache_blocks the first time one of its blocks is
+    // used and dropped again by cache_trim, which runs the CLOCK algorithm over frame_used.
+    uint8_t *frame_loaded;
+    uint8_t *frame_used; // used since the clock hand last passed
+    int32_t frames_loaded;
+    int32_t clock_hand;
+    int32_t readahead_next;   // the frame after the last miss, a miss there is sequential
+    int32_t readahead_window; // frames the last miss read past what was asked for
+    pthread_mutex_t cache_lock;
+
+    // Blocks of compressed files that were read in part, so reading the rest of them doesn't
+    // decompress them again. Slots are reused in turn from inflate_next.
+    struct inflatedBlock inflated[INFLATE_CACHE];
+    uint8_t *inflated_data;
+    int32_t inflate_next;
+    pthread_mutex_t inflate_lock;
+
+    // The dedup tables, in the metadata when the image dedups and NULL otherwise. All of them
+    // are covered by alloc_lock.
+    uint32_t *dedup_clock; // counts the blocks ever claimed
+    uint32_t *deleted_at;  // dedup_clock when the file in each inode was deleted
+    struct blockRef *block_refs;
+    struct dedupEntry *dedup_index;
+    uint32_t dedup_slots;
+
+    // The journal is a sidecar file next to the image, <image>.jnl
+    int journal_fd;
+    uint64_t journal_sequence;
+    int32_t journal_recovered; // records openfs replayed
+
+    uint8_t savefs_pending; // a batch asked for savefs, done when the image is closed
+
+    struct openFile files[MFS_MAX_HANDLES];
+
+    // Library calls hold image_lock shared while they work, savefs, journal commits and
+    // closing hold it exclusively. Under it dir_lock covers the directory, its index and the
+    // free inode map, inode_lock(fs, i) inode i and its blocks, alloc_lock the free block
+    // map and handle_lock the files table. They are always taken in that order. Inodes share
+    // INODE_LOCKS locks, and no call holds more than one of them.
+    pthread_rwlock_t image_lock;
+    pthread_rwlock_t dir_lock;
+    pthread_rwlock_t inode_locks[INODE_LOCKS];
+    pthread_mutex_t alloc_lock;
+    pthread_mutex_t handle_lock;
+};
+
+// Settings shared by every image, defined in mfs.c
+extern char *cipher_passphrase;
+extern uint8_t cipher_key_set;
+extern uint8_t journal_mode;
+extern uint8_t command_failed;
+extern uint8_t defer_savefs;
+
+void report_error(const char *format, ...);
+void mark_dirty(struct mfs *fs, int32_t block);
+void mark_dirty_range(struct mfs *fs, void *ptr, size_t len);
+void clear_block_dirty(struct mfs *fs, int32_t block);
+void mark_all_dirty(struct mfs *fs);
+void clear_dirty(struct mfs *fs);
+int32_t next_dirty_run(struct mfs *fs, uint64_t *bitmap, int32_t *start);
+int write_blocks(struct mfs *fs, int32_t start, int32_t len);
+int cache_read(struct mfs *fs, int32_t first, int32_t last);
+uint8_t *block_data(struct mfs *fs, int32_t block);
+uint8_t *cache_blocks(struct mfs *fs, int32_t start, int32_t len);
+void cache_trim(struct mfs *fs);
+uint64_t checksum(uint8_t *buf, size_t len);
+void journal_open(struct mfs *fs);
+void journal_close(struct mfs *fs);
+int32_t journal_replay(struct mfs *fs);
+void journal_commit(struct mfs *fs);
+void journal_reset(struct mfs *fs);
+int32_t next_free_block(struct mfs *fs, int32_t block);
+int32_t free_run_length(struct mfs *fs, int32_t block, int32_t max);
+int32_t findFreeRun(struct mfs *fs, int32_t want, int32_t *length);
+int32_t findFreeInode(struct mfs *fs);
+void set_free_block(struct mfs *fs, int32_t block, uint8_t value);
+void set_free_run(struct mfs *fs, int32_t start, int32_t length, uint8_t value);
+int32_t claim_run(struct mfs *fs, int32_t want, int32_t *length);
+void set_free_inode(struct mfs *fs, int32_t index, uint8_t value);
+int append_extent(struct mfs *fs, struct inode *file_inode, int32_t start, int32_t length);
+struct extent *file_extent(struct mfs *fs, struct inode *file_inode, int32_t index,
+                           struct extentPath *path);
+int visit_file_blocks(struct mfs *fs, struct inode *file_inode,
+                      int (*visit)(struct mfs *fs, int32_t start, int32_t length, void *arg),
+                      void *arg);
+void free_file_blocks(struct mfs *fs, struct inode *file_inode, uint8_t value);
+void free_tree_blocks(struct mfs *fs, struct inode *file_inode);
+void truncate_extents(struct mfs *fs, struct inode *file_inode, int32_t keep);
+int is_packed(struct inode *file_inode);
+uint8_t *packed_data(struct mfs *fs, struct inode *file_inode);
+void mark_packed_dirty(struct mfs *fs, struct inode *file_inode);
+int pack_reserve(struct mfs *fs, struct inode *file_inode, uint32_t size);
+void tail_release(struct mfs *fs, struct tailRef *ref, uint8_t value);
+int tail_intact(struct mfs *fs, struct inode *file_inode);
+int copy_stored(struct mfs *fs, struct inode *file_inode, uint32_t offset, uint8_t *buf,
+                uint32_t len, int write, uint64_t *cursor);
+int put_stored(struct mfs *fs, int32_t inode_index, struct inode *file_inode, uint32_t offset,
+               uint8_t *buf, uint32_t len, uint64_t *cursor);
+uint8_t *stored_bytes(struct mfs *fs, int32_t inode_index, struct inode *file_inode,
+                      uint32_t offset, uint32_t len, uint8_t *buf, uint64_t *cursor);
+int inflate_block(struct mfs *fs, int32_t inode_index, struct inode *file_inode, int32_t block,
+                  uint8_t *out, uint8_t *scratch, uint64_t *cursor);
+void forget_inflated(struct mfs *fs, int32_t inode_index);
+int read_compressed(struct mfs *fs, int32_t inode_index, uint8_t *buf, uint32_t offset,
+                    uint32_t len, uint64_t *cursor);
+int compress_file(struct mfs *fs, int32_t inode_index, int fd);
+int inflate_file(struct mfs *fs, int32_t inode_index);
+uint64_t block_hash(const uint8_t *data, size_t len);
+int list_blocks(struct mfs *fs, struct inode *file_inode, int32_t *blocks);
+int remap_file(struct mfs *fs, struct inode *file_inode, int32_t *blocks);
+int entry_current(struct mfs *fs, struct dedupEntry *entry);
+int32_t share_block(struct mfs *fs, int32_t own, uint8_t *data, uint64_t hash);
+void dedup_file(struct mfs *fs, int32_t inode_index);
+int unshare_blocks(struct mfs *fs, int32_t inode_index, int32_t first, int32_t last);
+void stamp_deleted(struct mfs *fs, int32_t inode_index);
+uint32_t name_hash(char *filename);
+void dir_index_add(struct mfs *fs, int32_t entry);
+void dir_index_remove(struct mfs *fs, int32_t entry);
+void dir_index_build(struct mfs *fs);
+int recoverable(struct mfs *fs, int32_t entry);
+int32_t lookup(struct mfs *fs, char *filename, int deleted);
+int set_geometry(struct mfs *fs, struct superblock *geometry);
+void free_geometry(struct mfs *fs);
+int check_geometry(struct superblock *geometry);
+int check_legacy(struct mfs *fs);
+void plan_geometry(struct superblock *geometry, uint32_t block_size, uint32_t num_blocks,
+                   uint32_t num_files, uint32_t pack_size, uint32_t flags);
+uint32_t dedup_layout(struct superblock *geometry, uint32_t *ref_block, uint32_t *index_block);
+void set_layout(struct mfs *fs);
+void init(struct mfs *fs);
+uint64_t df(struct mfs *fs);
+void df_used(struct mfs *fs, uint64_t *logical, uint64_t *physical);
+int createfs(struct mfs *fs, char *filename, int use_mmap, struct superblock *geometry);
+int savefs(struct mfs *fs);
+int openfs(struct mfs *fs, char *filename, int use_mmap);
+int closefs(struct mfs *fs);
+// ENCRYPTION JOB
+// One thread's share of a range being encrypted or decrypted
+struct cryptJob
+{
+    uint32_t *key;
+    uint32_t nonce[3];
+    uint32_t counter;
+    uint8_t *buf;
+    size_t len;
+};
+
+// INSERT ITEM
+// One host file going through insert-many
+struct insertItem
+{
+    char *path;
+    int fd;
+    off_t size;
+    int state;
+    int32_t inode;
+};
+
+// INSERT PIPELINE
+// Shared by the stages of insert-many and guarded by lock. Readers claim items through
+// next_open, the allocator has placed every item before consumed, and copy threads claim
+// the reserved items in copy_queue through next_copy. An item's inode is an MFS_E code if it
+// couldn't be placed.
+struct insertPipeline
+{
+    struct mfs *fs;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct insertItem *items;
+    int32_t count;
+    int32_t next_open;
+    int32_t consumed;
+    int32_t *copy_queue;
+    int32_t queued;
+    int32_t next_copy;
+    int allocated;
+    uint64_t bytes;
+    int32_t files;
+    int32_t failed;
+};
+
+// EXPORT JOB
+// Shared by the export workers, which claim entries through next
+struct exportJob
+{
+    struct mfs *fs;
+    char *hostdir;
+    int32_t *entries;
+    int32_t count;
+    int32_t next;
+    uint64_t bytes;
+    int32_t files;
+    int32_t failed;
+};
+
+int set_passphrase(const char *passphrase);
+void derive_key(struct mfs *fs);
+int key_matches(struct mfs *fs, int32_t inode_index);
+int new_generation(struct mfs *fs, int32_t inode_index);
+void *crypt_worker(void *arg);
+void crypt_range(struct mfs *fs, int32_t inode_index, uint32_t offset, uint8_t *buf, size_t len);
+int ingest_extent(struct mfs *fs, int32_t inode_index, int fd, off_t offset, int32_t start,
+                  size_t bytes);
+int32_t reserve_file(struct mfs *fs, char *filename, off_t size);
+int fill_file(struct mfs *fs, int32_t inode_index, int fd);
+void release_file(struct mfs *fs, int32_t inode_index);
+void insert(struct mfs *fs, char *filename);
+int insert_open(struct insertItem *item);
+void *insert_reader(void *arg);
+void *insert_copier(void *arg);
+void insert_many(struct mfs *fs, char **paths, int32_t count);
+void insert_many_command(struct mfs *fs, char *option, char *argument);
+void encrypt_block_scalar(uint8_t *str, char key, uint32_t len);
+void encrypt_block_word(uint8_t *str, char key, uint32_t len);
+#if defined(__x86_64__) || defined(__i386__)
+void encrypt_block_sse2(uint8_t *str, char key, uint32_t len);
+void encrypt_block_avx2(uint8_t *str, char key, uint32_t len);
+void encrypt_block_avx512(uint8_t *str, char key, uint32_t len);
+#endif
+int xor_self_check(void (*kernel)(uint8_t *, char, uint32_t));
+void select_xor_kernel();
 void encrypt_block(uint8_t *str, char key, uint32_t len);
-void encrypt(char *filename, char cypher);
-void retrieve(char *FName, char *NFName);
-void delete(char *filename);
-void undelete(char *filename);
-void read_file(char *filename, int start, int len);
-void attrib(char *typeAttrib, char *filename);
+void encrypt(struct mfs *fs, char *filename, char cypher);
+int blocks_dirty(struct mfs *fs, int32_t start, int32_t len);
+int output_encrypted_file(struct mfs *fs, struct inode *file_inode, int out_fd);
+int output_compressed_file(struct mfs *fs, struct inode *file_inode, int out_fd);
+int output_extents(struct mfs *fs, struct iovec *iov, int count, int on_disk, int out_fd);
+int output_file(struct mfs *fs, struct inode *file_inode, int out_fd);
+void retrieve(struct mfs *fs, char *FName, char *NFName);
+void *export_worker(void *arg);
+void export_files(struct mfs *fs, char *hostdir, char *pattern);
+void undelete(struct mfs *fs, char *filename);
+void attrib(struct mfs *fs, char *typeAttrib, char *filename);
 void print_bin(uint8_t value);
-void list(char *token, char * token2);
+void list(struct mfs *fs, char *token, char * token2);
+
+
+void library_init();
+struct mfs *new_context();
+void free_context(struct mfs *fs);
+pthread_rwlock_t *inode_lock(struct mfs *fs, int32_t inode_index);
+struct openFile *handle_file(mfs_t *fs, int handle, int access);
+void reset_cursors(struct mfs *fs, int32_t inode_index);
+int truncate_file(struct mfs *fs, int32_t inode_index);
+int rekey_file(struct mfs *fs, int32_t inode_index);
+int pack_file(struct mfs *fs, int32_t inode_index);
+int unpack_file(struct mfs *fs, int32_t inode_index);
+int grow_file(struct mfs *fs, int32_t inode_index, int32_t need);
+int copy_range(struct mfs *fs, int32_t inode_index, uint8_t *buf, uint32_t offset, uint32_t len,
+               int write, uint64_t *cursor);
+int zero_range(struct mfs *fs, int32_t inode_index, uint32_t offset, uint32_t end,
+               uint64_t *cursor);
+
+mfs_t *shell_find(char *filename);
+void shell_open(char *filename, int flags, int create, struct mfs_geometry *geometry);
+void shell_close(mfs_t *fs);
+void shell_close_all();
+int shell_key(const char *passphrase);
+void use_image(char *filename);
+void list_images();
+void copy_file(char *filename, char *image, char *newname);
+void delete(char *filename);
+void build_hex_table();
+size_t format_hex(uint8_t *bytes, size_t len, char *text);
+void read_file(char *filename, int start, int len, int raw, char *outfile);
 void free_tokens(char *token[], int token_count);
+int run_command(char *command_string);
+int run_batch(FILE *script, char *commands, int stop_on_error);
+
+int serve(char *socket_path, char *images[], int count);
 
 
 #endif
\ No newline at end of file
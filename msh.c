@@ -0,0 +1,1015 @@
+#include "mfs.h"
+
+// SHELL
+// The mfs command line, a client of the library in libmfs.c like any other program
+
+// Every image the shell has open, and the one commands work on, NULL when there is none
+mfs_t *shell_images[SHELL_IMAGES];
+mfs_t *shell_fs = NULL;
+
+// The open image the shell knows by filename, NULL if it has none
+mfs_t *shell_find(char *filename)
+{
+  int i;
+  for (i = 0; i < SHELL_IMAGES; i++)
+  {
+    if (shell_images[i] != NULL && strncmp(shell_images[i]->image_name, filename, 63) == 0)
+    {
+      return shell_images[i];
+    }
+  }
+  return NULL;
+}
+
+// Create or open an image and make it the one commands work on. The images already open
+// stay open, except one opened from the same file. geometry sizes a created image.
+void shell_open(char *filename, int flags, int create, struct mfs_geometry *geometry)
+{
+  mfs_t *fs = shell_find(filename);
+  if (fs != NULL)
+  {
+    shell_close(fs);
+  }
+
+  int slot;
+  for (slot = 0; slot < SHELL_IMAGES; slot++)
+  {
+    if (shell_images[slot] == NULL)
+    {
+      break;
+    }
+  }
+  if (slot == SHELL_IMAGES)
+  {
+    report_error("OPEN ERROR: No more than %d images can be open.\n", SHELL_IMAGES);
+    return;
+  }
+
+  int ret;
+  if (create)
+  {
+    ret = mfs_create_geometry(filename, flags, geometry, &fs);
+    if (ret != MFS_OK)
+    {
+      report_error("CREATEFS ERROR: %s: %s.\n", filename, mfs_strerror(ret));
+      return;
+    }
+  }
+  else
+  {
+    ret = mfs_mount(filename, flags, &fs);
+    if (ret != MFS_OK)
+    {
+      report_error("OPEN ERROR: %s: %s.\n", filename, mfs_strerror(ret));
+      return;
+    }
+    if (fs->journal_recovered > 0)
+    {
+      printf("Recovered %d journal records.\n", fs->journal_recovered);
+    }
+  }
+
+  shell_images[slot] = fs;
+  shell_fs = fs;
+}
+
+// Close one of the shell's images. Closing the current one leaves no image current.
+void shell_close(mfs_t *fs)
+{
+  int i;
+  for (i = 0; i < SHELL_IMAGES; i++)
+  {
+    if (shell_images[i] == fs)
+    {
+      shell_images[i] = NULL;
+    }
+  }
+  if (shell_fs == fs)
+  {
+    shell_fs = NULL;
+  }
+
+  int ret = mfs_unmount(fs);
+  if (ret != MFS_OK)
+  {
+    report_error("CLOSE ERROR: %s.\n", mfs_strerror(ret));
+  }
+}
+
+void shell_close_all()
+{
+  int i;
+  for (i = 0; i < SHELL_IMAGES; i++)
+  {
+    if (shell_images[i] != NULL)
+    {
+      shell_close(shell_images[i]);
+    }
+  }
+}
+
+// Take on a passphrase, or drop it if NULL, and derive every open image's key from it.
+// Returns 0 or -1 if out of memory.
+int shell_key(const char *passphrase)
+{
+  int i;
+  if (set_passphrase(passphrase) == -1)
+  {
+    return -1;
+  }
+  for (i = 0; i < SHELL_IMAGES; i++)
+  {
+    if (shell_images[i] != NULL)
+    {
+      derive_key(shell_images[i]);
+    }
+  }
+  return 0;
+}
+
+// Make another open image the one commands work on
+void use_image(char *filename)
+{
+  mfs_t *fs = shell_find(filename);
+  if (fs == NULL)
+  {
+    report_error("USE ERROR: %s is not open.\n", filename);
+    return;
+  }
+  shell_fs = fs;
+}
+
+// List the open images, the one commands work on marked with *
+void list_images()
+{
+  int i;
+  for (i = 0; i < SHELL_IMAGES; i++)
+  {
+    if (shell_images[i] != NULL)
+    {
+      printf("%c %s\n", shell_images[i] == shell_fs ? '*' : ' ', shell_images[i]->image_name);
+    }
+  }
+}
+
+// Copy a file from the current image into another open image, under newname if given
+void copy_file(char *filename, char *image, char *newname)
+{
+  mfs_t *target = shell_find(image);
+  if (target == NULL)
+  {
+    report_error("COPY ERROR: %s is not open.\n", image);
+    return;
+  }
+  if (newname == NULL)
+  {
+    newname = filename;
+  }
+
+  int in = mfs_open(shell_fs, filename, MFS_READ);
+  if (in < 0)
+  {
+    report_error("COPY ERROR: %s: %s.\n", filename, mfs_strerror(in));
+    return;
+  }
+  int out = mfs_open(target, newname, MFS_WRITE | MFS_CREATE | MFS_TRUNCATE);
+  if (out < 0)
+  {
+    report_error("COPY ERROR: %s: %s.\n", newname, mfs_strerror(out));
+    mfs_close(shell_fs, in);
+    return;
+  }
+
+  uint8_t *chunk = malloc(READ_CHUNK);
+  uint32_t offset = 0;
+  ssize_t got = 0;
+  while (chunk != NULL && (got = mfs_pread(shell_fs, in, chunk, READ_CHUNK, offset)) > 0)
+  {
+    ssize_t put = mfs_pwrite(target, out, chunk, got, offset);
+    if (put < 0)
+    {
+      got = put;
+      break;
+    }
+    offset += got;
+  }
+  if (chunk == NULL)
+  {
+    got = MFS_ENOMEM;
+  }
+  if (got < 0)
+  {
+    report_error("COPY ERROR: %s.\n", mfs_strerror(got));
+  }
+
+  free(chunk);
+  mfs_close(shell_fs, in);
+  mfs_close(target, out);
+}
+
+void delete(char *filename)
+{
+  int ret = mfs_unlink(shell_fs, filename);
+  if (ret != MFS_OK)
+  {
+    report_error("DELETE ERROR: %s.\n", mfs_strerror(ret));
+  }
+}
+
+// Text the hex dump prints for each byte value, "%x " as read always has
+char hex_text[256][4];
+uint8_t hex_length[256];
+
+void build_hex_table()
+{
+  static const char digits[] = "0123456789abcdef";
+  int value;
+
+  for (value = 0; value < 256; value++)
+  {
+    int length = 0;
+    if (value >= 16)
+    {
+      hex_text[value][length++] = digits[value >> 4];
+    }
+    hex_text[value][length++] = digits[value & 0xf];
+    hex_text[value][length++] = ' ';
+    hex_length[value] = length;
+  }
+}
+
+// Format len bytes as hex text into text, which holds at least 3 * len. Returns its length.
+size_t format_hex(uint8_t *bytes, size_t len, char *text)
+{
+  char *out = text;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    // always copy all four bytes, the length moves past only the ones that count
+    memcpy(out, hex_text[bytes[i]], 4);
+    out += hex_length[bytes[i]];
+  }
+  return out - text;
+}
+
+// Print part of a file as hex, or with raw write the bytes themselves to outfile or, when
+// no outfile is named, to stdout. The file is read READ_CHUNK bytes at a time and each
+// chunk is formatted through the table into one buffer written in a single fwrite.
+void read_file(char *filename, int start, int len, int raw, char *outfile)
+{
+  if (start < 0 || len < 0)
+  {
+    report_error("READ ERROR: Invalid byte range\n");
+    return;
+  }
+
+  int handle = mfs_open(shell_fs, filename, MFS_READ);
+  if (handle < 0)
+  {
+    report_error("READ ERROR: %s.\n", mfs_strerror(handle));
+    return;
+  }
+
+  uint8_t *chunk = malloc(READ_CHUNK);
+  char *text = raw ? NULL : malloc(READ_CHUNK * 3 + 1);
+  if (chunk == NULL || (!raw && text == NULL))
+  {
+    report_error("READ ERROR: %s.\n", mfs_strerror(MFS_ENOMEM));
+    free(chunk);
+    mfs_close(shell_fs, handle);
+    return;
+  }
+  if (!raw && hex_length[0] == 0)
+  {
+    build_hex_table();
+  }
+
+  FILE *out = stdout;
+  if (outfile != NULL)
+  {
+    out = fopen(outfile, "w");
+    if (out == NULL)
+    {
+      report_error("READ ERROR: Can not open %s\n", outfile);
+      free(chunk);
+      mfs_close(shell_fs, handle);
+      return;
+    }
+  }
+
+  uint32_t offset = start;
+  uint32_t end = (uint32_t)start + len;
+  while (offset < end)
+  {
+    size_t want = (end - offset < READ_CHUNK) ? end - offset : READ_CHUNK;
+    ssize_t got = mfs_pread(shell_fs, handle, chunk, want, offset);
+    if (got <= 0)
+    {
+      break;
+    }
+
+    size_t bytes = got;
+    char *bytes_out = (char *)chunk;
+    if (!raw)
+    {
+      bytes = format_hex(chunk, got, text);
+      bytes_out = text;
+    }
+    if (fwrite(bytes_out, 1, bytes, out) != bytes)
+    {
+      report_error("READ ERROR: Could not write the bytes read\n");
+      break;
+    }
+    offset += got;
+  }
+  if (!raw)
+  {
+    fputc('\n', out);
+  }
+
+  if (out == stdout)
+  {
+    fflush(stdout);
+  }
+  else
+  {
+    fclose(out);
+  }
+  free(chunk);
+  free(text);
+  mfs_close(shell_fs, handle);
+}
+
+void free_tokens(char *token[], int token_count)
+{
+  int i;
+  for (i = 0; i < token_count; i++)
+  {
+    if (token[i] != NULL)
+    {
+      free(token[i]);
+      token[i] = NULL;
+    }
+  }
+}
+
+// Parse and run a single command line. Returns 1 if the command was quit.
+int run_command(char *command_string)
+{
+  /* Parse input */
+  char **token = calloc(MAX_NUM_ARGUMENTS, sizeof(char *));
+
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
+  {
+    token[i] = NULL;
+  }
+
+  int token_count = 0;
+
+  // Pointer to point to the token
+  // parsed by strsep
+  char *argument_ptr = NULL;
+
+  char *working_string = strdup(command_string);
+
+  // we are going to move the working_string pointer so
+  // keep track of its original value so we can deallocate
+  // the correct amount at the end
+  char *head_ptr = working_string;
+
+  // Tokenize the input strings with whitespace used as the delimiter
+  while (((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
+         (token_count < MAX_NUM_ARGUMENTS))
+  {
+    token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
+    if (strlen(token[token_count]) == 0)
+    {
+      free(token[token_count]);
+      token[token_count] = NULL;
+    }
+    token_count++;
+  }
+
+  // Checks for blank input before proceding to prevent segmentation faults
+  if (token[0] == NULL);
+  // QUIT
+  else if (!strcmp(token[0], "quit"))
+  {
+    free_tokens(token, token_count);
+    free(token);
+    free(head_ptr);
+    return 1;
+  }
+  // CREATEFS
+  else if (strcmp("createfs", token[0]) == 0)
+  {
+    // createfs [-m] [-z] [-d] <filename> [-b block size] [-n blocks] [-f files] [-t pack size],
+    // where -m keeps the image mapped, -z compresses inserted files, -d stores their blocks
+    // once, -t 0 turns packing off and the sizes left out take their defaults
+    struct mfs_geometry geometry = {0, 0, 0, 0, 0};
+    char *filename = NULL;
+    int flags = 0;
+    int valid = 1;
+    int i;
+    for (i = 1; i < token_count && token[i] != NULL && valid; i++)
+    {
+      if (strcmp("-m", token[i]) == 0)
+      {
+        flags |= MFS_MAP;
+      }
+      else if (strcmp("-z", token[i]) == 0)
+      {
+        geometry.flags |= MFS_COMPRESS;
+      }
+      else if (strcmp("-d", token[i]) == 0)
+      {
+        geometry.flags |= MFS_DEDUP;
+      }
+      else if (strcmp("-b", token[i]) == 0 || strcmp("-n", token[i]) == 0 ||
+               strcmp("-f", token[i]) == 0 || strcmp("-t", token[i]) == 0)
+      {
+        char *end = NULL;
+        unsigned long value = 0;
+        if (i + 1 < token_count && token[i + 1] != NULL)
+        {
+          value = strtoul(token[i + 1], &end, 0);
+        }
+        int zero_ok = (token[i][1] == 't');
+        if (end == NULL || *end != '\0' || (value == 0 && !zero_ok) || value >= UINT32_MAX)
+        {
+          report_error("CREATEFS: %s needs a positive number.\n", token[i]);
+          valid = 0;
+          break;
+        }
+        if (token[i][1] == 't')
+        {
+          geometry.pack_size = (value == 0) ? MFS_NO_PACKING : value;
+        }
+        else if (token[i][1] == 'b')
+        {
+          geometry.block_size = value;
+        }
+        else if (token[i][1] == 'n')
+        {
+          geometry.num_blocks = value;
+        }
+        else
+        {
+          geometry.num_files = value;
+        }
+        i++;
+      }
+      else if (filename == NULL)
+      {
+        filename = token[i];
+      }
+    }
+    if (!valid);
+    else if (filename == NULL)
+    {
+      report_error("CREATEFS: Filename not provided.\n");
+    }
+    else
+    {
+      shell_open(filename, flags, 1, &geometry);
+    }
+  }
+  // SAVEFS
+  else if (strcmp("savefs", token[0]) == 0)
+  {
+    if (defer_savefs && shell_fs != NULL)
+    {
+      shell_fs->savefs_pending = 1;
+    }
+    else
+    {
+      int ret = mfs_sync(shell_fs);
+      if (ret != MFS_OK)
+      {
+        report_error("SAVEFS ERROR: %s.\n", mfs_strerror(ret));
+      }
+    }
+  }
+  // CLOSE
+  else if (strcmp("close", token[0]) == 0)
+  {
+    // close [image] closes the named image, or the current one
+    mfs_t *fs = (token[1] != NULL) ? shell_find(token[1]) : shell_fs;
+    if (fs == NULL)
+    {
+      report_error("CLOSE ERROR: %s.\n", mfs_strerror(MFS_ENOTOPEN));
+    }
+    else
+    {
+      shell_close(fs);
+    }
+  }
+  // USE
+  else if (strcmp("use", token[0]) == 0)
+  {
+    if (token[1] == NULL)
+    {
+      report_error("USE ERROR: There is no filename specified.\n");
+    }
+    else
+    {
+      use_image(token[1]);
+    }
+  }
+  // IMAGES
+  else if (strcmp("images", token[0]) == 0)
+  {
+    list_images();
+  }
+  // COPY
+  else if (strcmp("copy", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (token[1] == NULL || token[2] == NULL)
+    {
+      report_error("COPY ERROR: Usage is copy <filename> <image> [newfilename]\n");
+    }
+    else
+    {
+      copy_file(token[1], token[2], token[3]);
+    }
+  }
+  // OPEN
+  else if (strcmp("open", token[0]) == 0)
+  {
+    // open -m <filename> maps the image instead of reading it into memory
+    if (token[1] != NULL && strcmp("-m", token[1]) == 0)
+    {
+      if (token[2] == NULL)
+      {
+        report_error("OPEN ERROR: There is no filename specified.\n");
+      }
+      else
+      {
+        shell_open(token[2], MFS_MAP, 0, NULL);
+      }
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("OPEN ERROR: There is no filename specified.\n");
+    }
+    else
+    {
+      shell_open(token[1], 0, 0, NULL);
+    }
+  }
+  // LIST
+  else if (strcmp("list", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else
+    {
+      list(shell_fs, token[1], token[2]);
+    }
+  }
+  // DF
+  else if (strcmp("df", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else
+    {
+      uint64_t logical;
+      uint64_t physical;
+      df_used(shell_fs, &logical, &physical);
+      printf("%llu bytes free\n", (unsigned long long)df(shell_fs));
+      printf("%llu bytes of files in %llu bytes of blocks\n", (unsigned long long)logical,
+             (unsigned long long)physical);
+    }
+  }
+  // INSERT
+  else if (strcmp("insert", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (shell_fs->read_only)
+    {
+      report_error("INSERT ERROR: %s.\n", mfs_strerror(MFS_EROFS));
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no filename specified\n");
+    }
+    else
+    {
+      //checks filename length
+      if(strlen(token[1]) <= 64)
+      {
+        insert(shell_fs, token[1]);
+      }
+      else
+      {
+        report_error("INSERT ERROR: Filename is too long.\n");
+      }
+    }
+  }
+  // INSERT-MANY
+  else if (strcmp("insert-many", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (shell_fs->read_only)
+    {
+      report_error("INSERT ERROR: %s.\n", mfs_strerror(MFS_EROFS));
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no files specified\n");
+    }
+    else
+    {
+      insert_many_command(shell_fs, token[1], token[2]);
+    }
+  }
+  // ENCRYPT AND DECRYPT
+  else if (strcmp("encrypt", token[0]) == 0 || strcmp("decrypt", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (shell_fs->read_only)
+    {
+      report_error("ERROR: %s.\n", mfs_strerror(MFS_EROFS));
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no filename specified\n");
+    }
+    else if (token[2] == NULL)
+    {
+      report_error("ERROR: no cypher specified\n");
+    }
+    else if (strlen(token[2]) > 1)
+    {
+      report_error("ERROR: cypher is not valid, cypher should include a single 1-byte value only\n");
+    }
+    else
+    {
+      encrypt(shell_fs, token[1], token[2][0]);
+    }
+  }
+  // RETRIEVE
+  else if (strcmp("retrieve", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no filename specified\n");
+    }
+    else
+    {
+      retrieve(shell_fs, token[1], token[2]);
+    }
+  }
+  // EXPORT
+  else if (strcmp("export", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no directory specified\n");
+    }
+    else
+    {
+      export_files(shell_fs, token[1], token[2]);
+    }
+  }
+  // DELETE
+  else if (strcmp("delete", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no filename specified.\n");
+    }
+    else
+    {
+      delete(token[1]);
+    }
+  }
+  // UNDELETE
+  else if (strcmp("undelete", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ERROR: Disk image is not opened.\n");
+    }
+    else if (shell_fs->read_only)
+    {
+      report_error("UNDELETE ERROR: %s.\n", mfs_strerror(MFS_EROFS));
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ERROR: no filename specified.\n");
+    }
+    else
+    {
+      undelete(shell_fs, token[1]);
+    }
+  }
+  // ATTRIB
+  else if (strcmp("attrib", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("ATTRIB ERROR: Disk image is not opened.\n");
+    }
+    else if (shell_fs->read_only)
+    {
+      report_error("ATTRIB ERROR: %s.\n", mfs_strerror(MFS_EROFS));
+    }
+    else if (token[1] == NULL)
+    {
+      report_error("ATTRIB ERROR: attribute not specified.\n");
+    }
+    else if (token[2] == NULL)
+    {
+      report_error("ATTRIB ERROR: no filename specified.\n");
+    }
+    else if (strcmp("+h", token[1]) == 0)
+    {
+      attrib(shell_fs, token[1], token[2]);
+    }
+    else if (strcmp("-h", token[1]) == 0)
+    {
+      attrib(shell_fs, token[1], token[2]);
+    }
+    else if (strcmp("+r", token[1]) == 0)
+    {
+      attrib(shell_fs, token[1], token[2]);
+    }
+    else if (strcmp("-r", token[1]) == 0)
+    {
+      attrib(shell_fs, token[1], token[2]);
+    }
+    else
+    {
+      report_error("Something has gone wrong. Cannot set attribute\n");
+    }
+  }
+  // READ
+  else if (strcmp("read", token[0]) == 0)
+  {
+    if (shell_fs == NULL)
+    {
+      report_error("READ ERROR: Disk image is not opened.\n");
+    }
+    else
+    {
+      // read -b <filename> <start> <len> [outfile] writes the bytes themselves
+      int raw = (token[1] != NULL && strcmp("-b", token[1]) == 0);
+      char **args = token + raw;
+
+      if (args[1] == NULL)
+      {
+        report_error("READ ERROR: Filename not specified\n");
+      }
+      else if (args[2] == NULL)
+      {
+        report_error("READ ERROR: Starting byte not specified\n");
+      }
+      else if (args[3] == NULL)
+      {
+        report_error("READ ERROR: Number of bytes not specified\n");
+      }
+      else
+      {
+        read_file(args[1], atoi(args[2]), atoi(args[3]), raw, raw ? args[4] : NULL);
+      }
+    }
+  }
+  // KEY
+  else if (strcmp("key", token[0]) == 0)
+  {
+    if (token[1] == NULL)
+    {
+      report_error("KEY ERROR: no passphrase specified\n");
+    }
+    else if (strcmp("-d", token[1]) == 0)
+    {
+      shell_key(NULL);
+    }
+    else if (!chacha20_self_check() || !sha256_self_check())
+    {
+      report_error("KEY ERROR: cipher failed its self check\n");
+    }
+    else if (shell_key(token[1]) == -1)
+    {
+      report_error("KEY ERROR: out of memory\n");
+    }
+  }
+  // JOURNAL
+  else if (strcmp("journal", token[0]) == 0)
+  {
+    if (token[1] == NULL)
+    {
+      char *modes[] = {"off", "ordered", "data"};
+      printf("journal: %s\n", modes[journal_mode]);
+    }
+    else if (strcmp("off", token[1]) == 0)
+    {
+      journal_mode = JOURNAL_OFF;
+    }
+    else if (strcmp("ordered", token[1]) == 0)
+    {
+      journal_mode = JOURNAL_ORDERED;
+    }
+    else if (strcmp("data", token[1]) == 0)
+    {
+      journal_mode = JOURNAL_DATA;
+    }
+    else
+    {
+      report_error("JOURNAL ERROR: Mode should be off, ordered or data.\n");
+    }
+  }
+  else // COMMAND NOT FOUND
+  {
+    report_error("ERROR: Command not found.\n");
+  }
+
+  // Every command that changed an image is committed before the next prompt. A batch
+  // commits once at the end instead. Either way the block caches are trimmed back to size.
+  for (int i = 0; i < SHELL_IMAGES; i++)
+  {
+    if (shell_images[i] != NULL)
+    {
+      if (!defer_savefs)
+      {
+        journal_commit(shell_images[i]);
+      }
+      cache_trim(shell_images[i]);
+    }
+  }
+
+  free_tokens(token, token_count);
+  free(token);
+  free(head_ptr);
+  return 0;
+}
+
+// Run every command in a batch, read from script or split out of commands at each ';'.
+// With stop_on_error the batch ends at the first failing command. Returns 1 if any failed.
+int run_batch(FILE *script, char *commands, int stop_on_error)
+{
+  char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
+  char *rest = commands;
+  int failed = 0;
+
+  defer_savefs = 1;
+  while (1)
+  {
+    if (script != NULL)
+    {
+      if (!fgets(command_string, MAX_COMMAND_SIZE, script))
+      {
+        break;
+      }
+    }
+    else
+    {
+      char *next = strsep(&rest, ";\n");
+      if (next == NULL)
+      {
+        break;
+      }
+      strncpy(command_string, next, MAX_COMMAND_SIZE - 1);
+      command_string[MAX_COMMAND_SIZE - 1] = '\0';
+    }
+
+    // Leading blanks would tokenize as an empty command and # starts a comment
+    char *command = command_string + strspn(command_string, WHITESPACE);
+    if (*command == '#')
+    {
+      continue;
+    }
+
+    command_failed = 0;
+    int quit = run_command(command);
+    failed |= command_failed;
+    if (quit || (command_failed && stop_on_error))
+    {
+      break;
+    }
+  }
+
+  // The one save and journal commit of the whole batch
+  shell_close_all();
+  free(command_string);
+  return failed;
+}
+
+// MAIN
+// mfs              interactive, prompting for each command
+// mfs -f <script>  run the commands in script, one per line, - for stdin
+// mfs -c <cmds>    run the commands separated by ';'
+// -e               stop a batch at the first command that fails
+// mfs --serve <socket> <image>...  answer requests for the images on a Unix socket
+int main(int argc, char *argv[])
+{
+  char *script_name = NULL;
+  char *commands = NULL;
+  char *socket_path = NULL;
+  int stop_on_error = 0;
+  int opt;
+
+  struct option long_options[] = {
+    {"serve", required_argument, NULL, 's'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, "f:c:e", long_options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'f':
+        script_name = optarg;
+        break;
+      case 'c':
+        commands = optarg;
+        break;
+      case 'e':
+        stop_on_error = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-e] [-f script | -c commands]\n"
+                        "       %s --serve socket image...\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (socket_path != NULL)
+  {
+    return serve(socket_path, argv + optind, argc - optind) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (script_name != NULL || commands != NULL)
+  {
+    FILE *script = NULL;
+    if (script_name != NULL)
+    {
+      script = (strcmp(script_name, "-") == 0) ? stdin : fopen(script_name, "r");
+      if (script == NULL)
+      {
+        fprintf(stderr, "mfs: Can not open %s.\n", script_name);
+        return EXIT_FAILURE;
+      }
+    }
+    int failed = run_batch(script, commands, stop_on_error);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
+  while (1)
+  {
+    // Print out the msh prompt
+    printf("mfs> ");
+
+    // Read the command from the commandline.  The
+    // maximum command that will be read is MAX_COMMAND_SIZE
+    // This while command will wait here until the user
+    // inputs something since fgets returns NULL when there
+    // is no input
+    while (!fgets(command_string, MAX_COMMAND_SIZE, stdin));
+
+    if (run_command(command_string))
+    {
+      // Cleanup allocatec memory and exit program
+      shell_close_all();
+      free(command_string);
+      exit(EXIT_SUCCESS);
+    }
+  }
+}
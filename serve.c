@@ -0,0 +1,599 @@
+#include "mfs.h"
+#include "serve.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+// SERVER
+// mfs --serve keeps images open and answers the requests in serve.h on a Unix socket, so
+// programs don't each have to load an image of their own. One thread runs an epoll loop over
+// every connection. All the complete requests a read brings in are answered together, the
+// images they changed are committed to the journal once, and then the replies are sent.
+
+#define SERVE_EVENTS 64
+#define SERVE_BACKLOG 64
+#define SERVE_OUT_LIMIT (4 * 1024 * 1024) // Replies queued before a client's input is left unread
+#define SERVE_IN_LIMIT (SERVE_MAX_INSERT + 131072) // Input buffered, room for the largest request
+
+struct serveBuffer
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+struct serveClient
+{
+    int fd;
+    int eof;               // The client shut down its side, close once the replies are out
+    struct serveBuffer in;
+    struct serveBuffer out;
+    size_t in_used;        // Bytes at the front of in already answered
+    size_t out_sent;       // Bytes at the front of out already sent
+    uint64_t skip;         // Bytes of a refused insert still to be dropped as they come in
+};
+
+mfs_t *serve_images[SHELL_IMAGES];
+int serve_image_count = 0;
+int serve_changed[SHELL_IMAGES]; // Images written since the last commit
+volatile sig_atomic_t serve_stop = 0;
+
+void serve_signal(int sig)
+{
+  serve_stop = 1;
+}
+
+// Make room for extra more bytes. Returns 0 or -1 if out of memory.
+int buffer_reserve(struct serveBuffer *buf, size_t extra)
+{
+  if (buf->len + extra <= buf->size)
+  {
+    return 0;
+  }
+
+  size_t size = buf->size ? buf->size : 4096;
+  while (size < buf->len + extra)
+  {
+    size *= 2;
+  }
+  uint8_t *data = realloc(buf->data, size);
+  if (data == NULL)
+  {
+    return -1;
+  }
+  buf->data = data;
+  buf->size = size;
+  return 0;
+}
+
+// Queue a reply header with room for payload bytes after it. Returns the header, whose length
+// is then set to the bytes actually used, or NULL if out of memory.
+struct serveReply *reply_start(struct serveClient *client, uint32_t id, size_t payload)
+{
+  if (buffer_reserve(&client->out, sizeof(struct serveReply) + payload) == -1)
+  {
+    return NULL;
+  }
+  struct serveReply *reply = (struct serveReply *)(client->out.data + client->out.len);
+  reply->id = id;
+  reply->status = MFS_OK;
+  reply->length = 0;
+  return reply;
+}
+
+void reply_end(struct serveClient *client, struct serveReply *reply)
+{
+  client->out.len += sizeof(struct serveReply) + reply->length;
+}
+
+void fill_entry(struct serveEntry *entry, struct mfs_stat *st, size_t name_len)
+{
+  entry->size = st->size;
+  entry->blocks = st->blocks;
+  entry->extents = st->extents;
+  entry->attributes = st->attributes;
+  entry->name_len = name_len;
+  entry->reserved = 0;
+}
+
+// Store data as a new file. A file that can't be written whole is removed again. changed is
+// set once the file has been created, whether or not it stays.
+int serve_insert(mfs_t *fs, char *name, uint8_t *data, uint32_t length, int *changed)
+{
+  struct mfs_stat st;
+  int ret = mfs_stat(fs, name, &st);
+  if (ret == MFS_OK)
+  {
+    return MFS_EEXIST;
+  }
+  if (ret != MFS_ENOENT)
+  {
+    return ret;
+  }
+
+  int handle = mfs_open(fs, name, MFS_WRITE | MFS_CREATE);
+  if (handle < 0)
+  {
+    return handle;
+  }
+  *changed = 1;
+  ssize_t wrote = (length > 0) ? mfs_pwrite(fs, handle, data, length, 0) : 0;
+  mfs_close(fs, handle);
+  if (wrote < 0)
+  {
+    mfs_unlink(fs, name);
+    return wrote;
+  }
+  return MFS_OK;
+}
+
+// Reply with up to length bytes of a file from offset
+int serve_read(struct serveClient *client, struct serveReply **reply, mfs_t *fs, char *name,
+               uint32_t offset, uint32_t length)
+{
+  struct mfs_stat st;
+  int ret = mfs_stat(fs, name, &st);
+  if (ret != MFS_OK)
+  {
+    return ret;
+  }
+  if (offset >= st.size)
+  {
+    return MFS_OK;
+  }
+  if (length > st.size - offset)
+  {
+    length = st.size - offset;
+  }
+
+  uint32_t id = (*reply)->id;
+  *reply = reply_start(client, id, length);
+  if (*reply == NULL)
+  {
+    return MFS_ENOMEM;
+  }
+
+  int handle = mfs_open(fs, name, MFS_READ);
+  if (handle < 0)
+  {
+    return handle;
+  }
+  ssize_t got = mfs_pread(fs, handle, (uint8_t *)(*reply + 1), length, offset);
+  mfs_close(fs, handle);
+  if (got < 0)
+  {
+    return got;
+  }
+  (*reply)->length = got;
+  return MFS_OK;
+}
+
+int serve_list(struct serveClient *client, struct serveReply **reply, mfs_t *fs)
+{
+  uint32_t id = (*reply)->id;
+  char name[65];
+  struct mfs_stat st;
+  int pos = 0;
+  int ret;
+
+  while ((ret = mfs_readdir(fs, &pos, name, &st)) == MFS_OK)
+  {
+    size_t name_len = strlen(name);
+    size_t used = (*reply)->length;
+    *reply = reply_start(client, id, used + sizeof(struct serveEntry) + name_len);
+    if (*reply == NULL)
+    {
+      return MFS_ENOMEM;
+    }
+
+    uint8_t *payload = (uint8_t *)(*reply + 1) + used;
+    fill_entry((struct serveEntry *)payload, &st, name_len);
+    memcpy(payload + sizeof(struct serveEntry), name, name_len);
+    (*reply)->length = used + sizeof(struct serveEntry) + name_len;
+  }
+  return (ret == MFS_ENOENT) ? MFS_OK : ret;
+}
+
+// Answer one request. Returns -1 only if the reply couldn't be queued.
+int serve_request(struct serveClient *client, struct serveRequest *request, char *name,
+                  uint8_t *data)
+{
+  struct serveReply *reply = reply_start(client, request->id, 0);
+  if (reply == NULL)
+  {
+    return -1;
+  }
+
+  mfs_t *fs = NULL;
+  int ret = MFS_OK;
+  if (request->image >= serve_image_count)
+  {
+    ret = MFS_EINVAL;
+  }
+  else if (request->name_len > SERVE_MAX_NAME)
+  {
+    ret = MFS_ENAMETOOLONG;
+  }
+  else
+  {
+    fs = serve_images[request->image];
+  }
+
+  // Only requests that changed the image cost a journal commit
+  struct mfs_stat st;
+  int changed = 0;
+  if (fs != NULL)
+  {
+    switch (request->op)
+    {
+      case SERVE_INSERT:
+        ret = serve_insert(fs, name, data, request->length, &changed);
+        break;
+      case SERVE_RETRIEVE:
+        ret = serve_read(client, &reply, fs, name, 0, MAX_FILE_SIZE);
+        break;
+      case SERVE_READ:
+        ret = serve_read(client, &reply, fs, name, request->offset, request->length);
+        break;
+      case SERVE_LIST:
+        ret = serve_list(client, &reply, fs);
+        break;
+      case SERVE_DELETE:
+        ret = mfs_unlink(fs, name);
+        changed = (ret == MFS_OK);
+        break;
+      case SERVE_STAT:
+        ret = mfs_stat(fs, name, &st);
+        if (ret == MFS_OK)
+        {
+          reply = reply_start(client, request->id, sizeof(struct serveEntry));
+          if (reply == NULL)
+          {
+            return -1;
+          }
+          fill_entry((struct serveEntry *)(reply + 1), &st, 0);
+          reply->length = sizeof(struct serveEntry);
+        }
+        break;
+      default:
+        ret = MFS_EINVAL;
+        break;
+    }
+  }
+  if (changed)
+  {
+    serve_changed[request->image] = 1;
+  }
+
+  if (reply == NULL)
+  {
+    return -1;
+  }
+  reply->status = ret;
+  if (ret != MFS_OK)
+  {
+    reply->length = 0;
+  }
+  reply_end(client, reply);
+  return 0;
+}
+
+// Answer every complete request in the client's input while its queue of replies has room.
+// Returns how many were answered, or -1 if the client sent something that can't be a request.
+int serve_requests(struct serveClient *client)
+{
+  int answered = 0;
+  while (client->out.len - client->out_sent < SERVE_OUT_LIMIT)
+  {
+    size_t avail = client->in.len - client->in_used;
+    if (client->skip > 0)
+    {
+      size_t drop = (avail < client->skip) ? avail : client->skip;
+      client->in_used += drop;
+      client->skip -= drop;
+      if (client->skip > 0)
+      {
+        break;
+      }
+      continue;
+    }
+    if (avail < sizeof(struct serveRequest))
+    {
+      break;
+    }
+
+    // An insert too large to buffer is answered straight away and its bytes are dropped
+    struct serveRequest request;
+    memcpy(&request, client->in.data + client->in_used, sizeof(request));
+    if (request.op == SERVE_INSERT && request.length > SERVE_MAX_INSERT)
+    {
+      struct serveReply *reply = reply_start(client, request.id, 0);
+      if (reply == NULL)
+      {
+        return -1;
+      }
+      reply->status = MFS_EFBIG;
+      reply_end(client, reply);
+      client->in_used += sizeof(request);
+      client->skip = (uint64_t)request.name_len + request.length;
+      answered++;
+      continue;
+    }
+
+    size_t data_len = (request.op == SERVE_INSERT) ? request.length : 0;
+    size_t frame = sizeof(request) + request.name_len + data_len;
+    if (avail < frame)
+    {
+      break;
+    }
+
+    char name[SERVE_MAX_NAME + 1];
+    uint8_t *body = client->in.data + client->in_used + sizeof(request);
+    memset(name, 0, sizeof(name));
+    if (request.name_len <= SERVE_MAX_NAME)
+    {
+      memcpy(name, body, request.name_len);
+    }
+
+    if (serve_request(client, &request, name, body + request.name_len) == -1)
+    {
+      return -1;
+    }
+    client->in_used += frame;
+    answered++;
+  }
+
+  // Keep only the partial request left at the end
+  if (client->in_used == 0)
+  {
+    return answered;
+  }
+  memmove(client->in.data, client->in.data + client->in_used, client->in.len - client->in_used);
+  client->in.len -= client->in_used;
+  client->in_used = 0;
+  return answered;
+}
+
+// Read what the client has sent so far, up to SERVE_IN_LIMIT bytes. Returns -1 on a read
+// error.
+int serve_receive(struct serveClient *client)
+{
+  while (!client->eof && client->in.len < SERVE_IN_LIMIT)
+  {
+    if (buffer_reserve(&client->in, 65536) == -1)
+    {
+      return -1;
+    }
+    ssize_t got = read(client->fd, client->in.data + client->in.len,
+                       client->in.size - client->in.len);
+    if (got > 0)
+    {
+      client->in.len += got;
+    }
+    else if (got == 0)
+    {
+      client->eof = 1;
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      break;
+    }
+    else if (errno != EINTR)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Send as much of the queued replies as the socket takes. Returns -1 on a write error.
+int serve_send(struct serveClient *client)
+{
+  while (client->out_sent < client->out.len)
+  {
+    ssize_t sent = send(client->fd, client->out.data + client->out_sent,
+                        client->out.len - client->out_sent, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+      client->out_sent += sent;
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      return 0;
+    }
+    else if (errno != EINTR)
+    {
+      return -1;
+    }
+  }
+  client->out.len = 0;
+  client->out_sent = 0;
+  return 0;
+}
+
+void serve_drop(int epoll_fd, struct serveClient *client)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  free(client->in.data);
+  free(client->out.data);
+  free(client);
+}
+
+// Commit every image changed by the requests just answered and trim the block caches
+void serve_commit()
+{
+  for (int i = 0; i < serve_image_count; i++)
+  {
+    pthread_rwlock_wrlock(&serve_images[i]->image_lock);
+    if (serve_changed[i])
+    {
+      journal_commit(serve_images[i]);
+      serve_changed[i] = 0;
+    }
+    cache_trim(serve_images[i]);
+    pthread_rwlock_unlock(&serve_images[i]->image_lock);
+  }
+}
+
+void serve_accept(int epoll_fd, int listen_fd)
+{
+  int fd;
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+  {
+    struct serveClient *client = calloc(1, sizeof(struct serveClient));
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.ptr = client;
+    if (client == NULL || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+      free(client);
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+  }
+}
+
+// Work on one client the epoll loop woke up for. Returns -1 once it should be dropped.
+int serve_client(int epoll_fd, struct serveClient *client, uint32_t events)
+{
+  if (events & EPOLLERR)
+  {
+    return -1;
+  }
+  if ((events & (EPOLLIN | EPOLLHUP)) && serve_receive(client) == -1)
+  {
+    return -1;
+  }
+
+  // Once the replies are all sent, requests held back by a full queue can be answered
+  int answered;
+  do
+  {
+    answered = serve_requests(client);
+    if (answered == -1)
+    {
+      return -1;
+    }
+    serve_commit();
+    if (serve_send(client) == -1)
+    {
+      return -1;
+    }
+  } while (answered > 0 && client->out.len == 0);
+
+  if (client->eof && client->out.len == 0)
+  {
+    return -1;
+  }
+
+  struct epoll_event event = {.events = 0};
+  event.data.ptr = client;
+  if (!client->eof && client->out.len - client->out_sent < SERVE_OUT_LIMIT)
+  {
+    event.events |= EPOLLIN;
+  }
+  if (client->out.len > 0)
+  {
+    event.events |= EPOLLOUT;
+  }
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+// mfs --serve. Opens the images, answers requests on socket_path until SIGINT or SIGTERM,
+// then saves and closes the images. Returns 0, or 1 if the server could not be started.
+int serve(char *socket_path, char *images[], int count)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "mfs: Socket path %s is too long.\n", socket_path);
+    return 1;
+  }
+  if (count < 1 || count > SHELL_IMAGES)
+  {
+    fprintf(stderr, "mfs: --serve needs between 1 and %d images.\n", SHELL_IMAGES);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  for (serve_image_count = 0; serve_image_count < count; serve_image_count++)
+  {
+    int ret = mfs_mount(images[serve_image_count], 0, &serve_images[serve_image_count]);
+    if (ret != MFS_OK)
+    {
+      fprintf(stderr, "mfs: %s: %s.\n", images[serve_image_count], mfs_strerror(ret));
+      break;
+    }
+  }
+
+  // Requests are committed a round at a time by serve_commit instead of one by one
+  defer_savefs = 1;
+
+  int listen_fd = -1;
+  int epoll_fd = -1;
+  if (serve_image_count == count)
+  {
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SERVE_BACKLOG) == -1)
+    {
+      fprintf(stderr, "mfs: %s: %s.\n", socket_path, strerror(errno));
+    }
+    else
+    {
+      epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+  }
+
+  struct epoll_event event = {.events = EPOLLIN};
+  event.data.ptr = NULL;
+  if (epoll_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1)
+  {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+
+  // No SA_RESTART, so a signal breaks epoll_wait
+  struct sigaction stop = {.sa_handler = serve_signal};
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+
+  struct epoll_event events[SERVE_EVENTS];
+  while (epoll_fd != -1 && !serve_stop)
+  {
+    int n = epoll_wait(epoll_fd, events, SERVE_EVENTS, -1);
+    for (int i = 0; i < n; i++)
+    {
+      struct serveClient *client = events[i].data.ptr;
+      if (client == NULL)
+      {
+        serve_accept(epoll_fd, listen_fd);
+      }
+      else if (serve_client(epoll_fd, client, events[i].events) == -1)
+      {
+        serve_drop(epoll_fd, client);
+      }
+    }
+  }
+
+  // The connections still open are dropped with the process
+  int failed = (epoll_fd == -1);
+  if (listen_fd != -1)
+  {
+    close(listen_fd);
+    unlink(socket_path);
+  }
+  if (epoll_fd != -1)
+  {
+    close(epoll_fd);
+  }
+  for (int i = 0; i < serve_image_count; i++)
+  {
+    mfs_sync(serve_images[i]);
+    mfs_unmount(serve_images[i]);
+  }
+  return failed;
+}
@@ -0,0 +1,50 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+// The wire protocol of mfs --serve. Clients connect to its Unix socket and send requests, each
+// a serveRequest followed by name_len bytes of filename and, for SERVE_INSERT, length bytes of
+// file contents. Any number of requests can be sent without waiting, and the replies come back
+// in the same order, each a serveReply followed by length bytes of payload. Fields are in the
+// byte order of the host, since both ends are on it.
+
+#include <stdint.h>
+
+#define SERVE_INSERT 1   // Store the payload as a new file
+#define SERVE_RETRIEVE 2 // Reply with a whole file
+#define SERVE_READ 3     // Reply with length bytes of a file from offset
+#define SERVE_LIST 4     // Reply with a serveEntry and its name for every file, no name needed
+#define SERVE_DELETE 5   // Delete a file
+#define SERVE_STAT 6     // Reply with a serveEntry for a file, without the name after it
+
+#define SERVE_MAX_NAME 64 // Filenames longer than this are refused with MFS_ENAMETOOLONG
+
+#define SERVE_MAX_INSERT (16 * 1024 * 1024) // Larger inserts are refused with MFS_EFBIG
+
+struct serveRequest
+{
+    uint32_t id;       // Handed back in the reply
+    uint8_t op;        // SERVE_ code
+    uint8_t image;     // Which of the images given to --serve, in order from 0
+    uint16_t name_len;
+    uint32_t offset;   // SERVE_READ only
+    uint32_t length;   // Bytes wanted by SERVE_READ, bytes that follow a SERVE_INSERT
+};
+
+struct serveReply
+{
+    uint32_t id;
+    int32_t status;    // MFS_OK or an MFS_E code from libmfs.h
+    uint32_t length;   // Bytes of payload that follow
+};
+
+struct serveEntry
+{
+    uint32_t size;
+    uint32_t blocks;
+    uint32_t extents;
+    uint8_t attributes; // MFS_ATTR_ flags
+    uint8_t name_len;   // Bytes of name after the entry in a SERVE_LIST reply
+    uint16_t reserved;
+};
+
+#endif
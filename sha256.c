@@ -0,0 +1,245 @@
+#include "sha256.h"
+
+#include <string.h>
+
+// SHA-256 as laid out in FIPS 180-4, HMAC as in RFC 2104 and PBKDF2 as in RFC 8018.
+
+static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint32_t round_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+#define ROTR(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+
+// Hashes are defined as big-endian words whatever the host order
+static uint32_t load32_be(const uint8_t *in)
+{
+  return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+static void store32_be(uint8_t *out, uint32_t value)
+{
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static void compress(uint32_t state[8], const uint8_t block[SHA256_BLOCK])
+{
+  uint32_t w[64];
+  uint32_t x[8];
+  int i;
+
+  for (i = 0; i < 16; i++)
+  {
+    w[i] = load32_be(block + 4 * i);
+  }
+  for (; i < 64; i++)
+  {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  memcpy(x, state, sizeof(x));
+  for (i = 0; i < 64; i++)
+  {
+    uint32_t s1 = ROTR(x[4], 6) ^ ROTR(x[4], 11) ^ ROTR(x[4], 25);
+    uint32_t ch = (x[4] & x[5]) ^ (~x[4] & x[6]);
+    uint32_t t1 = x[7] + s1 + ch + round_k[i] + w[i];
+    uint32_t s0 = ROTR(x[0], 2) ^ ROTR(x[0], 13) ^ ROTR(x[0], 22);
+    uint32_t maj = (x[0] & x[1]) ^ (x[0] & x[2]) ^ (x[1] & x[2]);
+    memmove(x + 1, x, 7 * sizeof(uint32_t));
+    x[4] += t1;
+    x[0] = t1 + s0 + maj;
+  }
+  for (i = 0; i < 8; i++)
+  {
+    state[i] += x[i];
+  }
+}
+
+void sha256_init(struct sha256 *ctx)
+{
+  memcpy(ctx->state, initial, sizeof(initial));
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const uint8_t *data, size_t len)
+{
+  ctx->length += len;
+  while (len > 0)
+  {
+    size_t take = SHA256_BLOCK - ctx->used;
+    if (take > len)
+    {
+      take = len;
+    }
+    memcpy(ctx->pending + ctx->used, data, take);
+    ctx->used += take;
+    data += take;
+    len -= take;
+    if (ctx->used == SHA256_BLOCK)
+    {
+      compress(ctx->state, ctx->pending);
+      ctx->used = 0;
+    }
+  }
+}
+
+void sha256_final(struct sha256 *ctx, uint8_t out[SHA256_DIGEST])
+{
+  uint64_t bits = ctx->length * 8;
+  int i;
+
+  // a one bit, zeros up to the last 8 bytes of a block, then the length in bits
+  ctx->pending[ctx->used++] = 0x80;
+  if (ctx->used > SHA256_BLOCK - 8)
+  {
+    memset(ctx->pending + ctx->used, 0, SHA256_BLOCK - ctx->used);
+    compress(ctx->state, ctx->pending);
+    ctx->used = 0;
+  }
+  memset(ctx->pending + ctx->used, 0, SHA256_BLOCK - 8 - ctx->used);
+  store32_be(ctx->pending + SHA256_BLOCK - 8, bits >> 32);
+  store32_be(ctx->pending + SHA256_BLOCK - 4, bits);
+  compress(ctx->state, ctx->pending);
+
+  for (i = 0; i < 8; i++)
+  {
+    store32_be(out + 4 * i, ctx->state[i]);
+  }
+}
+
+// The hash states after the inner and outer padded keys, which every HMAC under the key
+// starts from
+static void hmac_start(const uint8_t *key, size_t key_len, struct sha256 *inner,
+                       struct sha256 *outer)
+{
+  uint8_t pad[SHA256_BLOCK];
+  uint8_t hashed[SHA256_DIGEST];
+  int i;
+
+  if (key_len > SHA256_BLOCK)
+  {
+    sha256_init(inner);
+    sha256_update(inner, key, key_len);
+    sha256_final(inner, hashed);
+    key = hashed;
+    key_len = SHA256_DIGEST;
+  }
+
+  memset(pad, 0x36, sizeof(pad));
+  for (i = 0; i < (int)key_len; i++)
+  {
+    pad[i] ^= key[i];
+  }
+  sha256_init(inner);
+  sha256_update(inner, pad, sizeof(pad));
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (i = 0; i < (int)key_len; i++)
+  {
+    pad[i] ^= key[i];
+  }
+  sha256_init(outer);
+  sha256_update(outer, pad, sizeof(pad));
+}
+
+static void hmac_finish(struct sha256 *inner, struct sha256 *outer, uint8_t out[SHA256_DIGEST])
+{
+  uint8_t hashed[SHA256_DIGEST];
+  sha256_final(inner, hashed);
+  sha256_update(outer, hashed, sizeof(hashed));
+  sha256_final(outer, out);
+}
+
+void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t len,
+                 uint8_t out[SHA256_DIGEST])
+{
+  struct sha256 inner;
+  struct sha256 outer;
+
+  hmac_start(key, key_len, &inner, &outer);
+  sha256_update(&inner, msg, len);
+  hmac_finish(&inner, &outer, out);
+}
+
+// Each block of output is the XOR of rounds chained HMACs of the salt and the block's
+// number. The padded passphrase is only hashed once, every round starts from its states.
+void pbkdf2_sha256(const uint8_t *pass, size_t pass_len, const uint8_t *salt, size_t salt_len,
+                   uint32_t rounds, uint8_t *out, size_t out_len)
+{
+  struct sha256 inner;
+  struct sha256 outer;
+  uint32_t number;
+
+  hmac_start(pass, pass_len, &inner, &outer);
+  for (number = 1; out_len > 0; number++)
+  {
+    struct sha256 in = inner;
+    struct sha256 on = outer;
+    uint8_t counter[4];
+    uint8_t u[SHA256_DIGEST];
+    uint8_t t[SHA256_DIGEST];
+    uint32_t round;
+    int i;
+
+    store32_be(counter, number);
+    sha256_update(&in, salt, salt_len);
+    sha256_update(&in, counter, sizeof(counter));
+    hmac_finish(&in, &on, u);
+    memcpy(t, u, sizeof(t));
+    for (round = 1; round < rounds; round++)
+    {
+      in = inner;
+      on = outer;
+      sha256_update(&in, u, sizeof(u));
+      hmac_finish(&in, &on, u);
+      for (i = 0; i < SHA256_DIGEST; i++)
+      {
+        t[i] ^= u[i];
+      }
+    }
+
+    size_t take = (out_len < SHA256_DIGEST) ? out_len : SHA256_DIGEST;
+    memcpy(out, t, take);
+    out += take;
+    out_len -= take;
+  }
+}
+
+// Check the hash against the "abc" vector in FIPS 180-4 and PBKDF2 against the first vector
+// in RFC 7914 section 11. Returns 1 if both match.
+int sha256_self_check()
+{
+  static const uint8_t expect_hash[16] = {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+                                          0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23};
+  static const uint8_t expect_key[16] = {0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f,
+                                         0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05};
+  struct sha256 ctx;
+  uint8_t out[64];
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, (const uint8_t *)"abc", 3);
+  sha256_final(&ctx, out);
+  if (memcmp(out, expect_hash, sizeof(expect_hash)) != 0)
+  {
+    return 0;
+  }
+
+  pbkdf2_sha256((const uint8_t *)"passwd", 6, (const uint8_t *)"salt", 4, 1, out, 64);
+  return memcmp(out, expect_key, sizeof(expect_key)) == 0;
+}
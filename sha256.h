@@ -0,0 +1,27 @@
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST 32 // Bytes of a SHA-256 hash
+#define SHA256_BLOCK 64  // Bytes the compression function takes at a time
+
+struct sha256
+{
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t pending[SHA256_BLOCK];
+    size_t used; // bytes of pending waiting for a whole block
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const uint8_t *data, size_t len);
+void sha256_final(struct sha256 *ctx, uint8_t out[SHA256_DIGEST]);
+void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t len,
+                 uint8_t out[SHA256_DIGEST]);
+void pbkdf2_sha256(const uint8_t *pass, size_t pass_len, const uint8_t *salt, size_t salt_len,
+                   uint32_t rounds, uint8_t *out, size_t out_len);
+int sha256_self_check();
+
+#endif
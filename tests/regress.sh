@@ -0,0 +1,122 @@
+#!/bin/sh
+# Regression checks that drive the mfs shell through sequences that once went wrong.
+#
+# usage: regress.sh path/to/mfs
+
+MFS=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+failures=0
+
+fail()
+{
+  echo "regress: $1"
+  failures=$((failures + 1))
+}
+
+# A deleted file that shared blocks with one since changed in place can't be brought back
+# holding the new bytes
+dedup_undelete_after_write()
+{
+  head -c 50000 /dev/urandom > t1
+  cp t1 t1copy
+  "$MFS" > log 2>&1 <<EOF
+createfs -d u.img
+insert t1
+insert t1copy
+delete t1
+encrypt t1copy x
+undelete t1
+retrieve t1 o_u
+quit
+EOF
+  if [ -e o_u ] && ! cmp -s t1 o_u
+  then
+    fail "undelete brought back a shared block written since"
+  fi
+  rm -f t1 t1copy o_u u.img u.img.jnl log
+}
+
+# An insert that fails for want of room leaves a deleted file in the inode it would have
+# taken recoverable
+failed_insert_keeps_deleted()
+{
+  head -c 4096 /dev/urandom > d
+  head -c 1000 /dev/zero > one
+  {
+    echo "createfs -t 0 -n 1024 -f 1000 f.img"
+    echo "insert d"
+    i=0
+    while [ $i -lt 700 ]
+    do
+      echo "insert one$i"
+      i=$((i + 1))
+    done
+    # every other block is freed so what is left takes more extents than fit
+    i=1
+    while [ $i -lt 660 ]
+    do
+      echo "delete one$i"
+      i=$((i + 2))
+    done
+    echo "delete d"
+    echo "df"
+    echo "savefs"
+    echo "quit"
+  } > cmds
+  i=0
+  while [ $i -lt 700 ]
+  do
+    ln one one$i
+    i=$((i + 1))
+  done
+  free=$("$MFS" < cmds 2>&1 | sed -n 's/.* \([0-9][0-9]*\) bytes free$/\1/p' | tail -1)
+  head -c "$free" /dev/zero > x
+  "$MFS" > log 2>&1 <<EOF
+open f.img
+insert x
+undelete d
+retrieve d o_d
+quit
+EOF
+  if ! grep -q "INSERT ERROR" log || ! cmp -s d o_d
+  then
+    fail "a failed insert lost the deleted file in its inode"
+  fi
+  rm -f d one* x o_d cmds log f.img f.img.jnl
+}
+
+# A source that reads back shorter than its size leaves no entry behind, and none of the blocks
+# it was given. sysfs files claim a page and hold a few bytes.
+unreadable_insert_leaves_nothing()
+{
+  [ -r /sys/kernel/uevent_seqnum ] || return
+  ln -s /sys/kernel/uevent_seqnum short
+  "$MFS" > log 2>&1 <<EOF
+createfs s.img
+df
+insert-many short
+insert short
+list
+df
+quit
+EOF
+  if grep -q "^\(mfs> \)*short$" log || [ "$(grep -c "bytes free" log)" -ne 2 ] ||
+     [ "$(grep "bytes free" log | sed 's/.* \([0-9]*\) bytes free/\1/' | sort -u | wc -l)" -ne 1 ]
+  then
+    fail "a source that couldn't be read was left in the image"
+  fi
+  rm -f short s.img s.img.jnl log
+}
+
+dedup_undelete_after_write
+failed_insert_keeps_deleted
+unreadable_insert_leaves_nothing
+
+if [ "$failures" -gt 0 ]
+then
+  echo "regress: $failures failures"
+  exit 1
+fi
+echo "regress: ok"
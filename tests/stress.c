@@ -0,0 +1,296 @@
+// Stress test for the library's locking. Writers, readers, creators and unlinkers all work on
+// one image at once and every byte read back is checked against what should be there, then
+// the image is mounted again and checked once more.
+//
+// usage: stress [image [map]]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmfs.h"
+
+#define WRITERS 16
+#define READERS 6
+#define SHARERS 8
+#define ROUNDS 40
+#define CHUNK 3000
+#define CHUNKS 8
+#define FIXED_SIZE 20000
+#define SLICE 4096
+
+static mfs_t *fs;
+static int failures;
+static int done;
+
+static void fail(const char *what, const char *name, long value)
+{
+  fprintf(stderr, "stress: %s %s (%ld)\n", what, name, value);
+  __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+}
+
+// The byte a file written in round round holds at offset
+static uint8_t pattern(long id, int round, uint32_t offset)
+{
+  return (uint8_t)(id * 131 + round * 17 + offset % 251);
+}
+
+static int check_bytes(const uint8_t *buf, size_t len, long id, int round, uint32_t offset)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+  {
+    if (buf[i] != pattern(id, round, offset + i))
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Each writer owns a file it creates, fills a chunk at a time in a shuffled order, reads
+// back, and now and then unlinks so the next round creates it again
+static void *writer(void *arg)
+{
+  long id = (long)arg;
+  char name[32];
+  uint8_t buf[CHUNK];
+  uint8_t back[CHUNK];
+  unsigned seed = id + 1;
+  int round;
+
+  snprintf(name, sizeof(name), "w%ld", id);
+  for (round = 0; round < ROUNDS; round++)
+  {
+    int handle = mfs_open(fs, name, MFS_READ | MFS_WRITE | MFS_CREATE | MFS_TRUNCATE);
+    if (handle < 0)
+    {
+      fail("open", name, handle);
+      return NULL;
+    }
+
+    int start = rand_r(&seed) % CHUNKS;
+    int k;
+    for (k = 0; k < CHUNKS; k++)
+    {
+      uint32_t offset = ((start + k * 3) % CHUNKS) * CHUNK;
+      uint32_t i;
+      for (i = 0; i < CHUNK; i++)
+      {
+        buf[i] = pattern(id, round, offset + i);
+      }
+      ssize_t ret = mfs_pwrite(fs, handle, buf, CHUNK, offset);
+      if (ret != CHUNK)
+      {
+        fail("pwrite", name, ret);
+      }
+    }
+    for (k = 0; k < CHUNKS; k++)
+    {
+      ssize_t ret = mfs_pread(fs, handle, back, CHUNK, k * CHUNK);
+      if (ret != CHUNK || check_bytes(back, CHUNK, id, round, k * CHUNK) == -1)
+      {
+        fail("pread", name, ret);
+      }
+    }
+    mfs_close(fs, handle);
+
+    struct mfs_stat st;
+    int ret = mfs_stat(fs, name, &st);
+    if (ret != MFS_OK || st.size != CHUNK * CHUNKS)
+    {
+      fail("stat", name, ret);
+    }
+    if (round % 5 == 4 || round == ROUNDS - 1)
+    {
+      ret = mfs_unlink(fs, name);
+      if (ret != MFS_OK)
+      {
+        fail("unlink", name, ret);
+      }
+      if (mfs_stat(fs, name, &st) != MFS_ENOENT)
+      {
+        fail("still there", name, 0);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Readers keep checking a file nobody changes while the others churn around it
+static void *reader(void *arg)
+{
+  uint8_t buf[SLICE];
+  (void)arg;
+
+  while (!__atomic_load_n(&done, __ATOMIC_RELAXED))
+  {
+    int handle = mfs_open(fs, "fixed", MFS_READ);
+    if (handle < 0)
+    {
+      fail("open", "fixed", handle);
+      return NULL;
+    }
+    uint32_t offset;
+    for (offset = 0; offset < FIXED_SIZE; offset += SLICE)
+    {
+      ssize_t ret = mfs_pread(fs, handle, buf, SLICE, offset);
+      size_t want = (FIXED_SIZE - offset < SLICE) ? FIXED_SIZE - offset : SLICE;
+      if (ret != (ssize_t)want || check_bytes(buf, want, 0, 0, offset) == -1)
+      {
+        fail("pread", "fixed", ret);
+      }
+    }
+    mfs_close(fs, handle);
+  }
+  return NULL;
+}
+
+// Sharers each write their own slice of one file through handles of their own, which
+// grows it from several threads at once
+static void *sharer(void *arg)
+{
+  long id = (long)arg;
+  uint8_t buf[SLICE];
+  uint32_t offset = id * SLICE;
+  uint32_t i;
+
+  int handle = mfs_open(fs, "common", MFS_READ | MFS_WRITE | MFS_CREATE);
+  if (handle < 0)
+  {
+    fail("open", "common", handle);
+    return NULL;
+  }
+  for (i = 0; i < SLICE; i++)
+  {
+    buf[i] = pattern(-1, 0, offset + i);
+  }
+  ssize_t ret = mfs_pwrite(fs, handle, buf, SLICE, offset);
+  if (ret != SLICE)
+  {
+    fail("pwrite", "common", ret);
+  }
+  mfs_close(fs, handle);
+  return NULL;
+}
+
+static void *syncer(void *arg)
+{
+  (void)arg;
+  while (!__atomic_load_n(&done, __ATOMIC_RELAXED))
+  {
+    int ret = mfs_sync(fs);
+    if (ret != MFS_OK)
+    {
+      fail("sync", "", ret);
+    }
+    usleep(1000);
+  }
+  return NULL;
+}
+
+static void check_common(void)
+{
+  uint8_t *buf = malloc(SHARERS * SLICE);
+  int handle = mfs_open(fs, "common", MFS_READ);
+  ssize_t ret = (handle < 0 || buf == NULL) ? handle : mfs_pread(fs, handle, buf,
+                                                                 SHARERS * SLICE, 0);
+  if (ret != SHARERS * SLICE || check_bytes(buf, SHARERS * SLICE, -1, 0, 0) == -1)
+  {
+    fail("contents", "common", ret);
+  }
+  if (handle >= 0)
+  {
+    mfs_close(fs, handle);
+  }
+  free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *image = (argc > 1) ? argv[1] : "stress.img";
+  int flags = (argc > 2 && strcmp(argv[2], "map") == 0) ? MFS_MAP : 0;
+  char journal[4096];
+  uint8_t fixed[FIXED_SIZE];
+  pthread_t churn[WRITERS + SHARERS];
+  pthread_t watch[READERS + 1];
+  long i;
+
+  snprintf(journal, sizeof(journal), "%s.jnl", image);
+  unlink(image);
+  unlink(journal);
+  int ret = mfs_create(image, flags, &fs);
+  if (ret != MFS_OK)
+  {
+    fprintf(stderr, "stress: create %s: %s\n", image, mfs_strerror(ret));
+    return 1;
+  }
+
+  int handle = mfs_open(fs, "fixed", MFS_WRITE | MFS_CREATE);
+  for (i = 0; i < FIXED_SIZE; i++)
+  {
+    fixed[i] = pattern(0, 0, i);
+  }
+  if (handle < 0 || mfs_pwrite(fs, handle, fixed, FIXED_SIZE, 0) != FIXED_SIZE)
+  {
+    fail("write", "fixed", handle);
+  }
+  mfs_close(fs, handle);
+
+  for (i = 0; i < READERS; i++)
+  {
+    pthread_create(&watch[i], NULL, reader, NULL);
+  }
+  pthread_create(&watch[READERS], NULL, syncer, NULL);
+  for (i = 0; i < WRITERS; i++)
+  {
+    pthread_create(&churn[i], NULL, writer, (void *)i);
+  }
+  for (i = 0; i < SHARERS; i++)
+  {
+    pthread_create(&churn[WRITERS + i], NULL, sharer, (void *)i);
+  }
+  for (i = 0; i < WRITERS + SHARERS; i++)
+  {
+    pthread_join(churn[i], NULL);
+  }
+  __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < READERS + 1; i++)
+  {
+    pthread_join(watch[i], NULL);
+  }
+  check_common();
+  mfs_unmount(fs);
+
+  // everything that should have lasted is still there once the image is read back
+  ret = mfs_mount(image, flags, &fs);
+  if (ret != MFS_OK)
+  {
+    fprintf(stderr, "stress: mount %s: %s\n", image, mfs_strerror(ret));
+    return 1;
+  }
+  for (i = 0; i < WRITERS; i++)
+  {
+    char name[32];
+    struct mfs_stat st;
+    snprintf(name, sizeof(name), "w%ld", i);
+    if (mfs_stat(fs, name, &st) != MFS_ENOENT)
+    {
+      fail("left behind", name, 0);
+    }
+  }
+  check_common();
+  mfs_unmount(fs);
+  unlink(image);
+  unlink(journal);
+
+  if (failures > 0)
+  {
+    printf("stress: %d failures\n", failures);
+    return 1;
+  }
+  printf("stress: ok\n");
+  return 0;
+}